@@ -1,12 +1,23 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <x86intrin.h>
 
 typedef uint8_t  ui8;
 typedef uint16_t ui16;
 typedef uint32_t ui32;
+typedef uint64_t ui64;
 typedef bool     u1;
 
 typedef float    f32;
@@ -17,21 +28,24 @@ typedef int16_t  i16;
 typedef int      i32;
 typedef int64_t  i64;
 
-char*            registerToRegisterEncoding16[] = {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di"};
-char*            registerToRegisterEncoding8[]  = {"al", "cl", "dl", "bl", "ah", "ch", "dh", "bh"};
-char*            registerMemoryEncoding0[]      = {"bx + si", "bx + di", "bp + si", "bp + di", "si", "di", "", "bx"};
-char*            registerMemoryEncoding1[]      = {"bx + si", "bx + di", "bp + si", "bp + di", "si", "di", "bp", "bx"};
+#define ArrayCount(Array) (sizeof(Array) / sizeof((Array)[0]))
+
+char* registerMemoryEncoding1[] = {"bx + si", "bx + di", "bp + si", "bp + di", "si", "di", "bp", "bx"};
 
 #define CF                         0
 #define PF                         1
 #define AF                         2
 #define ZF                         3
 #define SF                         4
-#define GETZF(flags)               ((flags >> (ZF - 1)) & 0b1)
-#define GETSF(flags)               ((flags >> (SF - 1)) & 0b1)
+#define OF                         5
+#define DF                         6
+#define GETFLAG(flags, flag)       ((flags >> flag) & 0b1)
+#define GETZF(flags)               GETFLAG(flags, ZF)
+#define GETSF(flags)               GETFLAG(flags, SF)
 
-#define SETZF(flags)               (flags = flags | 0b100)
-#define SETSF(flags)               (flags = flags | 0b1000)
+#define SETFLAG(flags, flag)       (flags = flags | (1 << flag))
+#define SETZF(flags)               SETFLAG(flags, ZF)
+#define SETSF(flags)               SETFLAG(flags, SF)
 
 #define GET_AX(cpu)                (cpu->registers[0])
 #define GET_CX(cpu)                (cpu->registers[1])
@@ -50,6 +64,13 @@ enum Operation
   ADD,
   SUB,
   CMP,
+  MOVS,
+  CMPS,
+  STOS,
+  LODS,
+  SCAS,
+  CLD,
+  STD,
   JE,
   JL,
   JLE,
@@ -101,29 +122,45 @@ struct Immediate
 };
 typedef struct Immediate Immediate;
 
+// Resolved from the ModRM byte at decode time, the address is registers[base] + registers[index] + displacement
 struct EffectiveAddress
 {
-  ui8       mod;
-  ui8       rm;
-  Immediate immediate;
+  ui16 displacement;
+  ui8  mod;
+  ui8  rm;
+  ui8  base;
+  ui8  index;
+  ui8  cycles;
+  bool wide;
 };
 typedef struct EffectiveAddress EffectiveAddress;
 
 #define NUMBER_OF_REGISTERS 8
+// The register file has one extra slot that is always zero, effective addresses without a base or index point at it
+#define ZERO_REGISTER       NUMBER_OF_REGISTERS
+#define REGISTER_FILE_SIZE  (NUMBER_OF_REGISTERS + 1)
+
+// The 8-bit registers alias the halves of the first four words, ah is bytes[1] and bh is bytes[7].
+// Decoding resolves every register operand to its slot, so access is a plain load or store without shifts or masks
+union RegisterFile
+{
+  ui16 words[REGISTER_FILE_SIZE];
+  ui8  bytes[REGISTER_FILE_SIZE * 2];
+};
+typedef union RegisterFile RegisterFile;
+_Static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "RegisterFile expects the low half of a word at the lower address");
 char* registerNames[NUMBER_OF_REGISTERS] = {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di"};
 
-void  debugFlags(ui8 flags)
+const char* flagNames[] = {"C", "P", "A", "Z", "S", "O", "D"};
+
+void        debugFlags(ui8 flags)
 {
-  bool f = false;
-  if (GETZF(flags))
-  {
-    printf(" Z");
-    f = true;
-  }
-  if (GETSF(flags))
+  for (i32 flag = CF; flag <= DF; flag++)
   {
-    printf(" S");
-    f = true;
+    if (GETFLAG(flags, flag))
+    {
+      printf(" %s", flagNames[flag]);
+    }
   }
 }
 void debugRegisters(ui16* registers)
@@ -150,10 +187,12 @@ enum RegisterType
 };
 typedef enum RegisterType RegisterType;
 
+// 16-bit registers are words[type], 8-bit ones are bytes[index]
 struct Register
 {
   RegisterType  type;
   ui8           offset;
+  ui8           index;
   ImmediateSize size;
 };
 typedef struct Register Register;
@@ -170,23 +209,98 @@ struct Operand
 };
 typedef struct Operand Operand;
 
+enum RepPrefix
+{
+  REP_NONE,
+  REP_E,
+  REP_NE
+};
+typedef enum RepPrefix RepPrefix;
+
 struct Instruction
 {
   Operation op;
   Operand   operands[2];
+  RepPrefix rep;
+  bool      wide;
+  ui8       size;
 };
 typedef struct Instruction Instruction;
 
-struct CPU
+static inline bool isJump(Operation op)
+{
+  return op >= JE;
+}
+
+static inline bool isStringOperation(Operation op)
+{
+  return op >= MOVS && op <= SCAS;
+}
+
+#define MAX_INSTRUCTION_LENGTH 6
+
+// An add, sub or cmp on 16-bit registers followed by a jnz is marked fused when it is decoded, the untraced
+// interpreter then runs both as one step. The jnz keeps its own entry for code that jumps straight to it
+struct DecodedInstruction
 {
-  ui16*       registers;
-  ui8         flags;
-  ui8         prevFlags;
   Instruction instruction;
-  ui8*        start;
-  ui8*        prev;
-  ui16        cycles;
-  ui8         memory[1024 * 1024];
+  ui8         size;
+  bool        valid;
+  bool        fusedJnz;
+  ui8         fusedSize;
+  ui8         fusedCycles;
+  i8          displacement;
+};
+typedef struct DecodedInstruction DecodedInstruction;
+
+struct Cycles
+{
+  ui32 normal;
+  ui32 ea;
+  ui32 penalty;
+};
+typedef struct Cycles Cycles;
+
+#define MEMORY_SIZE (1024 * 1024)
+#define PAGE_SHIFT  12
+#define PAGE_SIZE   (1 << PAGE_SHIFT)
+#define PAGE_COUNT  (MEMORY_SIZE >> PAGE_SHIFT)
+#define DIRTY_WORDS (PAGE_COUNT / 64)
+
+struct CPU
+{
+  ui16*                 registers;
+  RegisterFile*         registerFile;
+  ui8                   flags;
+  ui8                   prevFlags;
+  bool                  flagsPending;
+  bool                  flagsWide;
+  Operation             flagsOp;
+  ui16                  flagsLeft;
+  ui16                  flagsRight;
+  ui16                  flagsResult;
+  Instruction           instruction;
+  ui8*                  start;
+  ui8*                  prev;
+  ui64                  cycles;
+  ui64                  fusedExecuted;
+  bool                  fuse;
+  DecodedInstruction*   decoded;
+  ui8*                  image;
+  ui32                  codeBase;
+  ui32                  codeLength;
+  ui32                  codeVersion;
+  bool                  halted;
+  bool                  bus8088;
+  Cycles                stringCycles;
+  ui64*                 profileCycles;
+  ui64*                 profileCounts;
+  struct TraceRing*     traceRing;
+  struct WriteLog*      writeLog;
+  struct TraceRecorder* recorder;
+  struct MemoryWatch*   watch;
+  ui64                  dirtyPages[DIRTY_WORDS];
+  ui8*                  memory;
 };
 typedef struct CPU CPU;
 
@@ -212,415 +326,141 @@ void               parseRegister(Register* regis, ui8 reg, bool w)
     regis->size   = EIGHT;
     regis->offset = 8;
   }
+  regis->index = regis->type * 2 + (regis->offset == 8);
 }
-const char* opToString[]  = {"mov", "add", "sub", "cmp", "je", "jl", "jle", "jb", "jbe", "jp", "jo", "js", "jnz", "jnl", "jnle", "jnb", "jnbe", "jnp", "jno", "jns", "loop", "loopz", "loopnz", "jcxz"};
+const char* opToString[]  = {"mov", "add", "sub", "cmp", "movs", "cmps", "stos", "lods", "scas", "cld", "std", "je", "jl", "jle", "jb", "jbe", "jp", "jo", "js", "jnz", "jnl", "jnle", "jnb", "jnbe", "jnp", "jno", "jns", "loop", "loopz", "loopnz", "jcxz"};
 
 const char* regToString[] = {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di"};
 const char* regToStringHigh[] = {"ah", "ch", "dh", "bh"};
 const char* regToStringLow[]  = {"al", "cl", "dl", "bl"};
 
-void        debugRegister(Register reg)
+// Disassembly text is rendered straight into a caller supplied buffer, none of these touch stdio
+static inline char* formatString(char* out, const char* string)
 {
-  if (reg.size == SIXTEEN)
-  {
-    printf("%s", regToString[reg.type]);
-  }
-  else if (reg.offset == 8)
-  {
-    printf("%s", regToStringHigh[reg.type]);
-  }
-  else
+  while (*string)
   {
-    printf("%s", regToStringLow[reg.type]);
+    *out++ = *string++;
   }
+  return out;
 }
 
-void debugEffectiveAddress(EffectiveAddress effectiveAddress)
-{
-  printf("[");
-  if (effectiveAddress.mod == 0 && effectiveAddress.rm == 6)
-  {
-    printf("%d", effectiveAddress.immediate.size == EIGHT ? effectiveAddress.immediate.immediate8 : effectiveAddress.immediate.immediate16);
-  }
-  else
-  {
-    printf("%s", registerMemoryEncoding1[effectiveAddress.rm]);
-    if (effectiveAddress.immediate.size == ZERO)
-    {
-    }
-    else if (effectiveAddress.mod == 1)
-    {
-      printf(" + %d", effectiveAddress.immediate.immediate8);
-    }
-    else
-    {
-      printf(" + %d", effectiveAddress.immediate.immediate16);
-    }
-  }
-  printf("]");
-}
-void debugOperand(Operand operand)
+static inline char* formatNumber(char* out, i32 value)
 {
-  switch (operand.type)
-  {
-  case EFFECTIVEADDRESS:
-  {
-    debugEffectiveAddress(operand.effectiveAddress);
-    break;
-  }
-  case REGISTER:
+  char digits[12];
+  i32  count = 0;
+  if (value < 0)
   {
-    debugRegister(operand.reg);
-    break;
+    *out++ = '-';
+    value  = -value;
   }
-  case ACCUMULATOR:
+  do
   {
-    printf("ax");
-    break;
-  }
-  case IMMEDIATE:
+    digits[count++] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  while (count)
   {
-    printf("%d", operand.immediate.size == EIGHT ? operand.immediate.immediate8 : operand.immediate.immediate16);
-  }
+    *out++ = digits[--count];
   }
+  return out;
 }
 
-void debugIp(CPU* cpu, ui8* buffer)
-{
-  printf("\t\tip:0x%04x->0x%04x(%d)", (int)(cpu->prev - cpu->start), (i32)(buffer - cpu->start), (i32)(buffer - cpu->start));
-}
-static inline ui16 calculateEffectiveAddress(CPU* cpu, ui8 rm)
-{
-  switch (rm)
-  {
-  case 0:
-  {
-    return GET_BX(cpu) + GET_SI(cpu);
-  }
-  case 1:
-  {
-    return GET_BX(cpu) + GET_DI(cpu);
-  }
-  case 2:
-  {
-    return GET_BP(cpu) + GET_SI(cpu);
-  }
-  case 3:
-  {
-    return GET_BP(cpu) + GET_DI(cpu);
-  }
-  case 4:
-  {
-    return GET_SI(cpu);
-  }
-  case 5:
-  {
-    return GET_DI(cpu);
-  }
-  case 6:
-  {
-    return GET_BP(cpu);
-  }
-  case 7:
-  {
-    return GET_BX(cpu);
-  }
-  default:
-  {
-    printf("HUH\n");
-    exit(1);
-  }
-  }
-}
-static ui16 getEffectiveAddress(CPU* cpu, EffectiveAddress effectiveAddress)
+static char* formatRegister(char* out, Register reg)
 {
-  if (effectiveAddress.mod == 0 && effectiveAddress.rm == 6)
-  {
-    return IMMEDIATE_VALUE(effectiveAddress.immediate);
-  }
-  ui16 effective = calculateEffectiveAddress(cpu, effectiveAddress.rm);
-  if (effectiveAddress.mod == 0)
-  {
-    return effective;
-  }
-  if (effectiveAddress.mod == 1)
+  if (reg.size == SIXTEEN)
   {
-    return effective + effectiveAddress.immediate.immediate8;
+    return formatString(out, regToString[reg.type]);
   }
-
-  return effective + effectiveAddress.immediate.immediate16;
-}
-
-struct Cycles
-{
-  ui8 normal;
-  ui8 ea;
-  ui8 penalty;
-};
-typedef struct Cycles Cycles;
-
-ui8                   effectiveAddressNoDisplacementTable[8] = {
-    7, // BX + SI
-    8, // BX + DI
-    8, // BP + SI
-    7, // BP + DI
-    5, // SI
-    5, // DI
-    6, // DIRECT ADDRESS
-    5, // BX
-};
-ui8 effectiveAddressDisplacementTable[8] = {
-
-    11, // BX + SI + DISP
-    12, // BX + DI + DISP
-    12, // BP + SI + DISP
-    11, // BP + DI + DISP
-    9,  // SI + DISP
-    9,  // DI + DISP
-    9,  // BP + DISP
-    9,  // BX + DISP
-};
-
-void calcPenalty(CPU* cpu, Cycles* cycles, ui8 transfers, EffectiveAddress effectiveAddress)
-{
-  if (effectiveAddress.immediate.size == SIXTEEN && getEffectiveAddress(cpu, effectiveAddress) % 2 != 0)
+  else if (reg.offset == 8)
   {
-    cycles->penalty += transfers * 4;
+    return formatString(out, regToStringHigh[reg.type]);
   }
+  return formatString(out, regToStringLow[reg.type]);
 }
 
-ui8 calcEffectiveAddressCycles(CPU* cpu, EffectiveAddress effectiveAddress)
+static char* formatEffectiveAddress(char* out, EffectiveAddress effectiveAddress)
 {
-  if (effectiveAddress.mod == 1)
+  *out++ = '[';
+  if (effectiveAddress.mod == 0 && effectiveAddress.rm == 6)
   {
-    return effectiveAddressNoDisplacementTable[effectiveAddress.rm];
+    out = formatNumber(out, effectiveAddress.displacement);
   }
-  else if (effectiveAddress.immediate.size == ZERO)
+  else
   {
-    if (effectiveAddress.rm == 6)
+    out = formatString(out, registerMemoryEncoding1[effectiveAddress.rm]);
+    if (effectiveAddress.mod != 0)
     {
-      return 5;
+      out = formatString(out, " + ");
+      out = formatNumber(out, effectiveAddress.displacement);
     }
-    return effectiveAddressNoDisplacementTable[effectiveAddress.rm];
   }
-  return effectiveAddressDisplacementTable[effectiveAddress.rm];
+  *out++ = ']';
+  return out;
 }
 
-Cycles calcCyclesAdd(CPU* cpu, Operand* operands)
+static char* formatOperand(char* out, Operand operand)
 {
-  Cycles cycles;
-  cycles.normal  = 0;
-  cycles.ea      = 0;
-  cycles.penalty = 0;
-  switch (operands[0].type)
+  switch (operand.type)
   {
-  case REGISTER:
+  case EFFECTIVEADDRESS:
   {
-    if (operands[1].type == REGISTER)
-    {
-      cycles.normal = 3;
-    }
-    else if (operands[1].type == EFFECTIVEADDRESS)
-    {
-      cycles.normal = 9;
-      cycles.ea     = calcEffectiveAddressCycles(cpu, operands[1].effectiveAddress);
-      calcPenalty(cpu, &cycles, 1, operands[1].effectiveAddress);
-    }
-    else if (operands[1].type == IMMEDIATE)
-    {
-      cycles.normal = 4;
-    }
-    else
-    {
-      printf("HUH\n");
-      exit(1);
-    }
-    break;
+    return formatEffectiveAddress(out, operand.effectiveAddress);
   }
-  case IMMEDIATE:
+  case REGISTER:
   {
-    printf("HUH\n");
-    exit(1);
+    return formatRegister(out, operand.reg);
   }
-  case EFFECTIVEADDRESS:
+  case ACCUMULATOR:
   {
-    if (operands[1].type == REGISTER)
-    {
-      cycles.normal = 16;
-      cycles.ea     = calcEffectiveAddressCycles(cpu, operands[0].effectiveAddress);
-      calcPenalty(cpu, &cycles, 2, operands[0].effectiveAddress);
-    }
-    else if (operands[1].type == IMMEDIATE)
-    {
-      cycles.normal = 17;
-      cycles.ea     = calcEffectiveAddressCycles(cpu, operands[0].effectiveAddress);
-      calcPenalty(cpu, &cycles, 2, operands[0].effectiveAddress);
-    }
-    else
-    {
-      printf("HUH\n");
-      exit(1);
-    }
-    break;
+    return formatString(out, "ax");
   }
-  case ACCUMULATOR:
+  case IMMEDIATE:
   {
-    cycles.normal = 4;
+    return formatNumber(out, IMMEDIATE_VALUE(operand.immediate));
   }
   }
-  return cycles;
+  return out;
 }
 
-Cycles calcCyclesMov(CPU* cpu, Operand* operands)
+#define MAX_INSTRUCTION_TEXT 48
+
+// Writes at most MAX_INSTRUCTION_TEXT bytes without a terminator and returns the end of the text
+char* formatInstruction(char* out, Instruction* instruction)
 {
-  Cycles cycles;
-  cycles.normal  = 0;
-  cycles.ea      = 0;
-  cycles.penalty = 0;
-  switch (operands[0].type)
-  {
-  case REGISTER:
+  if (isStringOperation(instruction->op))
   {
-    if (operands[1].type == REGISTER)
-    {
-      cycles.normal = 2;
-    }
-    else if (operands[1].type == EFFECTIVEADDRESS)
-    {
-      cycles.normal = 8;
-      cycles.ea     = calcEffectiveAddressCycles(cpu, operands[1].effectiveAddress);
-      calcPenalty(cpu, &cycles, 1, operands[1].effectiveAddress);
-    }
-    else if (operands[1].type == IMMEDIATE)
-    {
-      cycles.normal = 4;
-    }
-    else
+    bool compares = instruction->op == CMPS || instruction->op == SCAS;
+    if (instruction->rep != REP_NONE)
     {
-      printf("HUH\n");
-      exit(1);
+      out = formatString(out, instruction->rep == REP_NE ? "repne " : compares ? "repe " : "rep ");
     }
-    break;
-  }
-  case IMMEDIATE:
-  {
-    printf("HUH\n");
-    exit(1);
+    out    = formatString(out, opToString[instruction->op]);
+    *out++ = instruction->wide ? 'w' : 'b';
+    return out;
   }
-  case EFFECTIVEADDRESS:
+  out = formatString(out, opToString[instruction->op]);
+  if (instruction->op == CLD || instruction->op == STD)
   {
-    if (operands[1].type == REGISTER)
-    {
-      cycles.normal = 9;
-      cycles.ea     = calcEffectiveAddressCycles(cpu, operands[0].effectiveAddress);
-      calcPenalty(cpu, &cycles, 1, operands[0].effectiveAddress);
-    }
-    else if (operands[1].type == IMMEDIATE)
-    {
-      cycles.normal = 10;
-      cycles.ea     = calcEffectiveAddressCycles(cpu, operands[0].effectiveAddress);
-      calcPenalty(cpu, &cycles, 1, operands[0].effectiveAddress);
-    }
-    else if (operands[1].type == ACCUMULATOR)
-    {
-      cycles.normal = 10;
-    }
-    else
-    {
-      printf("HUH\n");
-      exit(1);
-    }
-    break;
+    return out;
   }
-  case ACCUMULATOR:
+  *out++ = ' ';
+  if (isJump(instruction->op))
   {
-    cycles.normal = 10;
-  }
+    return formatNumber(out, *(i8*)&instruction->operands[0].immediate.immediate8);
   }
-  return cycles;
+  out    = formatOperand(out, instruction->operands[0]);
+  *out++ = ',';
+  *out++ = ' ';
+  return formatOperand(out, instruction->operands[1]);
 }
 
-Cycles calcCycles(CPU* cpu)
+void debugIp(CPU* cpu, ui8* buffer)
 {
-  switch (cpu->instruction.op)
-  {
-  case MOV:
-  {
-    return calcCyclesMov(cpu, cpu->instruction.operands);
-  }
-  case ADD:
-  {
-    return calcCyclesAdd(cpu, cpu->instruction.operands);
-  }
-  case SUB:
-  {
-  }
-  case CMP:
-  {
-  }
-  default:
-  {
-  }
-  }
-  return (Cycles){.normal = 0, .ea = 0};
+  printf("\t\tip:0x%04x->0x%04x(%d)", (int)(cpu->prev - cpu->start), (i32)(buffer - cpu->start), (i32)(buffer - cpu->start));
 }
-
-void debugInstruction(CPU* cpu, ui8* buffer)
+static inline ui16 getEffectiveAddress(CPU* cpu, EffectiveAddress effectiveAddress)
 {
-
-  printf("%s ", opToString[cpu->instruction.op]);
-  switch (cpu->instruction.op)
-  {
-  case MOV:
-  {
-  }
-  case ADD:
-  {
-  }
-  case SUB:
-  {
-  }
-  case CMP:
-  {
-    debugOperand(cpu->instruction.operands[0]);
-    printf(", ");
-    debugOperand(cpu->instruction.operands[1]);
-    printf("; ");
-    break;
-  }
-
-  default:
-  {
-    printf("%d;", *(i8*)&cpu->instruction.operands[0].immediate.immediate8);
-    break;
-  }
-  }
-  // debugIp(cpu, buffer);
-  // if (cpu->flags != cpu->prevFlags)
-  // {
-  //   printf("\t\tflags:");
-  //   debugFlags(cpu->prevFlags);
-  //   printf("->");
-  //   debugFlags(cpu->flags);
-  // }
-  // printf("\n");
-  Cycles cycles = calcCycles(cpu);
-  printf("\tcycles: %d", cycles.normal + cycles.ea);
-  if (cycles.ea || cycles.penalty)
-  {
-    printf("(%d", cycles.normal);
-    if (cycles.ea)
-    {
-      printf(", ea: %d", cycles.ea);
-    }
-    if (cycles.penalty)
-    {
-      printf(", p: %d", cycles.penalty);
-    }
-    printf(")");
-  }
-  cpu->cycles += cycles.normal + cycles.ea + cycles.penalty;
-  printf(" -> total: %d\n", cpu->cycles);
+  return cpu->registers[effectiveAddress.base] + cpu->registers[effectiveAddress.index] + effectiveAddress.displacement;
 }
 
 bool read_file(unsigned char** buffer, int* len, const char* fileName)
@@ -659,121 +499,170 @@ bool read_file(unsigned char** buffer, int* len, const char* fileName)
   return true;
 }
 
-void debugByte(ui8 byte)
+// A read only mapping of a program file, the cpu overlays the same pages privately so loading never copies the file
+struct ProgramImage
 {
-  for (int i = 7; i >= 0; i--)
-  {
-    printf("%d", byte >> i & 0b1);
-  }
-  printf("\n");
-}
+  ui8* bytes;
+  ui32 length;
+  i32  fd;
+};
+typedef struct ProgramImage ProgramImage;
 
-static inline char** getRegisterMemoryEncoding(bool w)
+static inline ui64 imageMappingSize(ui32 length)
 {
-  return w ? registerMemoryEncoding1 : registerMemoryEncoding0;
+  return ((ui64)length + 2 * PAGE_SIZE - 1) & ~(ui64)(PAGE_SIZE - 1);
 }
 
-static inline char** getRegisterRegisterEncoding(bool w)
+// The file is mapped over the front of an anonymous reservation, so at least one zeroed page follows the last byte
+// the same way read_file terminates its buffer, and decoding a truncated instruction never runs off the mapping
+static bool mapProgramImage(ProgramImage* image, const char* name)
 {
-  return w ? registerToRegisterEncoding16 : registerToRegisterEncoding8;
+  struct stat status;
+  image->fd = open(name, O_RDONLY);
+  if (image->fd < 0 || fstat(image->fd, &status) != 0 || !S_ISREG(status.st_mode) || status.st_size > UINT32_MAX - 2 * PAGE_SIZE)
+  {
+    if (image->fd >= 0)
+    {
+      close(image->fd);
+    }
+    return false;
+  }
+  image->length = (ui32)status.st_size;
+  image->bytes  = (ui8*)mmap(NULL, imageMappingSize(image->length), PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (image->bytes == MAP_FAILED)
+  {
+    close(image->fd);
+    return false;
+  }
+  if (image->length && mmap(image->bytes, image->length, PROT_READ, MAP_PRIVATE | MAP_FIXED, image->fd, 0) == MAP_FAILED)
+  {
+    munmap(image->bytes, imageMappingSize(image->length));
+    close(image->fd);
+    return false;
+  }
+  return true;
 }
 
-static inline void advance(ui8** buffer)
+static void unmapProgramImage(ProgramImage* image)
 {
-  (*buffer)++;
+  munmap(image->bytes, imageMappingSize(image->length));
+  close(image->fd);
 }
 
-void parseRegMemoryFieldCoding(Operand* operands, char* res, ui8** buffer, ui8 mod, bool w, ui8 rm)
-{
+// 1000:0000 sits above the 64KB the 16-bit effective addresses reach, so data only aliases code when -load asks for it
+#define DEFAULT_LOAD_ADDRESS 0x10000
 
-  char** encoding = getRegisterMemoryEncoding(mod == 0);
-  switch (mod)
+// Parses cs:ip in hex into the linear address the program is loaded at
+static bool parseLoadAddress(const char* text, ui32* address)
+{
+  char* end;
+  ui32  segment = (ui32)strtoul(text, &end, 16);
+  bool  valid   = end != text && *end == ':' && segment <= 0xFFFF;
+  if (valid)
   {
-  case 0:
+    const char* start  = end + 1;
+    ui32        offset = (ui32)strtoul(start, &end, 16);
+    valid              = end != start && !*end && offset <= 0xFFFF;
+    *address           = (segment << 4) + offset;
+  }
+  if (!valid)
   {
-    operands->effectiveAddress.mod            = 0;
-    operands->effectiveAddress.immediate.size = ZERO;
-    operands->effectiveAddress.rm             = rm;
-    operands->type                            = EFFECTIVEADDRESS;
-    if (rm == 6)
-    {
-      advance(buffer);
-      ui16 direct = *buffer[0];
-      if (w)
-      {
-        advance(buffer);
-        direct                                           = (*buffer[0] << 8) | direct;
-        operands->effectiveAddress.immediate.size        = SIXTEEN;
-        operands->effectiveAddress.immediate.immediate16 = direct;
-      }
-      else
-      {
-        operands->effectiveAddress.immediate.size       = EIGHT;
-        operands->effectiveAddress.immediate.immediate8 = (ui8)direct;
-      }
-      sprintf(&res[0], "[%d]", direct);
-    }
-    else
-    {
-      sprintf(&res[0], "[%s]", encoding[rm]);
-    }
-    break;
+    printf("Invalid load address '%s', expected cs:ip in hex\n", text);
   }
-  case 1:
+  return valid;
+}
+
+void debugByte(ui8 byte)
+{
+  for (int i = 7; i >= 0; i--)
   {
-    operands->effectiveAddress.mod = 1;
-    operands->effectiveAddress.rm  = rm;
-    operands->type                 = EFFECTIVEADDRESS;
+    printf("%d", byte >> i & 0b1);
+  }
+  printf("\n");
+}
 
-    advance(buffer);
-    if (*buffer[0] != 0)
-    {
-      operands->effectiveAddress.immediate.size       = EIGHT;
-      operands->effectiveAddress.immediate.immediate8 = *buffer[0];
-      sprintf(&res[0], "[%s + %d]", encoding[rm], *buffer[0]);
-    }
-    else
-    {
-      operands->effectiveAddress.immediate.size       = EIGHT;
-      operands->effectiveAddress.immediate.immediate8 = 0;
+static inline void advance(ui8** buffer)
+{
+  (*buffer)++;
+}
 
-      sprintf(&res[0], "[%s]", encoding[rm]);
-    }
-    break;
-  }
-  case 2:
-  {
-    operands->effectiveAddress.mod = 2;
-    operands->effectiveAddress.rm  = rm;
-    operands->type                 = EFFECTIVEADDRESS;
-    advance(buffer);
-    ui16 direct = *buffer[0];
+struct ModRMEntry
+{
+  ui8  mod;
+  ui8  rm;
+  ui8  base;
+  ui8  index;
+  ui8  displacementSize;
+  ui8  cycles;
+  bool isRegister;
+};
+typedef struct ModRMEntry ModRMEntry;
 
-    advance(buffer);
-    direct                                           = (*buffer[0] << 8) | direct;
+// Per rm values packed one nibble each, rm 0 in the lowest nibble, so they can be read in a constant expression.
+// Base and index are bx+si, bx+di, bp+si, bp+di, si, di, bp, bx with ZERO_REGISTER when there is no index
+#define RM_BASES                 0x35765533 // B, B, BP, BP, SI, DI, BP, B
+#define RM_INDICES               0x88887676 // SI, DI, SI, DI, ZERO_REGISTER...
+#define RM_CYCLES_NODISPLACEMENT 0x56557887 // 7, 8, 8, 7, 5, 5, 6 (direct address), 5
+#define RM_CYCLES_DISPLACEMENT   0x9999BCCB // 11, 12, 12, 11, 9, 9, 9, 9
+#define RM_NIBBLE(packed, rm)    (((packed) >> ((rm) * 4)) & 0xF)
 
-    operands->effectiveAddress.immediate.size        = SIXTEEN;
-    operands->effectiveAddress.immediate.immediate16 = direct != 0 ? direct : 0;
+_Static_assert(RM_NIBBLE(RM_BASES, 2) == BP && RM_NIBBLE(RM_BASES, 4) == SI && RM_NIBBLE(RM_BASES, 7) == B, "rm bases");
+_Static_assert(RM_NIBBLE(RM_INDICES, 1) == DI && RM_NIBBLE(RM_INDICES, 4) == ZERO_REGISTER, "rm indices");
 
-    sprintf(&res[0], "[%s + %d]", encoding[rm], direct);
-    break;
+#define MODRM_MOD(b)    (((b) >> 6) & 0b11)
+#define MODRM_RM(b)     ((b) & 0b111)
+// mod 0 with rm 6 is a direct address, always a 16 bit displacement and no base
+#define MODRM_DIRECT(b) (MODRM_MOD(b) == 0 && MODRM_RM(b) == 6)
+
+#define MODRM_ENTRY(b)                                                                                                 \
+  {MODRM_MOD(b),                                                                                                       \
+   MODRM_RM(b),                                                                                                        \
+   MODRM_DIRECT(b) ? ZERO_REGISTER : RM_NIBBLE(RM_BASES, MODRM_RM(b)),                                                 \
+   RM_NIBBLE(RM_INDICES, MODRM_RM(b)),                                                                                 \
+   MODRM_DIRECT(b) || MODRM_MOD(b) == 2 ? 2 : MODRM_MOD(b) == 1 ? 1 : 0,                                               \
+   RM_NIBBLE(MODRM_MOD(b) == 0 ? RM_CYCLES_NODISPLACEMENT : RM_CYCLES_DISPLACEMENT, MODRM_RM(b)),                      \
+   MODRM_MOD(b) == 3}
+#define MODRM_ENTRIES4(b)  MODRM_ENTRY(b), MODRM_ENTRY(b + 1), MODRM_ENTRY(b + 2), MODRM_ENTRY(b + 3)
+#define MODRM_ENTRIES16(b) MODRM_ENTRIES4(b), MODRM_ENTRIES4(b + 4), MODRM_ENTRIES4(b + 8), MODRM_ENTRIES4(b + 12)
+#define MODRM_ENTRIES64(b) MODRM_ENTRIES16(b), MODRM_ENTRIES16(b + 16), MODRM_ENTRIES16(b + 32), MODRM_ENTRIES16(b + 48)
+
+const ModRMEntry modrmTable[256] = {MODRM_ENTRIES64(0), MODRM_ENTRIES64(64), MODRM_ENTRIES64(128), MODRM_ENTRIES64(192)};
+
+// Expects buffer at the ModRM byte and leaves it at the last displacement byte
+void parseRegMemoryFieldCoding(Operand* operand, ui8** buffer, bool w)
+{
+  const ModRMEntry* entry = &modrmTable[*buffer[0]];
+  if (entry->isRegister)
+  {
+    operand->type = REGISTER;
+    parseRegister(&operand->reg, entry->rm, w);
+    return;
   }
-  case 3:
+
+  EffectiveAddress* effectiveAddress = &operand->effectiveAddress;
+  operand->type                      = EFFECTIVEADDRESS;
+  effectiveAddress->mod              = entry->mod;
+  effectiveAddress->rm               = entry->rm;
+  effectiveAddress->base             = entry->base;
+  effectiveAddress->index            = entry->index;
+  effectiveAddress->cycles           = entry->cycles;
+  effectiveAddress->wide             = w;
+  effectiveAddress->displacement     = 0;
+  if (entry->displacementSize >= 1)
   {
-    operands->type = REGISTER;
-    parseRegister(&operands->reg, rm, w);
-    sprintf(&res[0], "%s", getRegisterRegisterEncoding(w)[rm]);
-    break;
+    advance(buffer);
+    effectiveAddress->displacement = *buffer[0];
   }
+  if (entry->displacementSize == 2)
+  {
+    advance(buffer);
+    effectiveAddress->displacement |= *buffer[0] << 8;
   }
 }
 
-static void parseImmediateToRegMemory(Operand* operands, ui8** buffer, ui8 mod, ui8 rm, bool w, bool s, bool mov)
+static void parseImmediateToRegMemory(Operand* operands, ui8** buffer, bool w, bool s, bool mov)
 {
-
-  char res[32];
-  char source[32];
-  parseRegMemoryFieldCoding(&operands[0], &res[0], buffer, mod, w, rm);
+  parseRegMemoryFieldCoding(&operands[0], buffer, w);
 
   operands[1].type = IMMEDIATE;
   advance(buffer);
@@ -781,8 +670,7 @@ static void parseImmediateToRegMemory(Operand* operands, ui8** buffer, ui8 mod,
   if (!s && w)
   {
     advance(buffer);
-    offset = (*buffer[0] << 8) | offset;
-    sprintf(&source[0], mov ? "word %d" : "%d", offset);
+    offset                            = (*buffer[0] << 8) | offset;
     operands[1].immediate.size        = SIXTEEN;
     operands[1].immediate.immediate16 = offset;
   }
@@ -790,7 +678,6 @@ static void parseImmediateToRegMemory(Operand* operands, ui8** buffer, ui8 mod,
   {
     operands[1].immediate.size       = EIGHT;
     operands[1].immediate.immediate8 = offset;
-    sprintf(&source[0], mov ? "byte %d" : "%d", offset);
   }
 }
 static void parseImmediateToReg(Operand* operands, ui8** buffer, ui8 immediate, ui8 reg, bool w)
@@ -819,13 +706,8 @@ static void parseRegMemory(Operand* operands, ui8** buffer, char* instruction)
   bool w = (*buffer[0] & 1);
 
   advance(buffer);
-  ui8    mod      = (*buffer[0] >> 6) & 0b11;
-  ui8    reg      = (*buffer[0] >> 3) & 0b111;
-  ui8    rm       = *buffer[0] & 0b111;
-
-  char** encoding = getRegisterRegisterEncoding(w);
-  char   res[32];
-  parseRegMemoryFieldCoding(&operands[d], &res[0], buffer, mod, w, rm);
+  ui8 reg = (*buffer[0] >> 3) & 0b111;
+  parseRegMemoryFieldCoding(&operands[d], buffer, w);
 
   bool nd           = !d;
   operands[nd].type = REGISTER;
@@ -873,9 +755,7 @@ static void parseImmediateToRegMemoryAddSubCmp(Instruction* instruction, ui8** b
   bool w = (*buffer[0] & 1);
   advance(buffer);
 
-  ui8 mod = (*buffer[0] >> 6) & 0b11;
   ui8 reg = (*buffer[0] >> 3) & 0b111;
-  ui8 rm  = *buffer[0] & 0b111;
 
   if (reg == 0b101)
   {
@@ -889,7 +769,7 @@ static void parseImmediateToRegMemoryAddSubCmp(Instruction* instruction, ui8** b
   {
     instruction->op = ADD;
   }
-  parseImmediateToRegMemory(&instruction->operands[0], buffer, mod, rm, w, s, false);
+  parseImmediateToRegMemory(&instruction->operands[0], buffer, w, s, false);
 }
 static void parseAccumulatorToMemoryMov(Operand* operands, ui8** buffer, bool mta)
 {
@@ -899,24 +779,10 @@ static void parseAccumulatorToMemoryMov(Operand* operands, ui8** buffer, bool mt
   ui16 offset = *buffer[0];
   advance(buffer);
   offset = (*buffer[0] << 8) | offset;
-  if (mta)
-  {
-    operands[0].type                                   = ACCUMULATOR;
-    operands[1].type                                   = EFFECTIVEADDRESS;
-    operands[1].effectiveAddress.mod                   = 0;
-    operands[1].effectiveAddress.rm                    = 6;
-    operands[1].effectiveAddress.immediate.size        = SIXTEEN;
-    operands[1].effectiveAddress.immediate.immediate16 = offset;
-  }
-  else
-  {
-    operands[1].type                                   = ACCUMULATOR;
-    operands[0].type                                   = EFFECTIVEADDRESS;
-    operands[0].effectiveAddress.mod                   = 0;
-    operands[0].effectiveAddress.rm                    = 6;
-    operands[0].effectiveAddress.immediate.size        = SIXTEEN;
-    operands[0].effectiveAddress.immediate.immediate16 = offset;
-  }
+  Operand* memory            = &operands[mta ? 1 : 0];
+  operands[mta ? 0 : 1].type = ACCUMULATOR;
+  memory->type               = EFFECTIVEADDRESS;
+  memory->effectiveAddress   = (EffectiveAddress){.displacement = offset, .mod = 0, .rm = 6, .base = ZERO_REGISTER, .index = ZERO_REGISTER, .cycles = 6, .wide = w};
 }
 
 static void parseImmediateToRegMemoryMove(Operand* operands, ui8** buffer)
@@ -924,10 +790,7 @@ static void parseImmediateToRegMemoryMove(Operand* operands, ui8** buffer)
 
   bool w = *buffer[0] & 0b1;
   advance(buffer);
-  ui8 mod = (*buffer[0] >> 6) & 0b11;
-  ui8 rm  = *buffer[0] & 0b111;
-
-  parseImmediateToRegMemory(operands, buffer, mod, rm, w, 0, true);
+  parseImmediateToRegMemory(operands, buffer, w, 0, true);
 }
 
 static void parseJump(Operand* operands, ui8** buffer, char* instruction)
@@ -938,210 +801,685 @@ static void parseJump(Operand* operands, ui8** buffer, char* instruction)
   operands[0].immediate.immediate8 = *buffer[0];
 }
 
-static inline bool matchImmediateToRegMemoryMove(ui8 current)
+typedef void (*DecodeFunction)(Instruction* instruction, ui8** buffer);
+
+#define OPCODE_VALID 0b1
+#define OPCODE_MODRM 0b10
+#define OPCODE_JUMP  0b100
+#define OPCODE_WIDE   0b1000
+#define OPCODE_STRING 0b10000
+#define OPCODE_PREFIX 0b100000
+
+struct OpcodeEntry
+{
+  DecodeFunction decode;
+  Operation      op;
+  ui8            flags;
+};
+typedef struct OpcodeEntry OpcodeEntry;
+
+static void decodeRegMemory(Instruction* instruction, ui8** buffer)
+{
+  parseRegMemory(&instruction->operands[0], buffer, NULL);
+}
+
+static void decodeImmediateToRegMemory(Instruction* instruction, ui8** buffer)
 {
-  return ((current >> 1) & 0b1111111) == 0b1100011;
+  parseImmediateToRegMemoryAddSubCmp(instruction, buffer);
 }
 
-static inline bool matchImmediateToRegMove(ui8 current)
+static void decodeImmediateToAccumulator(Instruction* instruction, ui8** buffer)
 {
-  return ((current >> 4) & 0b1111) == 0b1011;
+  parseImmediateToAccumulator(&instruction->operands[0], buffer, NULL);
 }
 
-static inline bool matchImmediateToAccumulatorCmp(ui8 current)
+static void decodeImmediateToRegMove(Instruction* instruction, ui8** buffer)
 {
-  return ((current >> 1) & 0b1111111) == 0b0011110;
+  parseImmediateToRegMove(&instruction->operands[0], buffer);
 }
 
-static inline bool matchImmediateToAccumulatorSub(ui8 current)
+static void decodeAccumulatorToMemoryMov(Instruction* instruction, ui8** buffer)
 {
-  return ((current >> 1) & 0b1111111) == 0b0010110;
+  parseAccumulatorToMemoryMov(&instruction->operands[0], buffer, false);
 }
 
-static inline bool matchImmediateToAccumulatorAdd(ui8 current)
+static void decodeMemoryToAccumulatorMov(Instruction* instruction, ui8** buffer)
 {
-  return ((current >> 1) & 0b1111111) == 0b0000010;
+  parseAccumulatorToMemoryMov(&instruction->operands[0], buffer, true);
 }
 
-static inline bool matchMemoryToAccumulatorMov(ui8 current)
+static void decodeImmediateToRegMemoryMove(Instruction* instruction, ui8** buffer)
 {
-  return ((current >> 1) & 0b1111111) == 0b1010000;
+  parseImmediateToRegMemoryMove(&instruction->operands[0], buffer);
 }
 
-static inline bool matchAccumulatorToMemoryMov(ui8 current)
+static void decodeJump(Instruction* instruction, ui8** buffer)
 {
-  return ((current >> 1) & 0b1111111) == 0b1010001;
+  parseJump(&instruction->operands[0], buffer, NULL);
 }
 
-static inline bool matchRegMemoryCmp(ui8 current)
+// string and direction instructions are a single byte with no operands
+static void decodeNoOperands(Instruction* instruction, ui8** buffer)
 {
-  return ((current >> 2) & 0b111111) == 0b001110;
 }
 
-static inline bool matchRegMemorySub(ui8 current)
+// no w bit, shifting a byte by 8 always reads 0
+#define NO_W 8
+
+// Every first byte the decoder understands, walked top to bottom so the first matching row wins.
+// Columns are mask and value of the first byte, decoder, operation, flags and the bit holding w.
+// Both the opcode table and the linear reference decoder are expanded from this, nothing else lists encodings
+#define INSTRUCTION_SPEC(X, b)                                                           \
+  X(b, 0b11111100, 0b00000000, decodeRegMemory, ADD, OPCODE_MODRM, 0)                  \
+  X(b, 0b11111100, 0b00111000, decodeRegMemory, CMP, OPCODE_MODRM, 0)                  \
+  X(b, 0b11111100, 0b00101000, decodeRegMemory, SUB, OPCODE_MODRM, 0)                  \
+  /* the actual operation is in the reg field and gets set by the decoder */           \
+  X(b, 0b11111100, 0b10000000, decodeImmediateToRegMemory, ADD, OPCODE_MODRM, 0)       \
+  X(b, 0b11111110, 0b00111100, decodeImmediateToAccumulator, CMP, 0, 0)                \
+  X(b, 0b11111110, 0b00101100, decodeImmediateToAccumulator, SUB, 0, 0)                \
+  X(b, 0b11111110, 0b00000100, decodeImmediateToAccumulator, ADD, 0, 0)                \
+  X(b, 0b11110000, 0b10110000, decodeImmediateToRegMove, MOV, 0, 3)                    \
+  X(b, 0b11111110, 0b10100010, decodeAccumulatorToMemoryMov, MOV, 0, 0)                \
+  X(b, 0b11111110, 0b10100000, decodeMemoryToAccumulatorMov, MOV, 0, 0)                \
+  X(b, 0b11111110, 0b11000110, decodeImmediateToRegMemoryMove, MOV, OPCODE_MODRM, 0)   \
+  X(b, 0b11111100, 0b10001000, decodeRegMemory, MOV, OPCODE_MODRM, 0)                  \
+  X(b, 0b11111111, 0b01110100, decodeJump, JE, OPCODE_JUMP, NO_W)                      \
+  X(b, 0b11111111, 0b01111100, decodeJump, JL, OPCODE_JUMP, NO_W)                      \
+  X(b, 0b11111111, 0b01111110, decodeJump, JLE, OPCODE_JUMP, NO_W)                     \
+  X(b, 0b11111111, 0b01110010, decodeJump, JB, OPCODE_JUMP, NO_W)                      \
+  X(b, 0b11111111, 0b01110110, decodeJump, JBE, OPCODE_JUMP, NO_W)                     \
+  X(b, 0b11111111, 0b01111010, decodeJump, JP, OPCODE_JUMP, NO_W)                      \
+  X(b, 0b11111111, 0b01110000, decodeJump, JO, OPCODE_JUMP, NO_W)                      \
+  X(b, 0b11111111, 0b01111000, decodeJump, JS, OPCODE_JUMP, NO_W)                      \
+  X(b, 0b11111111, 0b01110101, decodeJump, JNZ, OPCODE_JUMP, NO_W)                     \
+  X(b, 0b11111111, 0b01111101, decodeJump, JNL, OPCODE_JUMP, NO_W)                     \
+  X(b, 0b11111111, 0b01111111, decodeJump, JNLE, OPCODE_JUMP, NO_W)                    \
+  X(b, 0b11111111, 0b01110011, decodeJump, JNB, OPCODE_JUMP, NO_W)                     \
+  X(b, 0b11111111, 0b01110111, decodeJump, JNBE, OPCODE_JUMP, NO_W)                    \
+  X(b, 0b11111111, 0b01111011, decodeJump, JNP, OPCODE_JUMP, NO_W)                     \
+  X(b, 0b11111111, 0b01110001, decodeJump, JNO, OPCODE_JUMP, NO_W)                     \
+  X(b, 0b11111111, 0b01111001, decodeJump, JNS, OPCODE_JUMP, NO_W)                     \
+  X(b, 0b11111111, 0b11100010, decodeJump, LOOP, OPCODE_JUMP, NO_W)                    \
+  X(b, 0b11111111, 0b11100001, decodeJump, LOOPZ, OPCODE_JUMP, NO_W)                   \
+  X(b, 0b11111111, 0b11100000, decodeJump, LOOPNZ, OPCODE_JUMP, NO_W)                  \
+  X(b, 0b11111111, 0b11100011, decodeJump, JCXZ, OPCODE_JUMP, NO_W)                    \
+  X(b, 0b11111110, 0b10100100, decodeNoOperands, MOVS, OPCODE_STRING, 0)               \
+  X(b, 0b11111110, 0b10100110, decodeNoOperands, CMPS, OPCODE_STRING, 0)               \
+  X(b, 0b11111110, 0b10101010, decodeNoOperands, STOS, OPCODE_STRING, 0)               \
+  X(b, 0b11111110, 0b10101100, decodeNoOperands, LODS, OPCODE_STRING, 0)               \
+  X(b, 0b11111110, 0b10101110, decodeNoOperands, SCAS, OPCODE_STRING, 0)               \
+  X(b, 0b11111111, 0b11111100, decodeNoOperands, CLD, 0, NO_W)                         \
+  X(b, 0b11111111, 0b11111101, decodeNoOperands, STD, 0, NO_W)                         \
+  /* not an instruction on its own, decodeInstruction looks at the string operation after it */ \
+  X(b, 0b11111110, 0b11110010, 0, MOV, OPCODE_PREFIX, NO_W)
+
+#define SPEC_MATCH(b, mask, value) (((b) & (mask)) == (value))
+#define SPEC_FLAGS(b, flags, w)    ((flags) | ((flags) & OPCODE_PREFIX ? 0 : OPCODE_VALID) | (((b) >> (w)) & 1) * OPCODE_WIDE)
+
+// Each field of a table entry is a chain of conditionals over the spec rows, ending in the value for unknown bytes
+#define SPEC_DECODE_FIELD(b, mask, value, decode, op, flags, w) SPEC_MATCH(b, mask, value) ? decode :
+#define SPEC_OP_FIELD(b, mask, value, decode, op, flags, w)     SPEC_MATCH(b, mask, value) ? op :
+#define SPEC_FLAGS_FIELD(b, mask, value, decode, op, flags, w)  SPEC_MATCH(b, mask, value) ? SPEC_FLAGS(b, flags, w) :
+
+#define OPCODE_ENTRY(b)                                                                                                \
+  {INSTRUCTION_SPEC(SPEC_DECODE_FIELD, b) 0, INSTRUCTION_SPEC(SPEC_OP_FIELD, b) MOV,                                  \
+   INSTRUCTION_SPEC(SPEC_FLAGS_FIELD, b) 0}
+#define OPCODE_ENTRIES4(b)  OPCODE_ENTRY(b), OPCODE_ENTRY(b + 1), OPCODE_ENTRY(b + 2), OPCODE_ENTRY(b + 3)
+#define OPCODE_ENTRIES16(b) OPCODE_ENTRIES4(b), OPCODE_ENTRIES4(b + 4), OPCODE_ENTRIES4(b + 8), OPCODE_ENTRIES4(b + 12)
+#define OPCODE_ENTRIES64(b) OPCODE_ENTRIES16(b), OPCODE_ENTRIES16(b + 16), OPCODE_ENTRIES16(b + 32), OPCODE_ENTRIES16(b + 48)
+
+// Resolved by the compiler from the spec, so there is nothing to initialize at startup
+const OpcodeEntry opcodeTable[256] = {OPCODE_ENTRIES64(0), OPCODE_ENTRIES64(64), OPCODE_ENTRIES64(128), OPCODE_ENTRIES64(192)};
+
+static inline bool decodeInstruction(Instruction* instruction, ui8** buffer)
+{
+  ui8*         start = *buffer;
+  const OpcodeEntry* entry = &opcodeTable[(*buffer)[0]];
+  instruction->rep   = REP_NONE;
+  if (!(entry->flags & OPCODE_VALID))
+  {
+    // a rep prefix is only understood in front of a string operation
+    if (!(entry->flags & OPCODE_PREFIX) || !(opcodeTable[(*buffer)[1]].flags & OPCODE_STRING))
+    {
+      return false;
+    }
+    instruction->rep = (*buffer)[0] & 1 ? REP_E : REP_NE;
+    (*buffer)++;
+    entry = &opcodeTable[(*buffer)[0]];
+  }
+  instruction->op   = entry->op;
+  instruction->wide = entry->flags & OPCODE_WIDE;
+  entry->decode(instruction, buffer);
+  (*buffer)++;
+  instruction->size = (ui8)(*buffer - start);
+  return true;
+}
+
+// Decodes one instruction out of the remaining bytes, fails on unknown opcodes and on instructions cut off by the end
+static inline bool decodeBounded(ui8* bytes, ui32 remaining, Instruction* out)
 {
-  return ((current >> 2) & 0b111111) == 0b001010;
+  ui8  tail[MAX_INSTRUCTION_LENGTH * 2];
+  ui8* buffer = bytes;
+  if (remaining < MAX_INSTRUCTION_LENGTH)
+  {
+    // decoding reads ahead without bounds checks, so the last few bytes get decoded from a padded copy
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, buffer, remaining);
+    buffer = tail;
+  }
+  return decodeInstruction(out, &buffer) && out->size <= remaining;
 }
 
-static inline bool matchRegMemoryAdd(ui8 current)
+// Decodes as much of bytes as it can into out, which needs room for len instructions. Stops at the first byte
+// that isn't a known opcode or at an instruction cut off by the end, the sizes of the returned instructions add up to the bytes consumed
+ui32 decode(ui8* bytes, ui32 len, Instruction* out)
 {
-  return ((current >> 2) & 0b111111) == 0;
+  ui32 count  = 0;
+  ui32 offset = 0;
+  while (offset < len && decodeBounded(bytes + offset, len - offset, &out[count]))
+  {
+    offset += out[count].size;
+    count++;
+  }
+  return count;
 }
 
-static inline bool matchImmediateToRegMemory(ui8 current)
+struct InstructionSpec
+{
+  ui8            mask;
+  ui8            value;
+  DecodeFunction decode;
+  Operation      op;
+  ui8            flags;
+  ui8            w;
+};
+typedef struct InstructionSpec InstructionSpec;
+
+#define SPEC_ROW(b, mask, value, decode, op, flags, w) {mask, value, decode, op, flags, w},
+const InstructionSpec instructionSpecs[] = {INSTRUCTION_SPEC(SPEC_ROW, 0)};
+
+static const InstructionSpec* findInstructionSpec(ui8 current)
 {
-  return ((current >> 2) & 0b111111) == 0b100000;
+  for (ui32 i = 0; i < ArrayCount(instructionSpecs); i++)
+  {
+    if ((current & instructionSpecs[i].mask) == instructionSpecs[i].value)
+    {
+      return &instructionSpecs[i];
+    }
+  }
+  return 0;
 }
 
-static inline bool matchJE(ui8 current)
+// Reference decoder that walks the spec rows one by one, kept to benchmark against the opcode table
+bool decodeInstructionLinear(Instruction* instruction, ui8** buffer)
 {
-  return current == 0b01110100;
+  const InstructionSpec* spec = findInstructionSpec((*buffer)[0]);
+  instruction->rep            = REP_NONE;
+  if (spec && (spec->flags & OPCODE_PREFIX))
+  {
+    const InstructionSpec* next = findInstructionSpec((*buffer)[1]);
+    if (!next || !(next->flags & OPCODE_STRING))
+    {
+      return false;
+    }
+    instruction->rep = (*buffer)[0] & 1 ? REP_E : REP_NE;
+    (*buffer)++;
+    spec = next;
+  }
+  if (!spec)
+  {
+    return false;
+  }
+  instruction->op   = spec->op;
+  instruction->wide = SPEC_FLAGS((*buffer)[0], spec->flags, spec->w) & OPCODE_WIDE;
+  spec->decode(instruction, buffer);
+  (*buffer)++;
+  return true;
 }
-static inline bool matchJL(ui8 current)
+
+// Flag producing instructions only record what they did, the flags themselves are derived once something reads them
+static inline void setLazyFlags(CPU* cpu, Operation op, ui16 left, ui16 right, ui16 result, bool wide)
 {
-  return current == 0b01111100;
+  cpu->flagsPending = true;
+  cpu->flagsOp      = op;
+  cpu->flagsLeft    = left;
+  cpu->flagsRight   = right;
+  cpu->flagsResult  = result;
+  cpu->flagsWide    = wide;
 }
-static inline bool matchJLE(ui8 current)
+
+ui8 getFlags(CPU* cpu)
 {
-  return current == 0b01111110;
+  if (!cpu->flagsPending)
+  {
+    return cpu->flags;
+  }
+
+  ui16 mask   = cpu->flagsWide ? 0xFFFF : 0xFF;
+  ui16 sign   = cpu->flagsWide ? 0x8000 : 0x80;
+  ui16 left   = cpu->flagsLeft & mask;
+  ui16 right  = cpu->flagsRight & mask;
+  ui16 result = cpu->flagsResult & mask;
+  // arithmetic never touches the direction flag
+  ui8  flags  = cpu->flags & (1 << DF);
+
+  if (result == 0)
+  {
+    SETZF(flags);
+  }
+  if (result & sign)
+  {
+    SETSF(flags);
+  }
+  if (!__builtin_parity(result & 0xFF))
+  {
+    SETFLAG(flags, PF);
+  }
+  if ((left ^ right ^ result) & 0x10)
+  {
+    SETFLAG(flags, AF);
+  }
+  if (cpu->flagsOp == ADD)
+  {
+    if ((ui32)left + (ui32)right > mask)
+    {
+      SETFLAG(flags, CF);
+    }
+    if ((left ^ result) & (right ^ result) & sign)
+    {
+      SETFLAG(flags, OF);
+    }
+  }
+  else
+  {
+    if (left < right)
+    {
+      SETFLAG(flags, CF);
+    }
+    if ((left ^ right) & (left ^ result) & sign)
+    {
+      SETFLAG(flags, OF);
+    }
+  }
+
+  cpu->flags        = flags;
+  cpu->flagsPending = false;
+  return flags;
 }
-static inline bool matchJB(ui8 current)
+
+// Conditional jumps only need a single flag, so they skip materializing the rest
+static inline bool getZF(CPU* cpu)
 {
-  return current == 0b01110010;
+  if (cpu->flagsPending)
+  {
+    return (cpu->flagsResult & (cpu->flagsWide ? 0xFFFF : 0xFF)) == 0;
+  }
+  return GETZF(cpu->flags);
 }
-static inline bool matchJBE(ui8 current)
+
+enum OperandForm
+{
+  FORM_REG_REG,
+  FORM_REG_MEM,
+  FORM_MEM_REG,
+  FORM_REG_IMM,
+  FORM_MEM_IMM,
+  FORM_ACC_MEM,
+  FORM_MEM_ACC,
+  FORM_ACC_IMM,
+  FORM_COUNT
+};
+typedef enum OperandForm OperandForm;
+
+struct Timing
+{
+  ui8 base;
+  ui8 transfers;
+};
+typedef struct Timing Timing;
+
+// Clocks per operation and operand form from the 8086 manual, memory forms pay the ea cost on top except for the accumulator ones
+Timing timingTable[CMP + 1][FORM_COUNT] = {
+    [MOV] = {{2, 0}, {8, 1}, {9, 1}, {4, 0}, {10, 1}, {10, 1}, {10, 1}, {4, 0}},
+    [ADD] = {{3, 0}, {9, 1}, {16, 2}, {4, 0}, {17, 2}, {0, 0}, {0, 0}, {4, 0}},
+    [SUB] = {{3, 0}, {9, 1}, {16, 2}, {4, 0}, {17, 2}, {0, 0}, {0, 0}, {4, 0}},
+    [CMP] = {{3, 0}, {9, 1}, {9, 1}, {4, 0}, {10, 1}, {0, 0}, {0, 0}, {4, 0}},
+};
+
+struct JumpTiming
+{
+  ui8 taken;
+  ui8 notTaken;
+};
+typedef struct JumpTiming JumpTiming;
+
+JumpTiming jumpTimingTable[JCXZ - JE + 1] = {
+    [JE - JE] = {16, 4},   [JL - JE] = {16, 4},    [JLE - JE] = {16, 4},  [JB - JE] = {16, 4},    [JBE - JE] = {16, 4}, [JP - JE] = {16, 4},
+    [JO - JE] = {16, 4},   [JS - JE] = {16, 4},    [JNZ - JE] = {16, 4},  [JNL - JE] = {16, 4},   [JNLE - JE] = {16, 4}, [JNB - JE] = {16, 4},
+    [JNBE - JE] = {16, 4}, [JNP - JE] = {16, 4},   [JNO - JE] = {16, 4},  [JNS - JE] = {16, 4},   [LOOP - JE] = {17, 5}, [LOOPZ - JE] = {18, 6},
+    [LOOPNZ - JE] = {19, 5}, [JCXZ - JE] = {18, 6},
+};
+
+// Only jnz is executed so far, every other jump falls through
+static inline bool isJumpTaken(CPU* cpu, Instruction* instruction)
 {
-  return current == 0b01110110;
+  return instruction->op == JNZ && !getZF(cpu);
 }
-static inline bool matchJP(ui8 current)
+
+static inline ui8 jumpCycles(Operation op, bool taken)
 {
-  return current == 0b01111010;
+  return taken ? jumpTimingTable[op - JE].taken : jumpTimingTable[op - JE].notTaken;
 }
-static inline bool matchJO(ui8 current)
+
+static OperandForm getOperandForm(Instruction* instruction)
 {
-  return current == 0b01110000;
+  OperandType dest   = instruction->operands[0].type;
+  OperandType source = instruction->operands[1].type;
+  if (dest == ACCUMULATOR)
+  {
+    return source == EFFECTIVEADDRESS ? FORM_ACC_MEM : FORM_ACC_IMM;
+  }
+  if (dest == EFFECTIVEADDRESS)
+  {
+    return source == REGISTER ? FORM_MEM_REG : source == ACCUMULATOR ? FORM_MEM_ACC : FORM_MEM_IMM;
+  }
+  return source == REGISTER ? FORM_REG_REG : source == EFFECTIVEADDRESS ? FORM_REG_MEM : FORM_REG_IMM;
 }
-static inline bool matchJS(ui8 current)
+
+// Word transfers cost an extra bus cycle at odd addresses on the 8086, and always on the 8088's byte wide bus
+static inline ui8 calcPenalty(CPU* cpu, ui16 address, bool wide, ui8 transfers)
 {
-  return current == 0b01111000;
+  if (!wide || !(cpu->bus8088 || (address & 1)))
+  {
+    return 0;
+  }
+  return transfers * 4;
 }
-static inline bool matchJNE(ui8 current)
+
+// Has to run before the instruction executes, the effective address and the jump condition depend on the current state
+Cycles calcCycles(CPU* cpu)
 {
-  return current == 0b01110101;
+  Instruction* instruction = &cpu->instruction;
+  Cycles       cycles      = {.normal = 0, .ea = 0, .penalty = 0};
+  if (isJump(instruction->op))
+  {
+    cycles.normal = jumpCycles(instruction->op, isJumpTaken(cpu, instruction));
+    return cycles;
+  }
+  if (instruction->op == CLD || instruction->op == STD)
+  {
+    cycles.normal = 2;
+    return cycles;
+  }
+  if (isStringOperation(instruction->op))
+  {
+    // depends on how many elements run, executeStringInstruction leaves it in cpu->stringCycles
+    return cycles;
+  }
+
+  OperandForm form   = getOperandForm(instruction);
+  Timing      timing = timingTable[instruction->op][form];
+  cycles.normal      = timing.base;
+  if (timing.transfers)
+  {
+    Operand* memory = &instruction->operands[instruction->operands[0].type == EFFECTIVEADDRESS ? 0 : 1];
+    if (form != FORM_ACC_MEM && form != FORM_MEM_ACC)
+    {
+      cycles.ea = memory->effectiveAddress.cycles;
+    }
+    cycles.penalty = calcPenalty(cpu, getEffectiveAddress(cpu, memory->effectiveAddress), instruction->wide, timing.transfers);
+  }
+  return cycles;
 }
-static inline bool matchJNL(ui8 current)
+
+void printInstruction(Instruction* instruction)
 {
-  return current == 0b01111101;
+  char  text[MAX_INSTRUCTION_TEXT];
+  char* end = formatInstruction(text, instruction);
+  fwrite(text, 1, end - text, stdout);
 }
-static inline bool matchJNLE(ui8 current)
+
+static inline char* formatUnsigned(char* out, ui64 value)
 {
-  return current == 0b01111111;
+  char digits[20];
+  i32  count = 0;
+  do
+  {
+    digits[count++] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  while (count)
+  {
+    *out++ = digits[--count];
+  }
+  return out;
 }
-static inline bool matchJNB(ui8 current)
+
+#define MAX_TRACE_TEXT (MAX_INSTRUCTION_TEXT + 96)
+
+// One line of the execution trace, shared by the direct trace and the pipelined trace writer
+char* formatTrace(char* out, Instruction* instruction, Cycles cycles, ui64 total)
 {
-  return current == 0b01110011;
+  out = formatInstruction(out, instruction);
+  out = formatString(out, isJump(instruction->op) ? ";" : "; ");
+  out = formatString(out, "\tcycles: ");
+  out = formatUnsigned(out, cycles.normal + cycles.ea);
+  if (cycles.ea || cycles.penalty)
+  {
+    *out++ = '(';
+    out    = formatUnsigned(out, cycles.normal);
+    if (cycles.ea)
+    {
+      out = formatString(out, ", ea: ");
+      out = formatUnsigned(out, cycles.ea);
+    }
+    if (cycles.penalty)
+    {
+      out = formatString(out, ", p: ");
+      out = formatUnsigned(out, cycles.penalty);
+    }
+    *out++ = ')';
+  }
+  out    = formatString(out, " -> total: ");
+  out    = formatUnsigned(out, total);
+  *out++ = '\n';
+  return out;
 }
-static inline bool matchJNBE(ui8 current)
+
+void debugInstruction(CPU* cpu, Cycles cycles)
 {
-  return current == 0b01110111;
+  char text[MAX_TRACE_TEXT];
+  cpu->cycles += cycles.normal + cycles.ea + cycles.penalty;
+  char* end = formatTrace(text, &cpu->instruction, cycles, cpu->cycles);
+  fwrite(text, 1, end - text, stdout);
 }
-static inline bool matchJNP(ui8 current)
+
+// Writing a whole word at an 8-bit register's offset and merging the other half back in avoids the size check,
+// but the overlapping loads and stores that follow can't be forwarded and it measures slower than this
+static inline ui16 readRegister(CPU* cpu, Register* reg)
 {
-  return current == 0b01111011;
+  return reg->size == SIXTEEN ? cpu->registerFile->words[reg->type] : cpu->registerFile->bytes[reg->index];
 }
-static inline bool matchJNO(ui8 current)
+
+static inline void setRegisterValue(CPU* cpu, Register* reg, ui16 value)
 {
-  return current == 0b01110001;
+  if (reg->size == SIXTEEN)
+  {
+    cpu->registerFile->words[reg->type] = value;
+  }
+  else
+  {
+    cpu->registerFile->bytes[reg->index] = (ui8)value;
+  }
 }
-static inline bool matchJNS(ui8 current)
+
+static inline bool isPageSet(ui64* pages, ui32 page)
 {
-  return current == 0b01111001;
+  return (pages[page >> 6] >> (page & 63)) & 1;
 }
-static inline bool matchLoop(ui8 current)
+
+static inline void markPages(ui64* pages, ui32 address, ui32 size)
 {
-  return current == 0b11100010;
+  for (ui32 page = address >> PAGE_SHIFT; page <= (address + size - 1) >> PAGE_SHIFT && page < PAGE_COUNT; page++)
+  {
+    pages[page >> 6] |= 1ULL << (page & 63);
+  }
 }
-static inline bool matchLoopz(ui8 current)
+
+#define WATCH_READ      0b1
+#define WATCH_WRITE     0b10
+#define WATCH_EXECUTE   0b100
+#define WATCH_KINDS     3
+#define MAX_WATCHPOINTS 16
+
+const char* watchKindToString[WATCH_KINDS] = {"read", "write", "execute"};
+
+struct Watchpoint
+{
+  ui32 first;
+  ui32 last;
+  ui8  kinds;
+  ui64 hits;
+};
+typedef struct Watchpoint Watchpoint;
+
+// Accesses to one address by one instruction, one counter per kind
+struct AccessCount
+{
+  ui32 address;
+  ui32 ip;
+  ui64 counts[WATCH_KINDS];
+  bool used;
+};
+typedef struct AccessCount AccessCount;
+
+// Only accesses to pages set in the bitmap are looked at, everywhere else they cost a single bit test.
+// Counting covers the watched ranges, or all data accesses with histogram set. Zero initialized is empty
+struct MemoryWatch
+{
+  ui64         pages[DIRTY_WORDS];
+  Watchpoint   watchpoints[MAX_WATCHPOINTS];
+  ui32         watchpointCount;
+  bool         histogram;
+  AccessCount* counts;
+  ui32         countCapacity;
+  ui32         countSize;
+  ui32         ip;
+};
+typedef struct MemoryWatch MemoryWatch;
+
+static void addWatchpoint(MemoryWatch* watch, ui32 first, ui32 last, ui8 kinds)
 {
-  return current == 0b11100001;
+  watch->watchpoints[watch->watchpointCount++] = (Watchpoint){.first = first, .last = last, .kinds = kinds, .hits = 0};
+  markPages(watch->pages, first, last - first + 1);
 }
-static inline bool matchLoopnz(ui8 current)
+
+static inline bool isWatched(MemoryWatch* watch, ui32 address, ui32 size)
 {
-  return current == 0b11100000;
+  return isPageSet(watch->pages, address >> PAGE_SHIFT) || isPageSet(watch->pages, (address + size - 1) >> PAGE_SHIFT);
 }
-static inline bool matchJCXZ(ui8 current)
+
+static inline ui32 hashAccess(ui32 address, ui32 ip)
 {
-  return current == 0b11100011;
+  return (address * 0x9E3779B1u) ^ (ip * 0x85EBCA6Bu);
 }
-static inline bool matchRegMemoryMove(ui8 current)
+
+static AccessCount* findAccessCount(MemoryWatch* watch, ui32 address, ui32 ip)
 {
-  return (current >> 2 & 0b111111) == 0b100010;
+  ui32 mask = watch->countCapacity - 1;
+  for (ui32 slot = hashAccess(address, ip) & mask;; slot = (slot + 1) & mask)
+  {
+    AccessCount* count = &watch->counts[slot];
+    if (!count->used || (count->address == address && count->ip == ip))
+    {
+      return count;
+    }
+  }
 }
 
-void updateFlags(CPU* cpu, ui16 value)
+static void countAccess(MemoryWatch* watch, ui32 address, ui32 kind)
 {
-  ui16 prev  = cpu->flags;
-  cpu->flags = 0;
-  if (value == 0)
+  if (watch->countSize * 2 >= watch->countCapacity)
   {
-    SETZF(cpu->flags);
+    AccessCount* old      = watch->counts;
+    ui32         capacity = watch->countCapacity;
+    watch->countCapacity  = capacity ? capacity * 2 : 1024;
+    watch->counts = (AccessCount*)calloc(watch->countCapacity, sizeof(AccessCount));
+    for (ui32 i = 0; i < capacity; i++)
+    {
+      if (old[i].used)
+      {
+        *findAccessCount(watch, old[i].address, old[i].ip) = old[i];
+      }
+    }
+    free(old);
   }
-  else if ((value & 0x8000) != 0)
+  AccessCount* count = findAccessCount(watch, address, watch->ip);
+  if (!count->used)
   {
-    SETSF(cpu->flags);
+    *count = (AccessCount){.address = address, .ip = watch->ip, .used = true};
+    watch->countSize++;
   }
+  count->counts[kind]++;
 }
 
-void setRegisterValue(CPU* cpu, Register* reg, ui16 value)
+// Called for accesses on watched pages only, kind is the index of the WATCH_* bit
+static void watchAccess(CPU* cpu, ui32 address, ui32 size, ui32 kind)
 {
-  ui16* regValue  = &cpu->registers[reg->type];
-  ui16  prevValue = *regValue;
-  if (reg->offset == 0)
+  MemoryWatch* watch = cpu->watch;
+  bool         hit   = false;
+  for (ui32 i = 0; i < watch->watchpointCount; i++)
   {
-    if (reg->size == EIGHT)
-    {
-      ui8 v     = (ui8)value;
-      *regValue = *regValue & 0x00FF;
-      *regValue = *regValue | v;
-    }
-    else
+    Watchpoint* watchpoint = &watch->watchpoints[i];
+    if ((watchpoint->kinds & (1 << kind)) && address <= watchpoint->last && address + size - 1 >= watchpoint->first)
     {
-      *regValue = value;
+      watchpoint->hits++;
+      hit = true;
     }
   }
-  else
+  if (hit)
+  {
+    printf("watch %s 0x%04x (%u bytes) at ip 0x%04x: ", watchKindToString[kind], address, size, watch->ip);
+    printInstruction(&cpu->instruction);
+    printf("\n");
+  }
+  // instruction fetches would drown out the data in the histogram, -profile already counts those
+  if (hit || (watch->histogram && kind != 2))
+  {
+    countAccess(watch, address, kind);
+  }
+}
+
+static inline void watchRead(CPU* cpu, ui32 address, ui32 size)
+{
+  if (cpu->watch && isWatched(cpu->watch, address, size))
   {
-    ui8 v     = (ui8)value;
-    *regValue = *regValue & 0xFF00;
-    *regValue = *regValue | (v << 8);
+    watchAccess(cpu, address, size, 0);
   }
 }
 
 Immediate getOperandValue(CPU* cpu, Operand operand)
 {
-  Immediate immediate;
+  Immediate immediate = {0};
   if (operand.type == IMMEDIATE)
   {
     return operand.immediate;
   }
   else if (operand.type == REGISTER)
   {
-    ui16 regValue = cpu->registers[operand.reg.type];
-    if (operand.reg.size == SIXTEEN)
-    {
-      immediate.size        = SIXTEEN;
-      immediate.immediate16 = regValue;
-    }
-    else
-    {
-      immediate.size       = EIGHT;
-      immediate.immediate8 = operand.reg.offset == 8 ? regValue << 8 : regValue & 0xFF;
-    }
+    immediate.size        = operand.reg.size;
+    immediate.immediate16 = readRegister(cpu, &operand.reg);
+  }
+  else if (operand.type == ACCUMULATOR)
+  {
+    immediate.size        = SIXTEEN;
+    immediate.immediate16 = cpu->registers[A];
   }
   else if (operand.type == EFFECTIVEADDRESS)
   {
     ui16 effectiveAddress = getEffectiveAddress(cpu, operand.effectiveAddress);
-    immediate.size        = operand.effectiveAddress.immediate.size;
+    immediate.size        = operand.effectiveAddress.wide ? SIXTEEN : EIGHT;
+    watchRead(cpu, effectiveAddress, immediate.size == SIXTEEN ? 2 : 1);
     if (immediate.size == EIGHT)
     {
       immediate.immediate8 = cpu->memory[effectiveAddress];
@@ -1154,333 +1492,4762 @@ Immediate getOperandValue(CPU* cpu, Operand operand)
   return immediate;
 }
 
-static inline void setMemoryValue(CPU* cpu, ui16 dest, Immediate value)
+static inline bool overlapsCode(CPU* cpu, ui32 address, ui32 size)
 {
-  if (value.size == SIXTEEN)
-  {
-    cpu->memory[dest]     = value.immediate16 & 0xFF;
-    cpu->memory[dest + 1] = value.immediate16 << 8;
-  }
-  else
-  {
-    cpu->memory[dest] = value.immediate8;
-  }
+  return address + size > cpu->codeBase && address < cpu->codeBase + cpu->codeLength;
 }
 
-void executeMoveInstruction(CPU* cpu, Operand* operands)
+// Any cached instruction starting up to MAX_INSTRUCTION_LENGTH - 1 bytes before the write could include the written bytes,
+// the address is linear and only has to overlap the code
+static void invalidateDecodedInstructions(CPU* cpu, ui32 address, ui32 size)
 {
-  Immediate immediate = getOperandValue(cpu, operands[1]);
-  if (operands[0].type == REGISTER)
+  ui32 end   = cpu->codeBase + cpu->codeLength;
+  ui32 first = address >= cpu->codeBase + MAX_INSTRUCTION_LENGTH - 1 ? address - (MAX_INSTRUCTION_LENGTH - 1) : cpu->codeBase;
+  ui32 last  = address + size < end ? address + size : end;
+  for (ui32 ip = first - cpu->codeBase; ip < last - cpu->codeBase; ip++)
   {
-    setRegisterValue(cpu, &operands[0].reg, immediate.size == EIGHT ? immediate.immediate8 : immediate.immediate16);
+    cpu->decoded[ip].valid = false;
   }
-  else if (operands[0].type == EFFECTIVEADDRESS)
+  cpu->codeVersion++;
+}
+
+static inline void markDirty(CPU* cpu, ui32 address, ui32 size)
+{
+  markPages(cpu->dirtyPages, address, size);
+}
+
+struct WriteRange
+{
+  ui32 address;
+  ui32 size;
+};
+typedef struct WriteRange WriteRange;
+
+// Memory written by the current instruction while a trace is recorded, element by element string stores coalesce into one range
+struct WriteLog
+{
+  WriteRange* ranges;
+  ui32        count;
+  ui32        capacity;
+};
+typedef struct WriteLog WriteLog;
+
+static void logWrite(WriteLog* log, ui32 address, ui32 size)
+{
+  if (log->count)
+  {
+    WriteRange* last = &log->ranges[log->count - 1];
+    ui32        end  = last->address + last->size;
+    if (address <= end && address + size >= last->address)
+    {
+      end           = address + size > end ? address + size : end;
+      last->address = address < last->address ? address : last->address;
+      last->size    = end - last->address;
+      return;
+    }
+  }
+  if (log->count == log->capacity)
+  {
+    log->capacity = log->capacity ? log->capacity * 2 : 16;
+    log->ranges   = (WriteRange*)realloc(log->ranges, sizeof(WriteRange) * log->capacity);
+  }
+  log->ranges[log->count++] = (WriteRange){.address = address, .size = size};
+}
+
+static inline void touchMemory(CPU* cpu, ui16 address, ui32 size)
+{
+  markDirty(cpu, address, size);
+  if (cpu->watch && isWatched(cpu->watch, address, size))
+  {
+    watchAccess(cpu, address, size, 1);
+  }
+  if (cpu->writeLog)
+  {
+    logWrite(cpu->writeLog, address, size);
+  }
+  if (overlapsCode(cpu, address, size))
+  {
+    invalidateDecodedInstructions(cpu, address, size);
+  }
+}
+
+static inline void setMemoryValue(CPU* cpu, ui16 dest, Immediate value)
+{
+  touchMemory(cpu, dest, value.size == SIXTEEN ? 2 : 1);
+  if (value.size == SIXTEEN)
+  {
+    cpu->memory[dest]     = value.immediate16 & 0xFF;
+    cpu->memory[dest + 1] = value.immediate16 >> 8;
+  }
+  else
+  {
+    cpu->memory[dest] = value.immediate8;
+  }
+}
+
+void executeMoveInstruction(CPU* cpu, Operand* operands)
+{
+  Immediate immediate = getOperandValue(cpu, operands[1]);
+  if (operands[0].type == REGISTER)
+  {
+    setRegisterValue(cpu, &operands[0].reg, immediate.size == EIGHT ? immediate.immediate8 : immediate.immediate16);
+  }
+  else if (operands[0].type == EFFECTIVEADDRESS)
+  {
+    ui16 dest = getEffectiveAddress(cpu, operands[0].effectiveAddress);
+    setMemoryValue(cpu, dest, immediate);
+  }
+}
+
+void executeAddInstruction(CPU* cpu, Operand* operands)
+{
+  Immediate op1 = getOperandValue(cpu, operands[1]);
+  Immediate op0 = getOperandValue(cpu, operands[0]);
+  ui16      res = IMMEDIATE_VALUE(op0) + IMMEDIATE_VALUE(op1);
+  if (operands[0].type == REGISTER)
+  {
+    setRegisterValue(cpu, &operands[0].reg, res);
+    setLazyFlags(cpu, ADD, IMMEDIATE_VALUE(op0), IMMEDIATE_VALUE(op1), res, operands[0].reg.size == SIXTEEN);
+  }
+}
+void executeJumpNotZeroInstruction(CPU* cpu, Operand* operands, ui8** buffer)
+{
+  if (!getZF(cpu))
+  {
+    *buffer += *(i8*)&operands[0].immediate.immediate8;
+  }
+}
+
+void executeCmpInstruction(CPU* cpu, Operand* operands)
+{
+  Immediate op1 = getOperandValue(cpu, operands[1]);
+  Immediate op0 = getOperandValue(cpu, operands[0]);
+  ui16      res = IMMEDIATE_VALUE(op0) - IMMEDIATE_VALUE(op1);
+
+  if (operands[0].type == REGISTER)
+  {
+    setLazyFlags(cpu, CMP, IMMEDIATE_VALUE(op0), IMMEDIATE_VALUE(op1), res, operands[0].reg.size == SIXTEEN);
+  }
+}
+
+void executeSubInstruction(CPU* cpu, Operand* operands)
+{
+  Immediate op1 = getOperandValue(cpu, operands[1]);
+  Immediate op0 = getOperandValue(cpu, operands[0]);
+  ui16      res = IMMEDIATE_VALUE(op0) - IMMEDIATE_VALUE(op1);
+  if (operands[0].type == REGISTER)
+  {
+    setRegisterValue(cpu, &operands[0].reg, res);
+    setLazyFlags(cpu, SUB, IMMEDIATE_VALUE(op0), IMMEDIATE_VALUE(op1), res, operands[0].reg.size == SIXTEEN);
+  }
+}
+
+// There are no segments in this simulator, si and di index memory directly so the only bound is the 16 bit wrap
+static inline ui16 readMemory(CPU* cpu, ui16 address, bool wide)
+{
+  watchRead(cpu, address, wide ? 2 : 1);
+  return wide ? cpu->memory[address] | (cpu->memory[(ui16)(address + 1)] << 8) : cpu->memory[address];
+}
+
+static void stepStringOperation(CPU* cpu, Operation op, bool wide, i16 delta)
+{
+  ui16*         registers = cpu->registers;
+  ImmediateSize size      = wide ? SIXTEEN : EIGHT;
+  switch (op)
+  {
+  case MOVS:
+  {
+    setMemoryValue(cpu, registers[DI], (Immediate){.size = size, .immediate16 = readMemory(cpu, registers[SI], wide)});
+    registers[SI] += delta;
+    registers[DI] += delta;
+    break;
+  }
+  case STOS:
+  {
+    setMemoryValue(cpu, registers[DI], (Immediate){.size = size, .immediate16 = registers[A]});
+    registers[DI] += delta;
+    break;
+  }
+  case LODS:
+  {
+    ui16 value    = readMemory(cpu, registers[SI], wide);
+    registers[A]  = wide ? value : (registers[A] & 0xFF00) | value;
+    registers[SI] += delta;
+    break;
+  }
+  case CMPS:
+  {
+    ui16 left  = readMemory(cpu, registers[SI], wide);
+    ui16 right = readMemory(cpu, registers[DI], wide);
+    setLazyFlags(cpu, CMP, left, right, left - right, wide);
+    registers[SI] += delta;
+    registers[DI] += delta;
+    break;
+  }
+  case SCAS:
+  {
+    ui16 left  = wide ? registers[A] : registers[A] & 0xFF;
+    ui16 right = readMemory(cpu, registers[DI], wide);
+    setLazyFlags(cpu, CMP, left, right, left - right, wide);
+    registers[DI] += delta;
+    break;
+  }
+  default:
+  {
+    break;
+  }
+  }
+}
+
+// Forward byte compares and scans with repe/repne, returns how many elements ran including the one that stopped it
+static ui32 scanBytes(CPU* cpu, Instruction* instruction, ui32 count)
+{
+  ui16* registers = cpu->registers;
+  ui8*  right     = &cpu->memory[registers[DI]];
+  bool  stopEqual = instruction->rep == REP_NE;
+  ui32  stop      = count;
+  if (instruction->op == SCAS)
+  {
+    ui8 value = registers[A] & 0xFF;
+    if (stopEqual)
+    {
+      ui8* found = (ui8*)memchr(right, value, count);
+      stop       = found ? (ui32)(found - right) : count;
+    }
+    else
+    {
+      for (stop = 0; stop < count && right[stop] == value; stop++)
+      {
+      }
+    }
+  }
+  else
+  {
+    ui8* left = &cpu->memory[registers[SI]];
+    for (stop = 0; stop < count && (left[stop] == right[stop]) != stopEqual; stop++)
+    {
+    }
+  }
+  return stop < count ? stop + 1 : count;
+}
+
+// Repeats while cx isn't zero, using host bulk operations whenever the result is the same as stepping element by element
+static ui32 runRepeatedStringOperation(CPU* cpu, Instruction* instruction)
+{
+  ui16* registers  = cpu->registers;
+  bool  wide       = instruction->wide;
+  i32   size       = wide ? 2 : 1;
+  bool  backward   = GETFLAG(cpu->flags, DF);
+  i16   delta      = backward ? -size : size;
+  ui32  count      = registers[C];
+  i32   bytes      = count * size;
+  // lowest address each side touches, out of range when the operation would wrap around 64K
+  i32   sourceLow  = backward ? registers[SI] + size - bytes : registers[SI];
+  i32   destLow    = backward ? registers[DI] + size - bytes : registers[DI];
+  bool  sourceFits = sourceLow >= 0 && sourceLow + bytes <= 0x10000;
+  bool  destFits   = destLow >= 0 && destLow + bytes <= 0x10000;
+  if (count == 0)
+  {
+    return 0;
+  }
+  if (cpu->watch)
+  {
+    // watched accesses have to be seen element by element
+    for (ui32 i = 0; i < count; i++)
+    {
+      stepStringOperation(cpu, instruction->op, wide, delta);
+      registers[C]--;
+      if ((instruction->op == CMPS || instruction->op == SCAS) && getZF(cpu) == (instruction->rep == REP_NE))
+      {
+        return i + 1;
+      }
+    }
+    return count;
+  }
+
+  switch (instruction->op)
+  {
+  case MOVS:
+  {
+    // stepping replicates bytes when the destination runs into source bytes that haven't been read yet, memmove doesn't
+    bool overlaps = backward ? destLow < sourceLow && destLow + bytes > sourceLow : destLow > sourceLow && destLow < sourceLow + bytes;
+    if (sourceFits && destFits && !overlaps)
+    {
+      touchMemory(cpu, destLow, bytes);
+      memmove(&cpu->memory[destLow], &cpu->memory[sourceLow], bytes);
+      registers[SI] += count * delta;
+      registers[DI] += count * delta;
+      registers[C] = 0;
+      return count;
+    }
+    break;
+  }
+  case STOS:
+  {
+    if (destFits)
+    {
+      ui8 low  = registers[A] & 0xFF;
+      ui8 high = registers[A] >> 8;
+      touchMemory(cpu, destLow, bytes);
+      if (!wide || low == high)
+      {
+        memset(&cpu->memory[destLow], low, bytes);
+      }
+      else
+      {
+        for (i32 i = 0; i < bytes; i += 2)
+        {
+          cpu->memory[destLow + i]     = low;
+          cpu->memory[destLow + i + 1] = high;
+        }
+      }
+      registers[DI] += count * delta;
+      registers[C] = 0;
+      return count;
+    }
+    break;
+  }
+  case LODS:
+  {
+    // only the last element survives in the accumulator
+    registers[SI] += (count - 1) * delta;
+    stepStringOperation(cpu, LODS, wide, delta);
+    registers[C] = 0;
+    return count;
+  }
+  case CMPS:
+  case SCAS:
+  {
+    if (!wide && !backward && destFits && (instruction->op == SCAS || sourceFits))
+    {
+      ui32 iterations = scanBytes(cpu, instruction, count);
+      // the flags come from the element that stopped the scan
+      registers[SI] += (iterations - 1) * (instruction->op == CMPS ? delta : 0);
+      registers[DI] += (iterations - 1) * delta;
+      stepStringOperation(cpu, instruction->op, wide, delta);
+      registers[C] -= iterations;
+      return iterations;
+    }
+    ui32 iterations = 0;
+    while (registers[C])
+    {
+      stepStringOperation(cpu, instruction->op, wide, delta);
+      registers[C]--;
+      iterations++;
+      if (getZF(cpu) == (instruction->rep == REP_NE))
+      {
+        break;
+      }
+    }
+    return iterations;
+  }
+  default:
+  {
+    break;
+  }
+  }
+
+  for (ui32 i = 0; i < count; i++)
+  {
+    stepStringOperation(cpu, instruction->op, wide, delta);
+  }
+  registers[C] = 0;
+  return count;
+}
+
+struct StringTiming
+{
+  ui8  single;
+  ui8  perRepetition;
+  bool source;
+  bool dest;
+};
+typedef struct StringTiming StringTiming;
+
+#define REP_BASE_CYCLES 9
+
+StringTiming stringTimingTable[SCAS - MOVS + 1] = {
+    [MOVS - MOVS] = {18, 17, true, true}, [CMPS - MOVS] = {22, 22, true, true}, [STOS - MOVS] = {11, 10, false, true},
+    [LODS - MOVS] = {12, 13, true, false}, [SCAS - MOVS] = {15, 15, false, true},
+};
+
+// The cost depends on how many elements ran, so it's left in cpu->stringCycles instead of coming from calcCycles
+void executeStringInstruction(CPU* cpu, Instruction* instruction)
+{
+  StringTiming timing    = stringTimingTable[instruction->op - MOVS];
+  ui16*        registers = cpu->registers;
+  // si and di step by the element size so every element pays the same alignment penalty
+  ui32 penalty = (timing.source ? calcPenalty(cpu, registers[SI], instruction->wide, 1) : 0) + (timing.dest ? calcPenalty(cpu, registers[DI], instruction->wide, 1) : 0);
+  if (instruction->rep == REP_NONE)
+  {
+    bool wide = instruction->wide;
+    stepStringOperation(cpu, instruction->op, wide, GETFLAG(cpu->flags, DF) ? -(wide ? 2 : 1) : (wide ? 2 : 1));
+    cpu->stringCycles = (Cycles){.normal = timing.single, .ea = 0, .penalty = penalty};
+    return;
+  }
+  ui32 iterations   = runRepeatedStringOperation(cpu, instruction);
+  cpu->stringCycles = (Cycles){.normal = REP_BASE_CYCLES + iterations * timing.perRepetition, .ea = 0, .penalty = iterations * penalty};
+}
+
+void executeDirectionInstruction(CPU* cpu, Operation op)
+{
+  getFlags(cpu);
+  if (op == STD)
+  {
+    SETFLAG(cpu->flags, DF);
+  }
+  else
+  {
+    cpu->flags &= ~(1 << DF);
+  }
+}
+
+bool executeInstruction(CPU* cpu, Instruction instruction, ui8** buffer)
+{
+  switch (instruction.op)
+  {
+  case MOV:
+  {
+    executeMoveInstruction(cpu, instruction.operands);
+    break;
+  }
+  case ADD:
+  {
+    executeAddInstruction(cpu, instruction.operands);
+    break;
+  }
+  case SUB:
+  {
+    executeSubInstruction(cpu, instruction.operands);
+    break;
+  }
+  case CMP:
+  {
+    executeCmpInstruction(cpu, instruction.operands);
+    break;
+  }
+  case JNZ:
+  {
+    executeJumpNotZeroInstruction(cpu, instruction.operands, buffer);
+    break;
+  }
+  case MOVS:
+  case CMPS:
+  case STOS:
+  case LODS:
+  case SCAS:
+  {
+    executeStringInstruction(cpu, &instruction);
+    break;
+  }
+  case CLD:
+  case STD:
+  {
+    executeDirectionInstruction(cpu, instruction.op);
+    break;
+  }
+  default:
+  {
+    return false;
+  }
+  }
+  return true;
+}
+
+static inline bool isFusableWithJnz(Instruction* instruction)
+{
+  Operand* operands = instruction->operands;
+  return (instruction->op == ADD || instruction->op == SUB || instruction->op == CMP) && operands[0].type == REGISTER && operands[0].reg.size == SIXTEEN &&
+         (operands[1].type == IMMEDIATE || (operands[1].type == REGISTER && operands[1].reg.size == SIXTEEN));
+}
+
+// The pair spans at most 6 bytes, so a write to the jnz still lands within MAX_INSTRUCTION_LENGTH - 1 bytes of the fused entry and invalidates it
+static void fuseDecodedInstruction(CPU* cpu, DecodedInstruction* decoded, ui8* next)
+{
+  decoded->fusedJnz = false;
+  Instruction jump;
+  ui8*        end = next;
+  if (!isFusableWithJnz(&decoded->instruction) || next + 2 > cpu->start + cpu->codeLength || !decodeInstruction(&jump, &end) || jump.op != JNZ)
+  {
+    return;
+  }
+  Instruction current = cpu->instruction;
+  cpu->instruction    = decoded->instruction;
+  Cycles cycles       = calcCycles(cpu);
+  cpu->instruction    = current;
+
+  decoded->fusedJnz     = true;
+  decoded->fusedSize    = (ui8)(end - next) + decoded->size;
+  decoded->fusedCycles  = cycles.normal + cycles.ea;
+  decoded->displacement = *(i8*)&jump.operands[0].immediate.immediate8;
+}
+
+// Instructions are decoded the first time their ip is reached and executed from the cache afterwards
+static inline DecodedInstruction* fetchDecodedInstruction(CPU* cpu, ui8* buffer)
+{
+  DecodedInstruction* decoded = &cpu->decoded[buffer - cpu->start];
+  if (!decoded->valid)
+  {
+    ui8* next = buffer;
+    if (!decodeInstruction(&decoded->instruction, &next))
+    {
+      return NULL;
+    }
+    decoded->size  = (ui8)(next - buffer);
+    decoded->valid = true;
+    fuseDecodedInstruction(cpu, decoded, next);
+  }
+  return decoded;
+}
+
+// Both halves of a fused pair in one step, the flags stay lazy and the jnz branches on the result directly
+static inline ui64 executeFusedJnz(CPU* cpu, DecodedInstruction* decoded, ui8** buffer)
+{
+  Operand*  operands = decoded->instruction.operands;
+  Operation op       = decoded->instruction.op;
+  ui16      left     = cpu->registers[operands[0].reg.type];
+  ui16      right    = operands[1].type == IMMEDIATE ? IMMEDIATE_VALUE(operands[1].immediate) : cpu->registers[operands[1].reg.type];
+  ui16      result   = op == ADD ? left + right : left - right;
+  if (op != CMP)
+  {
+    cpu->registers[operands[0].reg.type] = result;
+  }
+  setLazyFlags(cpu, op, left, right, result, true);
+  cpu->fusedExecuted++;
+  *buffer += decoded->fusedSize;
+  if (result != 0)
+  {
+    *buffer += decoded->displacement;
+    return decoded->fusedCycles + jumpCycles(JNZ, true);
+  }
+  return decoded->fusedCycles + jumpCycles(JNZ, false);
+}
+
+void debugMemory(CPU* cpu)
+{
+  printf("memory:\n");
+  for (i32 i = 0; i < MEMORY_SIZE; i++)
+  {
+    if (cpu->memory[i] != 0)
+    {
+      printf("%d", cpu->memory[i]);
+    }
+  }
+}
+
+static inline void markCodePages(CPU* cpu)
+{
+  if (cpu->codeLength)
+  {
+    markPages(cpu->dirtyPages, cpu->codeBase, cpu->codeLength);
+  }
+}
+
+// Zeroes a page and puts back whatever part of the loaded program it holds. The decode cache only has to go
+// when the program bytes were actually overwritten, otherwise every reset would throw away the decoded code
+static void clearPage(CPU* cpu, ui32 page)
+{
+  ui32 address = page << PAGE_SHIFT;
+  if (!overlapsCode(cpu, address, PAGE_SIZE))
+  {
+    memset(&cpu->memory[address], 0, PAGE_SIZE);
+    return;
+  }
+  ui32 first       = address > cpu->codeBase ? address : cpu->codeBase;
+  ui32 last        = address + PAGE_SIZE < cpu->codeBase + cpu->codeLength ? address + PAGE_SIZE : cpu->codeBase + cpu->codeLength;
+  bool codeChanged = memcmp(&cpu->memory[first], &cpu->image[first - cpu->codeBase], last - first) != 0;
+  memset(&cpu->memory[address], 0, PAGE_SIZE);
+  memcpy(&cpu->memory[first], &cpu->image[first - cpu->codeBase], last - first);
+  if (codeChanged)
+  {
+    invalidateDecodedInstructions(cpu, address, PAGE_SIZE);
+  }
+}
+
+// Every page outside the dirty bitmap is zero, so clearing, snapshotting and comparing memory only has to visit touched pages.
+// The pages holding the program are always in the bitmap and go back to the loaded image
+static void resetMemory(CPU* cpu)
+{
+  for (ui32 page = 0; page < PAGE_COUNT; page++)
+  {
+    if (isPageSet(cpu->dirtyPages, page))
+    {
+      clearPage(cpu, page);
+    }
+  }
+  memset(cpu->dirtyPages, 0, sizeof(cpu->dirtyPages));
+  markCodePages(cpu);
+}
+
+struct MemorySnapshot
+{
+  ui64  dirtyPages[DIRTY_WORDS];
+  ui32  pageCount;
+  ui8*  pages;
+};
+typedef struct MemorySnapshot MemorySnapshot;
+
+static void takeSnapshot(CPU* cpu, MemorySnapshot* snapshot)
+{
+  memcpy(snapshot->dirtyPages, cpu->dirtyPages, sizeof(cpu->dirtyPages));
+  snapshot->pageCount = 0;
+  for (ui32 word = 0; word < DIRTY_WORDS; word++)
+  {
+    snapshot->pageCount += __builtin_popcountll(cpu->dirtyPages[word]);
+  }
+  snapshot->pages = (ui8*)malloc((ui64)snapshot->pageCount * PAGE_SIZE);
+
+  ui8* page = snapshot->pages;
+  for (ui32 i = 0; i < PAGE_COUNT; i++)
+  {
+    if (isPageSet(cpu->dirtyPages, i))
+    {
+      memcpy(page, &cpu->memory[i << PAGE_SHIFT], PAGE_SIZE);
+      page += PAGE_SIZE;
+    }
+  }
+}
+
+// Pages touched since the snapshot are zeroed unless the snapshot holds a copy of them. The code pages are always
+// in the bitmap, so only a page whose bytes really differ is copied back and invalidates decoded code
+static void restoreSnapshot(CPU* cpu, MemorySnapshot* snapshot)
+{
+  ui8* page = snapshot->pages;
+  for (ui32 i = 0; i < PAGE_COUNT; i++)
+  {
+    if (isPageSet(snapshot->dirtyPages, i))
+    {
+      ui8* memory = &cpu->memory[i << PAGE_SHIFT];
+      if (memcmp(memory, page, PAGE_SIZE) != 0)
+      {
+        memcpy(memory, page, PAGE_SIZE);
+        if (overlapsCode(cpu, i << PAGE_SHIFT, PAGE_SIZE))
+        {
+          invalidateDecodedInstructions(cpu, i << PAGE_SHIFT, PAGE_SIZE);
+        }
+      }
+      page += PAGE_SIZE;
+    }
+    else if (isPageSet(cpu->dirtyPages, i))
+    {
+      clearPage(cpu, i);
+    }
+  }
+  memcpy(cpu->dirtyPages, snapshot->dirtyPages, sizeof(cpu->dirtyPages));
+  markCodePages(cpu);
+}
+
+static void freeSnapshot(MemorySnapshot* snapshot)
+{
+  free(snapshot->pages);
+  snapshot->pages     = 0;
+  snapshot->pageCount = 0;
+}
+
+static bool compareMemory(CPU* a, CPU* b)
+{
+  for (ui32 page = 0; page < PAGE_COUNT; page++)
+  {
+    if ((isPageSet(a->dirtyPages, page) || isPageSet(b->dirtyPages, page)) &&
+        memcmp(&a->memory[page << PAGE_SHIFT], &b->memory[page << PAGE_SHIFT], PAGE_SIZE) != 0)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+enum ThreadedHandler
+{
+  THREADED_MOV_R16_R16,
+  THREADED_MOV_R16_IMM,
+  THREADED_MOV_R16_MEM,
+  THREADED_MOV_MEM_R16,
+  THREADED_ADD_R16_R16,
+  THREADED_ADD_R16_IMM,
+  THREADED_SUB_R16_R16,
+  THREADED_SUB_R16_IMM,
+  THREADED_CMP_R16_R16,
+  THREADED_CMP_R16_IMM,
+  THREADED_JNZ,
+  THREADED_JUMP_NOP,
+  THREADED_GENERIC,
+  THREADED_EXIT,
+  THREADED_HANDLER_COUNT
+};
+typedef enum ThreadedHandler ThreadedHandler;
+
+struct ThreadedInstruction
+{
+  void*                       handler;
+  ThreadedHandler             kind;
+  ui8                         dest;
+  ui8                         source;
+  ui16                        immediate;
+  ui8                         cycles;
+  ui8                         takenCycles;
+  ui8                         penalty;
+  struct ThreadedInstruction* target;
+  Instruction                 instruction;
+};
+typedef struct ThreadedInstruction ThreadedInstruction;
+
+struct ThreadedProgram
+{
+  ThreadedInstruction* instructions;
+  ui32                 count;
+  bool                 resolved;
+};
+typedef struct ThreadedProgram ThreadedProgram;
+
+static inline bool isRegister16(Operand* operand)
+{
+  return operand->type == REGISTER && operand->reg.size == SIXTEEN;
+}
+
+static ThreadedHandler selectThreadedHandler(Instruction* instruction)
+{
+  Operand* operands = instruction->operands;
+  switch (instruction->op)
+  {
+  case MOV:
+  {
+    if (isRegister16(&operands[0]))
+    {
+      if (isRegister16(&operands[1]))
+      {
+        return THREADED_MOV_R16_R16;
+      }
+      if (operands[1].type == IMMEDIATE)
+      {
+        return THREADED_MOV_R16_IMM;
+      }
+      if (operands[1].type == EFFECTIVEADDRESS)
+      {
+        return THREADED_MOV_R16_MEM;
+      }
+    }
+    else if (operands[0].type == EFFECTIVEADDRESS && isRegister16(&operands[1]))
+    {
+      return THREADED_MOV_MEM_R16;
+    }
+    return THREADED_GENERIC;
+  }
+  case ADD:
+  case SUB:
+  case CMP:
+  {
+    if (!isRegister16(&operands[0]) || !(isRegister16(&operands[1]) || operands[1].type == IMMEDIATE))
+    {
+      return THREADED_GENERIC;
+    }
+    bool            immediate = operands[1].type == IMMEDIATE;
+    ThreadedHandler handler   = instruction->op == ADD ? THREADED_ADD_R16_R16 : instruction->op == SUB ? THREADED_SUB_R16_R16 : THREADED_CMP_R16_R16;
+    return (ThreadedHandler)(handler + immediate);
+  }
+  case JNZ:
+  {
+    return THREADED_JNZ;
+  }
+  default:
+  {
+    // the interpreter doesn't execute the remaining jumps either
+    return isJump(instruction->op) ? THREADED_JUMP_NOP : THREADED_GENERIC;
+  }
+  }
+}
+
+// Decodes the whole program once, picks a handler per opcode and operand form and resolves jump targets,
+// the last instruction is an exit sentinel so running off the end of the code needs no bounds check
+bool translateThreadedProgram(CPU* cpu, ThreadedProgram* program, ui8* code, ui32 len)
+{
+  i32*  ipToIndex       = (i32*)malloc(sizeof(i32) * (len + 1));
+  ui32* ips             = (ui32*)malloc(sizeof(ui32) * (len + 1));
+  program->instructions = (ThreadedInstruction*)calloc(len + 1, sizeof(ThreadedInstruction));
+  program->count        = 0;
+  program->resolved     = false;
+  for (ui32 i = 0; i <= len; i++)
+  {
+    ipToIndex[i] = -1;
+  }
+
+  ui8* buffer = code;
+  while (buffer < code + len)
+  {
+    ui32                 ip          = (ui32)(buffer - code);
+    ThreadedInstruction* instruction = &program->instructions[program->count];
+    if (!decodeInstruction(&instruction->instruction, &buffer))
+    {
+      printf("UNKNOWN INSTRUCTION ");
+      debugByte(buffer[0]);
+      free(ipToIndex);
+      free(ips);
+      return false;
+    }
+    Operand* operands      = instruction->instruction.operands;
+    instruction->kind      = selectThreadedHandler(&instruction->instruction);
+    instruction->dest      = operands[0].reg.type;
+    instruction->source    = operands[1].reg.type;
+    instruction->immediate = operands[1].type == IMMEDIATE ? IMMEDIATE_VALUE(operands[1].immediate) : 0;
+
+    if (isJump(instruction->instruction.op))
+    {
+      instruction->cycles      = jumpCycles(instruction->instruction.op, false);
+      instruction->takenCycles = jumpCycles(instruction->instruction.op, true);
+    }
+    else
+    {
+      cpu->instruction    = instruction->instruction;
+      Cycles cycles       = calcCycles(cpu);
+      instruction->cycles = cycles.normal + cycles.ea;
+    }
+
+    ipToIndex[ip]       = program->count;
+    ips[program->count] = (ui32)(buffer - code);
+    program->count++;
+  }
+  ipToIndex[len]                             = program->count;
+  program->instructions[program->count].kind = THREADED_EXIT;
+
+  for (ui32 i = 0; i < program->count; i++)
+  {
+    ThreadedInstruction* instruction = &program->instructions[i];
+    if (instruction->kind != THREADED_JNZ)
+    {
+      continue;
+    }
+    i32 target = (i32)ips[i] + *(i8*)&instruction->instruction.operands[0].immediate.immediate8;
+    if (target < 0 || target > (i32)len || ipToIndex[target] == -1)
+    {
+      printf("Jump to ip %d is not the start of an instruction\n", target);
+      target = len;
+    }
+    instruction->target = &program->instructions[ipToIndex[target]];
+  }
+
+  free(ipToIndex);
+  free(ips);
+  return true;
+}
+
+#define THREADED_NEXT()                                                                                                                                                                                \
+  instruction++;                                                                                                                                                                                       \
+  goto *instruction->handler
+
+// Runs the translated program with every handler jumping straight to the next one, returns the simulated cycles
+ui64 runThreadedProgram(CPU* cpu, ThreadedProgram* program)
+{
+  static void* labels[THREADED_HANDLER_COUNT] = {
+      [THREADED_MOV_R16_R16] = &&movR16R16, [THREADED_MOV_R16_IMM] = &&movR16Imm, [THREADED_MOV_R16_MEM] = &&movR16Mem, [THREADED_MOV_MEM_R16] = &&movMemR16,
+      [THREADED_ADD_R16_R16] = &&addR16R16, [THREADED_ADD_R16_IMM] = &&addR16Imm, [THREADED_SUB_R16_R16] = &&subR16R16, [THREADED_SUB_R16_IMM] = &&subR16Imm,
+      [THREADED_CMP_R16_R16] = &&cmpR16R16, [THREADED_CMP_R16_IMM] = &&cmpR16Imm, [THREADED_JNZ] = &&jnz,                 [THREADED_JUMP_NOP] = &&jumpNop,
+      [THREADED_GENERIC] = &&generic,       [THREADED_EXIT] = &&done,
+  };
+  if (!program->resolved)
+  {
+    for (ui32 i = 0; i <= program->count; i++)
+    {
+      program->instructions[i].handler = labels[program->instructions[i].kind];
+    }
+    program->resolved = true;
+  }
+
+  ui16*                registers   = cpu->registers;
+  ui64                 cycles      = 0;
+  ThreadedInstruction* instruction = program->instructions;
+  goto *instruction->handler;
+
+movR16R16:
+  cycles += instruction->cycles;
+  registers[instruction->dest] = registers[instruction->source];
+  THREADED_NEXT();
+
+movR16Imm:
+  cycles += instruction->cycles;
+  registers[instruction->dest] = instruction->immediate;
+  THREADED_NEXT();
+
+movR16Mem:
+{
+  Operand*  source  = &instruction->instruction.operands[1];
+  ui16      address = getEffectiveAddress(cpu, source->effectiveAddress);
+  Immediate value   = getOperandValue(cpu, *source);
+  cycles += instruction->cycles + calcPenalty(cpu, address, true, 1);
+  registers[instruction->dest] = IMMEDIATE_VALUE(value);
+  THREADED_NEXT();
+}
+
+movMemR16:
+{
+  ui16 address = getEffectiveAddress(cpu, instruction->instruction.operands[0].effectiveAddress);
+  cycles += instruction->cycles + calcPenalty(cpu, address, true, 1);
+  setMemoryValue(cpu, address, (Immediate){.size = SIXTEEN, .immediate16 = registers[instruction->source]});
+  THREADED_NEXT();
+}
+
+addR16R16:
+{
+  ui16 left  = registers[instruction->dest];
+  ui16 right = registers[instruction->source];
+  cycles += instruction->cycles;
+  registers[instruction->dest] = left + right;
+  setLazyFlags(cpu, ADD, left, right, left + right, true);
+  THREADED_NEXT();
+}
+
+addR16Imm:
+{
+  ui16 left = registers[instruction->dest];
+  cycles += instruction->cycles;
+  registers[instruction->dest] = left + instruction->immediate;
+  setLazyFlags(cpu, ADD, left, instruction->immediate, left + instruction->immediate, true);
+  THREADED_NEXT();
+}
+
+subR16R16:
+{
+  ui16 left  = registers[instruction->dest];
+  ui16 right = registers[instruction->source];
+  cycles += instruction->cycles;
+  registers[instruction->dest] = left - right;
+  setLazyFlags(cpu, SUB, left, right, left - right, true);
+  THREADED_NEXT();
+}
+
+subR16Imm:
+{
+  ui16 left = registers[instruction->dest];
+  cycles += instruction->cycles;
+  registers[instruction->dest] = left - instruction->immediate;
+  setLazyFlags(cpu, SUB, left, instruction->immediate, left - instruction->immediate, true);
+  THREADED_NEXT();
+}
+
+cmpR16R16:
+{
+  ui16 left  = registers[instruction->dest];
+  ui16 right = registers[instruction->source];
+  cycles += instruction->cycles;
+  setLazyFlags(cpu, CMP, left, right, left - right, true);
+  THREADED_NEXT();
+}
+
+cmpR16Imm:
+{
+  ui16 left = registers[instruction->dest];
+  cycles += instruction->cycles;
+  setLazyFlags(cpu, CMP, left, instruction->immediate, left - instruction->immediate, true);
+  THREADED_NEXT();
+}
+
+jnz:
+  if (!getZF(cpu))
+  {
+    cycles += instruction->takenCycles;
+    instruction = instruction->target;
+    goto *instruction->handler;
+  }
+  cycles += instruction->cycles;
+  THREADED_NEXT();
+
+jumpNop:
+  cycles += instruction->cycles;
+  THREADED_NEXT();
+
+generic:
+{
+  cpu->instruction     = instruction->instruction;
+  Cycles genericCycles = calcCycles(cpu);
+  executeInstruction(cpu, instruction->instruction, NULL);
+  if (isStringOperation(instruction->instruction.op))
+  {
+    genericCycles = cpu->stringCycles;
+  }
+  cycles += genericCycles.normal + genericCycles.ea + genericCycles.penalty;
+  THREADED_NEXT();
+}
+
+done:
+  return cycles;
+}
+
+typedef bool (*DecodeInstructionFunction)(Instruction* instruction, ui8** buffer);
+
+#define BENCHMARK_STREAM_SIZE  (16 * 1024 * 1024)
+#define BENCHMARK_REPETITIONS  10
+
+static f64 readTime()
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (f64)time.tv_sec + (f64)time.tv_nsec / 1000000000.0;
+}
+
+// xorshift64*, unlike rand the same seed gives the same stream everywhere
+struct RandomSeries
+{
+  ui64 state;
+};
+typedef struct RandomSeries RandomSeries;
+
+static inline ui64 nextRandom(RandomSeries* series)
+{
+  series->state ^= series->state >> 12;
+  series->state ^= series->state << 25;
+  series->state ^= series->state >> 27;
+  return series->state * 0x2545F4914F6CDD1DULL;
+}
+
+enum InstructionClass
+{
+  CLASS_MOV,
+  CLASS_ARITHMETIC,
+  CLASS_JUMP,
+  CLASS_STRING,
+  CLASS_COUNT
+};
+typedef enum InstructionClass InstructionClass;
+
+const char* classNames[] = {"mov", "arith", "jump", "string"};
+
+// Relative weight of each class, all zero picks uniformly over every valid opcode
+struct InstructionMix
+{
+  const char* name;
+  ui32        weights[CLASS_COUNT];
+};
+typedef struct InstructionMix InstructionMix;
+
+InstructionMix instructionMixes[] = {
+    {"opcodes", {0, 0, 0, 0}}, {"even", {1, 1, 1, 1}}, {"mov", {8, 1, 1, 0}}, {"arith", {1, 8, 1, 0}}, {"branchy", {2, 3, 5, 0}}, {"string", {1, 1, 0, 8}},
+};
+
+#define STREAM_SEED 5581
+
+static InstructionClass classifyOperation(Operation op)
+{
+  if (op == MOV)
+  {
+    return CLASS_MOV;
+  }
+  if (isJump(op))
+  {
+    return CLASS_JUMP;
+  }
+  if (isStringOperation(op) || op == CLD || op == STD)
+  {
+    return CLASS_STRING;
+  }
+  return CLASS_ARITHMETIC;
+}
+
+// A mix is either one of instructionMixes by name or comma separated weights in class order, e.g. 4,2,1,1
+static bool parseInstructionMix(const char* text, InstructionMix* mix)
+{
+  for (ui32 i = 0; i < ArrayCount(instructionMixes); i++)
+  {
+    if (strcmp(text, instructionMixes[i].name) == 0)
+    {
+      *mix = instructionMixes[i];
+      return true;
+    }
+  }
+  mix->name = text;
+  for (ui32 i = 0; i < CLASS_COUNT; i++)
+  {
+    char* end;
+    mix->weights[i] = (ui32)strtoul(text, &end, 10);
+    if (end == text || (i + 1 < CLASS_COUNT ? *end != ',' : *end != '\0'))
+    {
+      printf("Unknown mix '%s', expected one of", mix->name);
+      for (ui32 j = 0; j < ArrayCount(instructionMixes); j++)
+      {
+        printf(" %s", instructionMixes[j].name);
+      }
+      printf(" or %d comma separated weights for", CLASS_COUNT);
+      for (ui32 j = 0; j < CLASS_COUNT; j++)
+      {
+        printf(" %s", classNames[j]);
+      }
+      printf("\n");
+      return false;
+    }
+    text = end + 1;
+  }
+  return true;
+}
+
+// Writes a random legal opcode of the class the mix picks followed by random bytes and lets the decoder tell us
+// how many of them the instruction used, string operations get a rep/repe/repne prefix half of the time
+static ui8* generateInstructionStream(InstructionMix* mix, ui64 seed, ui32 capacity, ui32* size, ui32* instructionCount)
+{
+  ui8  opcodes[CLASS_COUNT + 1][256];
+  ui32 opcodeCounts[CLASS_COUNT + 1] = {0};
+  for (ui32 opcode = 0; opcode < 256; opcode++)
+  {
+    if (opcodeTable[opcode].flags & OPCODE_VALID)
+    {
+      InstructionClass group                            = classifyOperation(opcodeTable[opcode].op);
+      opcodes[group][opcodeCounts[group]++]             = (ui8)opcode;
+      opcodes[CLASS_COUNT][opcodeCounts[CLASS_COUNT]++] = (ui8)opcode;
+    }
+  }
+  ui32 totalWeight = 0;
+  for (ui32 i = 0; i < CLASS_COUNT; i++)
+  {
+    totalWeight += opcodeCounts[i] ? mix->weights[i] : 0;
+  }
+
+  RandomSeries series = {seed * 0x9E3779B97F4A7C15ULL + 1};
+  ui8*         stream = (ui8*)malloc(sizeof(ui8) * (capacity + MAX_INSTRUCTION_LENGTH + 1));
+  ui32         count  = 0;
+  ui32         offset = 0;
+  while (offset < capacity)
+  {
+    ui32 group = CLASS_COUNT;
+    if (totalWeight)
+    {
+      ui32 pick = nextRandom(&series) % totalWeight;
+      for (group = 0; pick >= (opcodeCounts[group] ? mix->weights[group] : 0); group++)
+      {
+        pick -= opcodeCounts[group] ? mix->weights[group] : 0;
+      }
+    }
+
+    ui64 bits   = nextRandom(&series);
+    ui8  opcode = opcodes[group][bits % opcodeCounts[group]];
+    ui32 length = 0;
+    if ((opcodeTable[opcode].flags & OPCODE_STRING) && (bits & (1ULL << 32)))
+    {
+      stream[offset + length++] = bits & (1ULL << 33) ? 0xF3 : 0xF2;
+    }
+    stream[offset + length] = opcode;
+    for (i32 i = 1; i < MAX_INSTRUCTION_LENGTH; i++)
+    {
+      stream[offset + length + i] = (ui8)(nextRandom(&series) >> 56);
+    }
+
+    Instruction instruction;
+    ui8*        buffer = &stream[offset];
+    if (!decodeInstruction(&instruction, &buffer))
+    {
+      printf("Generated an encoding the decoder rejects at %d\n", offset);
+      exit(1);
+    }
+    length = (ui32)(buffer - &stream[offset]);
+    if (offset + length > capacity)
+    {
+      break;
+    }
+    offset += length;
+    count++;
+  }
+  *instructionCount = count;
+  *size             = offset;
+  return stream;
+}
+
+// Reruns a test until it goes REPETITION_TIMEOUT seconds without a new fastest run, the clock and the
+// time stamp counter are both kept for the fastest one
+#define REPETITION_TIMEOUT 1.0
+
+struct RepetitionTester
+{
+  f64  bestTime;
+  ui64 bestTicks;
+  f64  lastImprovement;
+  ui32 runs;
+};
+typedef struct RepetitionTester RepetitionTester;
+
+static void startRepetitions(RepetitionTester* tester)
+{
+  tester->bestTime        = 1e9;
+  tester->bestTicks       = 0;
+  tester->lastImprovement = readTime();
+  tester->runs            = 0;
+}
+
+static bool isTesting(RepetitionTester* tester)
+{
+  return tester->runs == 0 || readTime() - tester->lastImprovement < REPETITION_TIMEOUT;
+}
+
+static void countRepetition(RepetitionTester* tester, f64 elapsed, ui64 ticks)
+{
+  tester->runs++;
+  if (elapsed < tester->bestTime)
+  {
+    tester->bestTime        = elapsed;
+    tester->bestTicks       = ticks;
+    tester->lastImprovement = readTime();
+  }
+}
+
+static void benchmarkDecoder(const char* name, DecodeInstructionFunction decode, ui8* stream, ui32 size, ui32 instructionCount)
+{
+  RepetitionTester tester;
+  ui32             checksum = 0;
+  startRepetitions(&tester);
+  while (isTesting(&tester))
+  {
+    ui8*        buffer = stream;
+    ui8*        end    = stream + size;
+    Instruction instruction;
+    ui32        count = 0;
+
+    f64         start      = readTime();
+    ui64        startTicks = __rdtsc();
+    while (buffer < end)
+    {
+      if (!decode(&instruction, &buffer))
+      {
+        printf("%s failed to decode byte at %d\n", name, (i32)(buffer - stream));
+        exit(1);
+      }
+      checksum += instruction.op;
+      count++;
+    }
+    ui64 ticks   = __rdtsc() - startTicks;
+    f64  elapsed = readTime() - start;
+
+    if (count != instructionCount)
+    {
+      printf("%s decoded %d instructions, expected %d\n", name, count, instructionCount);
+      exit(1);
+    }
+    countRepetition(&tester, elapsed, ticks);
+  }
+  printf("%-8s %8.2f Minst/s %8.2f MB/s %6.3f inst/cycle (%.3fms, %d runs, checksum %u)\n", name, instructionCount / tester.bestTime / 1000000.0,
+         size / tester.bestTime / (1024.0 * 1024.0), (f64)instructionCount / tester.bestTicks, tester.bestTime * 1000.0, tester.runs, checksum);
+}
+
+// Cycles are time stamp counter ticks, so they run at the nominal clock rather than the boosted one
+static void benchmarkDecodeMix(InstructionMix* mix, ui64 seed)
+{
+  ui32 size, instructionCount;
+  ui8* stream = generateInstructionStream(mix, seed, BENCHMARK_STREAM_SIZE, &size, &instructionCount);
+
+  printf("Mix %s (", mix->name);
+  for (ui32 i = 0; i < CLASS_COUNT; i++)
+  {
+    printf("%s%s %d", i ? ", " : "", classNames[i], mix->weights[i]);
+  }
+  printf("): %d instructions, %d bytes, seed %lu\n", instructionCount, size, seed);
+  benchmarkDecoder("linear", decodeInstructionLinear, stream, size, instructionCount);
+  benchmarkDecoder("table", decodeInstruction, stream, size, instructionCount);
+  free(stream);
+}
+
+void benchmarkDecode(InstructionMix* mix, ui64 seed)
+{
+  if (mix)
+  {
+    benchmarkDecodeMix(mix, seed);
+    return;
+  }
+  for (ui32 i = 0; i < ArrayCount(instructionMixes); i++)
+  {
+    benchmarkDecodeMix(&instructionMixes[i], seed);
+  }
+}
+
+static bool writeInstructionStream(const char* name, InstructionMix* mix, ui64 seed, ui32 capacity)
+{
+  ui32  size, instructionCount;
+  ui8*  stream  = generateInstructionStream(mix, seed, capacity, &size, &instructionCount);
+  FILE* filePtr = fopen(name, "wb");
+  bool  written = filePtr && fwrite(stream, 1, size, filePtr) == size;
+  written       = filePtr && fclose(filePtr) == 0 && written;
+  free(stream);
+  if (!written)
+  {
+    printf("Failed to write '%s'\n", name);
+    return false;
+  }
+  printf("Wrote %d instructions (%d bytes) of mix %s, seed %lu to %s\n", instructionCount, size, mix->name, seed, name);
+  return true;
+}
+
+// Grows on demand and is meant to be reused, so a whole disassembly ends up in one write call
+struct OutputBuffer
+{
+  char* data;
+  ui64  used;
+  ui64  capacity;
+};
+typedef struct OutputBuffer OutputBuffer;
+
+static void reserveOutput(OutputBuffer* output, ui64 size)
+{
+  if (output->used + size > output->capacity)
+  {
+    output->capacity = (output->used + size) * 2;
+    output->data     = (char*)realloc(output->data, output->capacity);
+  }
+}
+
+static bool flushOutput(OutputBuffer* output, i32 fd)
+{
+  ui64 written = 0;
+  while (written < output->used)
+  {
+    ssize_t result = write(fd, output->data + written, output->used - written);
+    if (result <= 0)
+    {
+      return false;
+    }
+    written += result;
+  }
+  output->used = 0;
+  return true;
+}
+
+static void formatInstructions(Instruction* instructions, ui32 count, OutputBuffer* output)
+{
+  reserveOutput(output, (ui64)count * (MAX_INSTRUCTION_TEXT + 1));
+  char* out = output->data + output->used;
+  for (ui32 i = 0; i < count; i++)
+  {
+    out    = formatInstruction(out, &instructions[i]);
+    *out++ = '\n';
+  }
+  output->used = out - output->data;
+}
+
+#define MAX_UNKNOWN_TEXT 24
+
+static char* formatUnknownByte(char* out, ui8 byte)
+{
+  const char* hex = "0123456789abcdef";
+  out             = formatString(out, "; unknown byte 0x");
+  *out++          = hex[byte >> 4];
+  *out++          = hex[byte & 0xF];
+  *out++          = '\n';
+  return out;
+}
+
+// Bytes that aren't a known opcode get a comment line and are skipped, the rest is decoded in runs
+static void disassemble(ui8* bytes, ui32 len, Instruction* instructions, OutputBuffer* output)
+{
+  ui32 offset = 0;
+  while (offset < len)
+  {
+    ui32 count = decode(bytes + offset, len - offset, instructions);
+    formatInstructions(instructions, count, output);
+    for (ui32 i = 0; i < count; i++)
+    {
+      offset += instructions[i].size;
+    }
+    if (offset < len)
+    {
+      reserveOutput(output, MAX_UNKNOWN_TEXT);
+      output->used = formatUnknownByte(output->data + output->used, bytes[offset]) - output->data;
+      offset++;
+    }
+  }
+}
+
+static ui32 decodeSkippingUnknown(ui8* bytes, ui32 len, Instruction* instructions)
+{
+  ui32 total  = 0;
+  ui32 offset = 0;
+  while (offset < len)
+  {
+    ui32 count = decode(bytes + offset, len - offset, instructions + total);
+    for (ui32 i = 0; i < count; i++)
+    {
+      offset += instructions[total + i].size;
+    }
+    total += count;
+    offset += offset < len;
+  }
+  return total;
+}
+
+// The true start of a chunk is at most MAX_INSTRUCTION_LENGTH - 1 bytes past its first byte, so every chunk is walked
+// from each of those candidates. Paths through variable length code resynchronize within a few instructions, a candidate
+// stops as soon as it lands on a boundary of the first path and exits where that path does
+#define DISASM_CANDIDATES MAX_INSTRUCTION_LENGTH
+#define DISASM_MIN_CHUNK  (64 * 1024)
+
+struct DisasmChunk
+{
+  ui32         begin;
+  ui32         end;
+  ui32         entry;
+  ui32         exits[DISASM_CANDIDATES];
+  ui64*        boundaries;
+  OutputBuffer output;
+};
+typedef struct DisasmChunk DisasmChunk;
+
+struct DisasmJobs
+{
+  ui8*         bytes;
+  ui32         len;
+  DisasmChunk* chunks;
+  ui32         count;
+  ui32         next;
+};
+typedef struct DisasmJobs DisasmJobs;
+
+// Same steps as disassemble, an unknown byte is skipped on its own
+static inline ui32 nextBoundary(ui8* bytes, ui32 len, ui32 offset)
+{
+  Instruction instruction;
+  return decodeBounded(bytes + offset, len - offset, &instruction) ? offset + instruction.size : offset + 1;
+}
+
+static void findDisasmExits(DisasmJobs* jobs, DisasmChunk* chunk)
+{
+  ui32 length       = chunk->end - chunk->begin;
+  chunk->boundaries = (ui64*)calloc(length / 64 + 1, sizeof(ui64));
+  ui32 offset       = chunk->begin;
+  while (offset < chunk->end)
+  {
+    ui32 bit = offset - chunk->begin;
+    chunk->boundaries[bit >> 6] |= 1ULL << (bit & 63);
+    offset = nextBoundary(jobs->bytes, jobs->len, offset);
+  }
+  chunk->exits[0] = offset;
+
+  // the first chunk starts at a known boundary and needs no candidates
+  for (ui32 candidate = 1; chunk->begin != 0 && candidate < DISASM_CANDIDATES; candidate++)
+  {
+    offset = chunk->begin + candidate;
+    while (offset < chunk->end && !((chunk->boundaries[(offset - chunk->begin) >> 6] >> ((offset - chunk->begin) & 63)) & 1))
+    {
+      offset = nextBoundary(jobs->bytes, jobs->len, offset);
+    }
+    chunk->exits[candidate] = offset < chunk->end ? chunk->exits[0] : offset;
+  }
+}
+
+// Decodes and formats from the entry the stitching found up to the next chunk's entry
+static void formatDisasmChunk(DisasmJobs* jobs, DisasmChunk* chunk)
+{
+  ui32 offset = chunk->entry;
+  ui32 end    = chunk->end;
+  reserveOutput(&chunk->output, (ui64)(end - chunk->begin + 1) * (MAX_INSTRUCTION_TEXT + 1));
+  char* out = chunk->output.data;
+  while (offset < end)
+  {
+    Instruction instruction;
+    if (decodeBounded(jobs->bytes + offset, jobs->len - offset, &instruction))
+    {
+      out    = formatInstruction(out, &instruction);
+      *out++ = '\n';
+      offset += instruction.size;
+    }
+    else
+    {
+      out = formatUnknownByte(out, jobs->bytes[offset]);
+      offset++;
+    }
+  }
+  chunk->output.used = out - chunk->output.data;
+}
+
+void* runDisasmExitWorker(void* arg)
+{
+  DisasmJobs* jobs = (DisasmJobs*)arg;
+  ui32        index;
+  while ((index = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_RELAXED)) < jobs->count)
+  {
+    findDisasmExits(jobs, &jobs->chunks[index]);
+  }
+  return 0;
+}
+
+void* runDisasmFormatWorker(void* arg)
+{
+  DisasmJobs* jobs = (DisasmJobs*)arg;
+  ui32        index;
+  while ((index = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_RELAXED)) < jobs->count)
+  {
+    formatDisasmChunk(jobs, &jobs->chunks[index]);
+  }
+  return 0;
+}
+
+// The calling thread works through the chunks as well
+static void runDisasmWorkers(DisasmJobs* jobs, ui32 threadCount, void* (*worker)(void*))
+{
+  pthread_t* threadIds = (pthread_t*)malloc(sizeof(pthread_t) * threadCount);
+  jobs->next           = 0;
+  ui32 started         = 1;
+  while (started < threadCount && pthread_create(&threadIds[started], NULL, worker, (void*)jobs) == 0)
+  {
+    started++;
+  }
+  // chunks are pulled from a shared counter, threads that failed to start just leave more of them to the others
+  worker((void*)jobs);
+  for (ui32 i = 1; i < started; i++)
+  {
+    if (pthread_join(threadIds[i], NULL) != 0)
+    {
+      printf("Failed to join?\n");
+      exit(2);
+    }
+  }
+  free(threadIds);
+}
+
+// Produces the same text as disassemble on threadCount threads (0 uses every core), as one buffer per chunk in order.
+// Finding the exits decodes everything once more than the sequential walk, in exchange both passes split over the cores
+static DisasmChunk* disassembleParallel(ui8* bytes, ui32 len, ui32 threadCount, ui32* chunkCount)
+{
+  if (threadCount == 0)
+  {
+    threadCount = (ui32)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  // a few chunks per thread so uneven chunks even out, a single thread gets one chunk and skips the exit pass
+  ui32 chunkSize = threadCount == 1 ? len + 1 : len / (threadCount * 4) + 1;
+  chunkSize      = chunkSize < DISASM_MIN_CHUNK ? DISASM_MIN_CHUNK : chunkSize;
+
+  DisasmJobs jobs;
+  jobs.bytes  = bytes;
+  jobs.len    = len;
+  jobs.count  = len / chunkSize + 1;
+  jobs.chunks = (DisasmChunk*)calloc(jobs.count, sizeof(DisasmChunk));
+  for (ui32 i = 0; i < jobs.count; i++)
+  {
+    jobs.chunks[i].begin = i * chunkSize;
+    jobs.chunks[i].end   = i == jobs.count - 1 ? len : (i + 1) * chunkSize;
+  }
+  threadCount = threadCount > jobs.count ? jobs.count : threadCount;
+
+  // a single chunk is entered at 0 and runs to the end, there is nothing to stitch
+  if (jobs.count > 1)
+  {
+    runDisasmWorkers(&jobs, threadCount, runDisasmExitWorker);
+  }
+  ui32 entry = 0;
+  for (ui32 i = 0; i < jobs.count; i++)
+  {
+    DisasmChunk* chunk = &jobs.chunks[i];
+    chunk->entry       = entry;
+    entry              = chunk->exits[entry - chunk->begin];
+  }
+  runDisasmWorkers(&jobs, threadCount, runDisasmFormatWorker);
+
+  *chunkCount = jobs.count;
+  return jobs.chunks;
+}
+
+static bool writeDisasmChunks(DisasmChunk* chunks, ui32 count, i32 fd)
+{
+  bool written = true;
+  for (ui32 i = 0; i < count; i++)
+  {
+    written = written && flushOutput(&chunks[i].output, fd);
+  }
+  return written;
+}
+
+static void freeDisasmChunks(DisasmChunk* chunks, ui32 count)
+{
+  for (ui32 i = 0; i < count; i++)
+  {
+    free(chunks[i].boundaries);
+    free(chunks[i].output.data);
+  }
+  free(chunks);
+}
+
+// Times decoding, formatting and the write separately. The write goes to an unlinked temporary file so the
+// text is really copied into the page cache, /dev/null discards it without reading and the terminal would measure itself
+void benchmarkDisassembly(const char* name)
+{
+  ui8* bytes;
+  int  len;
+  if (!read_file(&bytes, &len, name))
+  {
+    printf("Failed to read file '%s'\n", name);
+    return;
+  }
+  char outputName[] = "/tmp/decode-bench-XXXXXX";
+  i32  outputFd     = mkstemp(outputName);
+  if (outputFd < 0)
+  {
+    printf("Failed to create a temporary file to write to\n");
+    free(bytes);
+    return;
+  }
+  unlink(outputName);
+
+  Instruction* instructions = (Instruction*)malloc(sizeof(Instruction) * len);
+  OutputBuffer output       = {0};
+  ui32         count        = 0;
+  ui64         textSize     = 0;
+  f64          bestDecode   = 1e9;
+  f64          bestFormat   = 1e9;
+  f64          bestWrite    = 1e9;
+  for (i32 repetition = 0; repetition < BENCHMARK_REPETITIONS; repetition++)
+  {
+    f64 start = readTime();
+    count     = decodeSkippingUnknown(bytes, len, instructions);
+    f64 mid   = readTime();
+    formatInstructions(instructions, count, &output);
+    f64 formatted = readTime();
+    textSize      = output.used;
+    lseek(outputFd, 0, SEEK_SET);
+    flushOutput(&output, outputFd);
+    f64 end = readTime();
+
+    bestDecode = mid - start < bestDecode ? mid - start : bestDecode;
+    bestFormat = formatted - mid < bestFormat ? formatted - mid : bestFormat;
+    bestWrite  = end - formatted < bestWrite ? end - formatted : bestWrite;
+  }
+
+  // the parallel disassembler is measured against disassemble, which also writes the unknown byte comments
+  ui32 threadCount    = (ui32)sysconf(_SC_NPROCESSORS_ONLN);
+  f64  bestSequential = 1e9;
+  f64  bestParallel   = 1e9;
+  bool identical      = true;
+  for (i32 repetition = 0; repetition < BENCHMARK_REPETITIONS; repetition++)
+  {
+    OutputBuffer sequential = {0};
+    f64          start      = readTime();
+    disassemble(bytes, len, instructions, &sequential);
+    f64          mid        = readTime();
+    ui32         chunkCount;
+    DisasmChunk* chunks     = disassembleParallel(bytes, len, threadCount, &chunkCount);
+    f64          end        = readTime();
+    bestSequential          = mid - start < bestSequential ? mid - start : bestSequential;
+    bestParallel            = end - mid < bestParallel ? end - mid : bestParallel;
+
+    ui64 offset = 0;
+    for (ui32 i = 0; i < chunkCount && identical; i++)
+    {
+      identical = offset + chunks[i].output.used <= sequential.used && memcmp(sequential.data + offset, chunks[i].output.data, chunks[i].output.used) == 0;
+      offset += chunks[i].output.used;
+    }
+    identical = identical && offset == sequential.used;
+    freeDisasmChunks(chunks, chunkCount);
+    free(sequential.data);
+  }
+
+  f64 megabytes = len / (1024.0 * 1024.0);
+  printf("Disassembling %s: %d bytes, %d instructions, %lu bytes of text, best of %d\n", name, len, count, textSize, BENCHMARK_REPETITIONS);
+  printf("%-8s %8.3fms %10.2f MB/s\n", "decode", bestDecode * 1000.0, megabytes / bestDecode);
+  printf("%-8s %8.3fms %10.2f MB/s\n", "format", bestFormat * 1000.0, megabytes / bestFormat);
+  printf("%-8s %8.3fms %10.2f MB/s\n", "write", bestWrite * 1000.0, megabytes / bestWrite);
+  printf("%-8s %8.3fms %10.2f MB/s\n", "total", (bestDecode + bestFormat + bestWrite) * 1000.0, megabytes / (bestDecode + bestFormat + bestWrite));
+  printf("%-8s %8.3fms %10.2f MB/s disassemble into a fresh buffer\n", "serial", bestSequential * 1000.0, megabytes / bestSequential);
+  printf("%-8s %8.3fms %10.2f MB/s %d threads, %s\n", "parallel", bestParallel * 1000.0, megabytes / bestParallel, threadCount, identical ? "same text" : "TEXT DIFFERS");
+
+  close(outputFd);
+  free(output.data);
+  free(instructions);
+  free(bytes);
+}
+
+#define TRACE_RING_SIZE  4096
+#define TRACE_FLUSH_SIZE (64 * 1024)
+#define CACHE_LINE_SIZE  64
+
+struct TraceRecord
+{
+  Instruction instruction;
+  Cycles      cycles;
+  ui64        total;
+  bool        executed;
+};
+typedef struct TraceRecord TraceRecord;
+
+// Single producer (the executing thread) and single consumer (the trace writer), each index is only stored by its owner.
+// Both sides keep a private copy of the other index and only reload it when the ring looks full or empty
+struct TraceRing
+{
+  TraceRecord* records;
+  _Alignas(CACHE_LINE_SIZE) ui64 head;
+  ui64                           cachedTail;
+  _Alignas(CACHE_LINE_SIZE) ui64 tail;
+  ui64                           cachedHead;
+  bool                           done;
+  bool                           failed;
+};
+typedef struct TraceRing TraceRing;
+
+static void initTraceRing(TraceRing* ring)
+{
+  ring->records    = (TraceRecord*)malloc(sizeof(TraceRecord) * TRACE_RING_SIZE);
+  ring->head       = 0;
+  ring->cachedTail = 0;
+  ring->tail       = 0;
+  ring->cachedHead = 0;
+  ring->done       = false;
+  ring->failed     = false;
+}
+
+// Only waits when the writer is a whole ring behind, the record is published with a release store of head
+static void pushTraceRecord(TraceRing* ring, TraceRecord* record)
+{
+  ui64 head = ring->head;
+  while (head - ring->cachedTail == TRACE_RING_SIZE)
+  {
+    ring->cachedTail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - ring->cachedTail == TRACE_RING_SIZE)
+    {
+      sched_yield();
+    }
+  }
+  ring->records[head & (TRACE_RING_SIZE - 1)] = *record;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void closeTraceRing(TraceRing* ring)
+{
+  __atomic_store_n(&ring->done, true, __ATOMIC_RELEASE);
+}
+
+// Formats everything published so far in one go, hands the slots back and writes once enough text has piled up or the ring runs dry
+void* runTraceWriter(void* arg)
+{
+  TraceRing*   ring   = (TraceRing*)arg;
+  OutputBuffer output = {0};
+  ui64         tail   = 0;
+  for (;;)
+  {
+    if (tail == ring->cachedHead)
+    {
+      bool done        = __atomic_load_n(&ring->done, __ATOMIC_ACQUIRE);
+      ring->cachedHead = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+      if (tail == ring->cachedHead)
+      {
+        if (done)
+        {
+          break;
+        }
+        if (output.used && !flushOutput(&output, STDOUT_FILENO))
+        {
+          ring->failed = true;
+          output.used  = 0;
+        }
+        sched_yield();
+        continue;
+      }
+    }
+
+    ui64 head = ring->cachedHead;
+    reserveOutput(&output, (head - tail) * (MAX_TRACE_TEXT + 1));
+    char* out = output.data + output.used;
+    for (; tail < head; tail++)
+    {
+      TraceRecord* record = &ring->records[tail & (TRACE_RING_SIZE - 1)];
+      if (!record->executed)
+      {
+        *out++ = '\n';
+      }
+      out = formatTrace(out, &record->instruction, record->cycles, record->total);
+    }
+    output.used = out - output.data;
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    if (output.used >= TRACE_FLUSH_SIZE && !flushOutput(&output, STDOUT_FILENO))
+    {
+      ring->failed = true;
+      output.used  = 0;
+    }
+  }
+  if (!flushOutput(&output, STDOUT_FILENO))
+  {
+    ring->failed = true;
+  }
+  free(output.data);
+  return 0;
+}
+
+// Binary traces start from a reset cpu with the program bytes loaded at codeBase, the bytes follow the header.
+// Every executed instruction then adds one record:
+//   tag, zigzag varint ip delta, varint cycles,
+//   [register mask + changed registers], [flags], [varint range count + (varint address, varint size, bytes) per range]
+#define TRACE_MAGIC     0x43525450
+#define TRACE_VERSION   2
+#define TRACE_REGISTERS 0b1
+#define TRACE_FLAGS     0b10
+#define TRACE_MEMORY    0b100
+
+struct TraceHeader
+{
+  ui32 magic;
+  ui32 version;
+  ui64 count;
+  ui32 codeBase;
+  ui32 codeLength;
+};
+typedef struct TraceHeader TraceHeader;
+
+struct TraceRecorder
+{
+  i32          fd;
+  OutputBuffer output;
+  WriteLog     writes;
+  ui16         registers[NUMBER_OF_REGISTERS];
+  ui8          flags;
+  ui32         ip;
+  ui64         count;
+  bool         failed;
+};
+typedef struct TraceRecorder TraceRecorder;
+
+static inline ui8* writeVarint(ui8* out, ui64 value)
+{
+  while (value >= 0x80)
+  {
+    *out++ = (ui8)value | 0x80;
+    value >>= 7;
+  }
+  *out++ = (ui8)value;
+  return out;
+}
+
+static inline ui64 zigzag(i64 value)
+{
+  return ((ui64)value << 1) ^ (ui64)(value >> 63);
+}
+
+static bool startTraceRecorder(TraceRecorder* recorder, CPU* cpu, const char* name)
+{
+  recorder->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (recorder->fd < 0)
+  {
+    printf("Failed to open trace '%s'\n", name);
+    return false;
+  }
+  recorder->output = (OutputBuffer){0};
+  recorder->writes = (WriteLog){0};
+  recorder->flags  = getFlags(cpu);
+  recorder->ip     = 0;
+  recorder->count  = 0;
+  recorder->failed = false;
+  memcpy(recorder->registers, cpu->registers, sizeof(recorder->registers));
+
+  // the count is patched in once the run is over
+  TraceHeader header = {TRACE_MAGIC, TRACE_VERSION, 0, cpu->codeBase, cpu->codeLength};
+  reserveOutput(&recorder->output, sizeof(header) + cpu->codeLength + TRACE_FLUSH_SIZE);
+  memcpy(recorder->output.data, &header, sizeof(header));
+  memcpy(recorder->output.data + sizeof(header), cpu->image, cpu->codeLength);
+  recorder->output.used = sizeof(header) + cpu->codeLength;
+  cpu->writeLog         = &recorder->writes;
+  return true;
+}
+
+// Registers and flags are diffed against the previous record, memory comes from the ranges touchMemory logged
+static void recordStep(TraceRecorder* recorder, CPU* cpu, ui32 ip, Cycles cycles)
+{
+  WriteLog* writes = &recorder->writes;
+  ui64      size   = 32 + sizeof(recorder->registers);
+  for (ui32 i = 0; i < writes->count; i++)
+  {
+    size += 10 + writes->ranges[i].size;
+  }
+  reserveOutput(&recorder->output, size);
+
+  ui8* out   = (ui8*)recorder->output.data + recorder->output.used;
+  ui8* tag   = out++;
+  ui8  flags = getFlags(cpu);
+  out        = writeVarint(out, zigzag((i64)ip - (i64)recorder->ip));
+  out        = writeVarint(out, cycles.normal + cycles.ea + cycles.penalty);
+  *tag       = 0;
+
+  ui8  mask  = 0;
+  ui8* masks = out;
+  for (ui32 i = 0; i < NUMBER_OF_REGISTERS; i++)
+  {
+    if (cpu->registers[i] != recorder->registers[i])
+    {
+      if (!mask)
+      {
+        out++;
+      }
+      mask |= 1 << i;
+      memcpy(out, &cpu->registers[i], sizeof(ui16));
+      out += sizeof(ui16);
+      recorder->registers[i] = cpu->registers[i];
+    }
+  }
+  if (mask)
+  {
+    *tag |= TRACE_REGISTERS;
+    *masks = mask;
+  }
+
+  if (flags != recorder->flags)
+  {
+    *tag |= TRACE_FLAGS;
+    *out++          = flags;
+    recorder->flags = flags;
+  }
+
+  if (writes->count)
+  {
+    *tag |= TRACE_MEMORY;
+    out = writeVarint(out, writes->count);
+    for (ui32 i = 0; i < writes->count; i++)
+    {
+      WriteRange* range = &writes->ranges[i];
+      out               = writeVarint(out, range->address);
+      out               = writeVarint(out, range->size);
+      memcpy(out, &cpu->memory[range->address], range->size);
+      out += range->size;
+    }
+    writes->count = 0;
+  }
+
+  recorder->output.used = (char*)out - recorder->output.data;
+  recorder->ip          = ip;
+  recorder->count++;
+  if (recorder->output.used >= TRACE_FLUSH_SIZE && !flushOutput(&recorder->output, recorder->fd))
+  {
+    recorder->failed      = true;
+    recorder->output.used = 0;
+  }
+}
+
+static bool finishTraceRecorder(TraceRecorder* recorder, CPU* cpu)
+{
+  cpu->writeLog      = NULL;
+  bool        ok     = !recorder->failed && flushOutput(&recorder->output, recorder->fd);
+  TraceHeader header = {TRACE_MAGIC, TRACE_VERSION, recorder->count, cpu->codeBase, cpu->codeLength};
+  ok                 = ok && pwrite(recorder->fd, &header, sizeof(header), 0) == sizeof(header);
+  ok                 = close(recorder->fd) == 0 && ok;
+  free(recorder->output.data);
+  free(recorder->writes.ranges);
+  if (!ok)
+  {
+    printf("Failed to write the trace\n");
+  }
+  return ok;
+}
+
+// Simulated memory is an anonymous mapping, so untouched pages cost nothing and start out zeroed.
+// One spare page past the end lets an instruction fetch at the very top of memory read zeros instead of faulting
+#define MEMORY_MAPPING_SIZE (MEMORY_SIZE + PAGE_SIZE)
+
+static void initCPU(CPU* cpu, RegisterFile* registers)
+{
+  memset(registers, 0, sizeof(RegisterFile));
+  cpu->registers    = registers->words;
+  cpu->registerFile = registers;
+  cpu->prevFlags    = 0;
+  cpu->flags        = 0;
+  cpu->flagsPending = false;
+  cpu->cycles        = 0;
+  cpu->fusedExecuted = 0;
+  cpu->fuse          = true;
+  cpu->image       = NULL;
+  cpu->codeBase    = 0;
+  cpu->codeLength  = 0;
+  cpu->codeVersion = 0;
+  cpu->halted        = false;
+  cpu->bus8088       = false;
+  cpu->profileCycles = NULL;
+  cpu->profileCounts = NULL;
+  cpu->traceRing     = NULL;
+  cpu->writeLog      = NULL;
+  cpu->recorder      = NULL;
+  cpu->watch         = NULL;
+  cpu->decoded       = NULL;
+  cpu->memory        = (ui8*)mmap(NULL, MEMORY_MAPPING_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (cpu->memory == MAP_FAILED)
+  {
+    printf("Failed to map the simulated memory\n");
+    exit(1);
+  }
+  cpu->start = cpu->memory;
+  cpu->prev  = cpu->memory;
+  memset(cpu->dirtyPages, 0, sizeof(cpu->dirtyPages));
+}
+
+// Places the program at a linear address in simulated memory, code and data then share the same bytes.
+// A page aligned image backed by a file is mapped over memory copy on write, anything else is copied in
+static bool loadProgram(CPU* cpu, ProgramImage* image, ui32 address)
+{
+  if ((ui64)address + image->length > MEMORY_SIZE)
+  {
+    printf("A %u byte program does not fit in memory at 0x%05x\n", image->length, address);
+    return false;
+  }
+  if (image->fd >= 0 && image->length && (address & (PAGE_SIZE - 1)) == 0)
+  {
+    if (mmap(&cpu->memory[address], image->length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, image->fd, 0) == MAP_FAILED)
+    {
+      printf("Failed to map the program into memory\n");
+      return false;
+    }
+  }
+  else
+  {
+    memcpy(&cpu->memory[address], image->bytes, image->length);
+  }
+  cpu->image      = image->bytes;
+  cpu->codeBase   = address;
+  cpu->codeLength = image->length;
+  cpu->start      = &cpu->memory[address];
+  cpu->prev       = cpu->start;
+  cpu->decoded    = (DecodedInstruction*)calloc(image->length, sizeof(DecodedInstruction));
+  markCodePages(cpu);
+  return true;
+}
+
+static void freeCPU(CPU* cpu)
+{
+  free(cpu->decoded);
+  munmap(cpu->memory, MEMORY_MAPPING_SIZE);
+}
+
+static void resetRegisters(CPU* cpu)
+{
+  for (i32 i = 0; i < NUMBER_OF_REGISTERS; i++)
+  {
+    cpu->registers[i] = 0;
+  }
+  cpu->flags        = 0;
+  cpu->flagsPending = false;
+  cpu->prevFlags    = 0;
+  cpu->prev         = cpu->start;
+  cpu->halted       = false;
+}
+
+// Unknown instructions halt the cpu with cpu->prev pointing at the offending byte
+static Cycles stepInterpreter(CPU* cpu, ui8** buffer, bool trace)
+{
+  DecodedInstruction* decoded = fetchDecodedInstruction(cpu, *buffer);
+  if (!decoded)
+  {
+    cpu->halted = true;
+    return (Cycles){.normal = 0, .ea = 0, .penalty = 0};
+  }
+  ui32 ip         = (ui32)(*buffer - cpu->start);
+  cpu->instruction = decoded->instruction;
+  if (cpu->watch)
+  {
+    cpu->watch->ip = ip;
+    if (isWatched(cpu->watch, cpu->codeBase + ip, decoded->size))
+    {
+      watchAccess(cpu, cpu->codeBase + ip, decoded->size, 2);
+    }
+  }
+  *buffer += decoded->size;
+  Cycles cycles   = calcCycles(cpu);
+  bool   executed = executeInstruction(cpu, cpu->instruction, buffer);
+  if (isStringOperation(cpu->instruction.op))
+  {
+    cycles = cpu->stringCycles;
+  }
+  if (cpu->traceRing)
+  {
+    cpu->cycles += cycles.normal + cycles.ea + cycles.penalty;
+    TraceRecord record = {.instruction = cpu->instruction, .cycles = cycles, .total = cpu->cycles, .executed = executed};
+    pushTraceRecord(cpu->traceRing, &record);
+  }
+  else if (trace)
+  {
+    if (!executed)
+    {
+      printf("\n");
+    }
+    debugInstruction(cpu, cycles);
+  }
+  if (cpu->recorder)
+  {
+    recordStep(cpu->recorder, cpu, (ui32)(*buffer - cpu->start), cycles);
+  }
+  if (cpu->profileCycles)
+  {
+    cpu->profileCycles[ip] += cycles.normal + cycles.ea + cycles.penalty;
+    cpu->profileCounts[ip]++;
+  }
+
+  if (trace || cpu->traceRing)
+  {
+    cpu->prevFlags = getFlags(cpu);
+  }
+  cpu->prev = *buffer;
+  return cycles;
+}
+
+// Runs the program through the decode cache and executeInstruction for at most maxSteps instructions, returns the simulated cycles
+// and whether it stopped short of the end. Fused pairs only run as one step when nothing is looking at the individual instructions
+static ui64 runInterpreterLimited(CPU* cpu, bool trace, ui64 maxSteps, bool* timedOut)
+{
+  ui8* buffer = cpu->start;
+  ui8* end    = cpu->start + cpu->codeLength;
+  ui64 total  = 0;
+  ui64 steps  = 0;
+  bool fuse   = cpu->fuse && !trace && !cpu->traceRing && !cpu->recorder && !cpu->profileCycles && !cpu->watch;
+  while (buffer < end && !cpu->halted && steps < maxSteps)
+  {
+    steps++;
+    if (fuse)
+    {
+      DecodedInstruction* decoded = fetchDecodedInstruction(cpu, buffer);
+      if (decoded && decoded->fusedJnz)
+      {
+        total += executeFusedJnz(cpu, decoded, &buffer);
+        cpu->prev = buffer;
+        steps++;
+        continue;
+      }
+    }
+    Cycles cycles = stepInterpreter(cpu, &buffer, trace);
+    total += cycles.normal + cycles.ea + cycles.penalty;
+  }
+  *timedOut = buffer < end && !cpu->halted;
+  return total;
+}
+
+static ui64 runInterpreter(CPU* cpu, bool trace)
+{
+  bool timedOut;
+  return runInterpreterLimited(cpu, trace, ~0ULL, &timedOut);
+}
+
+// Same as a traced runInterpreter, but the trace is formatted and written on its own thread so execution never waits on stdout
+static ui64 runPipelinedInterpreter(CPU* cpu)
+{
+  TraceRing ring;
+  pthread_t writer;
+  initTraceRing(&ring);
+  fflush(stdout);
+  if (pthread_create(&writer, NULL, runTraceWriter, (void*)&ring) != 0)
+  {
+    printf("Failed to start the trace writer, tracing inline\n");
+    free(ring.records);
+    return runInterpreter(cpu, true);
+  }
+
+  cpu->traceRing = &ring;
+  ui64 total     = runInterpreter(cpu, false);
+  cpu->traceRing = NULL;
+  closeTraceRing(&ring);
+  if (pthread_join(writer, NULL) != 0)
+  {
+    printf("Failed to join?\n");
+    exit(2);
+  }
+  if (ring.failed)
+  {
+    fprintf(stderr, "Failed to write the trace\n");
+  }
+  free(ring.records);
+  return total;
+}
+
+// Seeking restores the closest earlier checkpoint and applies records forward from there, so stepping back costs at most an interval
+#define TRACE_CHECKPOINT_INTERVAL 1024
+
+struct TraceCheckpoint
+{
+  ui64           offset;
+  ui16           registers[NUMBER_OF_REGISTERS];
+  ui8            flags;
+  ui32           ip;
+  ui64           cycles;
+  MemorySnapshot memory;
+};
+typedef struct TraceCheckpoint TraceCheckpoint;
+
+struct TraceReplay
+{
+  ui8*             data;
+  ui64             size;
+  ui64             count;
+  TraceCheckpoint* checkpoints;
+  ui64             checkpointCount;
+  CPU*             cpu;
+  RegisterFile     registers;
+  ui32             ip;
+  ui64             index;
+  ui64             offset;
+};
+typedef struct TraceReplay TraceReplay;
+
+static inline bool readVarint(TraceReplay* replay, ui64* value)
+{
+  *value = 0;
+  for (ui32 shift = 0; shift < 64 && replay->offset < replay->size; shift += 7)
+  {
+    ui8 byte = replay->data[replay->offset++];
+    *value |= (ui64)(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Moves the cpu one instruction forward, fails on records that run past the end of the trace or outside of memory
+static bool applyTraceRecord(TraceReplay* replay)
+{
+  CPU* cpu = replay->cpu;
+  ui64 ipDelta, cycles;
+  if (replay->offset >= replay->size)
+  {
+    return false;
+  }
+  ui8 tag = replay->data[replay->offset++];
+  if (!readVarint(replay, &ipDelta) || !readVarint(replay, &cycles))
+  {
+    return false;
+  }
+  replay->ip += (i64)(ipDelta >> 1) ^ -(i64)(ipDelta & 1);
+  cpu->cycles += cycles;
+
+  if (tag & TRACE_REGISTERS)
+  {
+    if (replay->offset >= replay->size)
+    {
+      return false;
+    }
+    ui8 mask = replay->data[replay->offset++];
+    if (replay->offset + __builtin_popcount(mask) * sizeof(ui16) > replay->size)
+    {
+      return false;
+    }
+    for (ui32 i = 0; i < NUMBER_OF_REGISTERS; i++)
+    {
+      if (mask & (1 << i))
+      {
+        memcpy(&cpu->registers[i], &replay->data[replay->offset], sizeof(ui16));
+        replay->offset += sizeof(ui16);
+      }
+    }
+  }
+
+  if (tag & TRACE_FLAGS)
+  {
+    if (replay->offset >= replay->size)
+    {
+      return false;
+    }
+    cpu->flags = replay->data[replay->offset++];
+  }
+
+  if (tag & TRACE_MEMORY)
+  {
+    ui64 rangeCount;
+    if (!readVarint(replay, &rangeCount))
+    {
+      return false;
+    }
+    for (ui64 i = 0; i < rangeCount; i++)
+    {
+      ui64 address, size;
+      if (!readVarint(replay, &address) || !readVarint(replay, &size) || address + size > MEMORY_SIZE || replay->offset + size > replay->size)
+      {
+        return false;
+      }
+      memcpy(&cpu->memory[address], &replay->data[replay->offset], size);
+      markDirty(cpu, address, size);
+      replay->offset += size;
+    }
+  }
+  replay->index++;
+  return true;
+}
+
+static void takeTraceCheckpoint(TraceReplay* replay, TraceCheckpoint* checkpoint)
+{
+  checkpoint->offset = replay->offset;
+  checkpoint->flags  = replay->cpu->flags;
+  checkpoint->ip     = replay->ip;
+  checkpoint->cycles = replay->cpu->cycles;
+  memcpy(checkpoint->registers, replay->cpu->registers, sizeof(checkpoint->registers));
+  takeSnapshot(replay->cpu, &checkpoint->memory);
+}
+
+static void freeTraceReplay(TraceReplay* replay)
+{
+  for (ui64 i = 0; i < replay->checkpointCount; i++)
+  {
+    freeSnapshot(&replay->checkpoints[i].memory);
+  }
+  free(replay->checkpoints);
+  freeCPU(replay->cpu);
+  free(replay->cpu);
+  free(replay->data);
+}
+
+// Walks the whole trace once to validate it and lay down the checkpoints, leaves the cpu at the last instruction
+static bool loadTrace(TraceReplay* replay, const char* name)
+{
+  i32 len;
+  if (!read_file(&replay->data, &len, name))
+  {
+    printf("Failed to read trace '%s'\n", name);
+    return false;
+  }
+  TraceHeader header;
+  if ((ui32)len < sizeof(header))
+  {
+    printf("'%s' is too short to be a trace\n", name);
+    free(replay->data);
+    return false;
+  }
+  memcpy(&header, replay->data, sizeof(header));
+  if (header.magic != TRACE_MAGIC || header.version != TRACE_VERSION)
+  {
+    printf("'%s' is not a version %d trace\n", name, TRACE_VERSION);
+    free(replay->data);
+    return false;
+  }
+  if (header.codeLength > len - sizeof(header))
+  {
+    printf("'%s' is too short to hold its program\n", name);
+    free(replay->data);
+    return false;
+  }
+  // every record holds at least its tag and two varints, so a larger count can't be honest
+  if (header.count > (len - sizeof(header) - header.codeLength) / 3)
+  {
+    printf("'%s' claims %lu instructions but is too short to hold them\n", name, header.count);
+    free(replay->data);
+    return false;
+  }
+
+  replay->size            = len;
+  replay->count           = header.count;
+  replay->checkpointCount = header.count / TRACE_CHECKPOINT_INTERVAL + 1;
+  replay->checkpoints     = (TraceCheckpoint*)malloc(sizeof(TraceCheckpoint) * replay->checkpointCount);
+  replay->cpu             = (CPU*)malloc(sizeof(CPU));
+  if (!replay->checkpoints || !replay->cpu)
+  {
+    printf("Failed to allocate %lu trace checkpoints\n", replay->checkpointCount);
+    free(replay->checkpoints);
+    free(replay->cpu);
+    free(replay->data);
+    return false;
+  }
+  replay->ip              = 0;
+  replay->index           = 0;
+  replay->offset          = sizeof(header) + header.codeLength;
+  initCPU(replay->cpu, &replay->registers);
+
+  ProgramImage image = {.bytes = replay->data + sizeof(header), .length = header.codeLength, .fd = -1};
+  if (!loadProgram(replay->cpu, &image, header.codeBase))
+  {
+    replay->checkpointCount = 0;
+    freeTraceReplay(replay);
+    return false;
+  }
+
+  for (ui64 i = 0; i < replay->count; i++)
+  {
+    if (i % TRACE_CHECKPOINT_INTERVAL == 0)
+    {
+      takeTraceCheckpoint(replay, &replay->checkpoints[i / TRACE_CHECKPOINT_INTERVAL]);
+    }
+    if (!applyTraceRecord(replay))
+    {
+      printf("Trace '%s' is corrupt at instruction %lu\n", name, i);
+      replay->checkpointCount = i / TRACE_CHECKPOINT_INTERVAL + 1;
+      freeTraceReplay(replay);
+      return false;
+    }
+  }
+  if (replay->count % TRACE_CHECKPOINT_INTERVAL == 0)
+  {
+    takeTraceCheckpoint(replay, &replay->checkpoints[replay->count / TRACE_CHECKPOINT_INTERVAL]);
+  }
+  return true;
+}
+
+// Puts the cpu in the state it had after `index` instructions
+static void seekTrace(TraceReplay* replay, ui64 index)
+{
+  if (index > replay->count)
+  {
+    index = replay->count;
+  }
+  ui64 nearest = index / TRACE_CHECKPOINT_INTERVAL;
+  if (index < replay->index || nearest * TRACE_CHECKPOINT_INTERVAL > replay->index)
+  {
+    TraceCheckpoint* checkpoint = &replay->checkpoints[nearest];
+    CPU*             cpu        = replay->cpu;
+    memcpy(cpu->registers, checkpoint->registers, sizeof(checkpoint->registers));
+    cpu->flags        = checkpoint->flags;
+    cpu->flagsPending = false;
+    cpu->cycles       = checkpoint->cycles;
+    restoreSnapshot(cpu, &checkpoint->memory);
+    replay->ip     = checkpoint->ip;
+    replay->offset = checkpoint->offset;
+    replay->index  = nearest * TRACE_CHECKPOINT_INTERVAL;
+  }
+  while (replay->index < index)
+  {
+    applyTraceRecord(replay);
+  }
+}
+
+// Compiled code runs with the cpu in rdi, the JitState in rsi, the register file in r8, guest memory in r11 and the cycles
+// spent so far in rbx. Blocks jump straight into each other once linked and only come back to runJit through the shared exit
+struct JitState
+{
+  ui64 cycles;
+  ui8* exit;
+  ui32 steps;
+  ui32 writeAddress;
+  ui32 writeSize;
+};
+typedef struct JitState JitState;
+_Static_assert(sizeof(Operation) == 4, "the emitted code stores CPU.flagsOp as a dword");
+_Static_assert((0x10000 >> PAGE_SHIFT) < 64, "the emitted code assumes every guest address is dirty tracked by dirtyPages[0]");
+
+// Enters the compiled code at block, returns the ip it stopped at
+typedef ui32 (*JitEntry)(CPU* cpu, JitState* state, ui8* block);
+
+struct JitBlock
+{
+  ui8* code;
+  bool compiled;
+};
+typedef struct JitBlock JitBlock;
+
+#define JIT_BUFFER_SIZE            (1024 * 1024)
+#define JIT_MAX_BLOCK_INSTRUCTIONS 64
+// no instruction emits more than 192 bytes, the longest is a memory store with its code write check
+#define JIT_MAX_BLOCK_SIZE         (JIT_MAX_BLOCK_INSTRUCTIONS * 192)
+
+struct Jit
+{
+  ui8*      code;
+  ui32      used;
+  ui32      capacity;
+  JitBlock* blocks;
+  JitEntry  enter;
+  ui8*      leave;
+  ui32      codeVersion;
+  ui32      generation;
+  bool      writable;
+  JitState  state;
+};
+typedef struct Jit Jit;
+
+// The buffer is never writable and executable at once. Emitting or linking makes it writable and it goes back to
+// executable right before the compiled code runs, so one round of compiling and linking costs a single pair of flips
+static void setJitWritable(Jit* jit, bool writable)
+{
+  if (jit->writable == writable)
+  {
+    return;
+  }
+  jit->writable = writable;
+  if (mprotect(jit->code, jit->capacity, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) != 0)
+  {
+    perror("mprotect");
+    exit(1);
+  }
+}
+
+static inline void emit8(Jit* jit, ui8 byte)
+{
+  jit->code[jit->used++] = byte;
+}
+
+static inline void emit16(Jit* jit, ui16 value)
+{
+  emit8(jit, value & 0xFF);
+  emit8(jit, value >> 8);
+}
+
+static inline void emit32(Jit* jit, ui32 value)
+{
+  emit16(jit, value & 0xFFFF);
+  emit16(jit, value >> 16);
+}
+
+enum HostRegister
+{
+  HOST_RAX,
+  HOST_RCX,
+  HOST_RDX,
+  HOST_RBX,
+  HOST_RSP,
+  HOST_RBP,
+  HOST_RSI,
+  HOST_RDI,
+  HOST_R8,
+  HOST_R9,
+  HOST_R10,
+  HOST_R11,
+  HOST_R12
+};
+typedef enum HostRegister HostRegister;
+
+enum JitSize
+{
+  JIT_BYTE,
+  JIT_WORD,
+  JIT_DWORD,
+  JIT_QWORD
+};
+typedef enum JitSize JitSize;
+
+// Only al, cl and dl are used as byte registers, so a REX prefix never turns one of them into another register
+static void emitPrefix(Jit* jit, JitSize size, ui8 reg, ui8 index, ui8 base)
+{
+  if (size == JIT_WORD)
+  {
+    emit8(jit, 0x66);
+  }
+  ui8 rex = (size == JIT_QWORD ? 8 : 0) | (reg >> 3) << 2 | (index >> 3) << 1 | base >> 3;
+  if (rex)
+  {
+    emit8(jit, 0x40 | rex);
+  }
+}
+
+static void emitOpcode(Jit* jit, ui16 opcode)
+{
+  if (opcode > 0xFF)
+  {
+    emit8(jit, opcode >> 8);
+  }
+  emit8(jit, opcode & 0xFF);
+}
+
+// op reg, rm
+static void emitRegisterOperand(Jit* jit, JitSize size, ui16 opcode, ui8 reg, ui8 rm)
+{
+  emitPrefix(jit, size, reg, 0, rm);
+  emitOpcode(jit, opcode);
+  emit8(jit, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// op reg, [base + displacement], the bases used are never rsp or r12 so no SIB byte is needed
+static void emitMemoryOperand(Jit* jit, JitSize size, ui16 opcode, ui8 reg, ui8 base, i32 displacement)
+{
+  bool near = displacement >= -128 && displacement < 128;
+  emitPrefix(jit, size, reg, 0, base);
+  emitOpcode(jit, opcode);
+  emit8(jit, (near ? 0x40 : 0x80) | (reg & 7) << 3 | (base & 7));
+  if (near)
+  {
+    emit8(jit, (ui8)displacement);
+  }
+  else
+  {
+    emit32(jit, (ui32)displacement);
+  }
+}
+
+// op reg, [r11 + rcx], the guest address is always in ecx
+static void emitGuestMemoryOperand(Jit* jit, JitSize size, ui16 opcode, ui8 reg)
+{
+  emitPrefix(jit, size, reg, HOST_RCX, HOST_R11);
+  emitOpcode(jit, opcode);
+  emit8(jit, 0x04 | (reg & 7) << 3);
+  emit8(jit, HOST_RCX << 3 | (HOST_R11 & 7));
+}
+
+// mov host, imm32
+static void emitMoveImmediate(Jit* jit, ui8 host, ui32 value)
+{
+  emitPrefix(jit, JIT_DWORD, 0, 0, host);
+  emit8(jit, 0xB8 | (host & 7));
+  emit32(jit, value);
+}
+
+// Emits a jcc rel32 and returns where its displacement goes, bindBranch points it at the code emitted next
+static ui32 emitBranch(Jit* jit, ui16 opcode)
+{
+  emitOpcode(jit, opcode);
+  emit32(jit, 0);
+  return jit->used - 4;
+}
+
+static void bindBranch(Jit* jit, ui32 at)
+{
+  i32 displacement = (i32)(jit->used - (at + 4));
+  memcpy(jit->code + at, &displacement, sizeof(displacement));
+}
+
+// movzx host, guest register
+static void emitLoadRegister(Jit* jit, ui8 host, Register* reg)
+{
+  if (reg->size == SIXTEEN)
+  {
+    emitMemoryOperand(jit, JIT_DWORD, 0x0FB7, host, HOST_R8, reg->type * 2);
+  }
+  else
+  {
+    emitMemoryOperand(jit, JIT_DWORD, 0x0FB6, host, HOST_R8, reg->index);
+  }
+}
+
+// mov guest register, host
+static void emitStoreRegister(Jit* jit, ui8 host, Register* reg)
+{
+  if (reg->size == SIXTEEN)
+  {
+    emitMemoryOperand(jit, JIT_WORD, 0x89, host, HOST_R8, reg->type * 2);
+  }
+  else
+  {
+    emitMemoryOperand(jit, JIT_BYTE, 0x88, host, HOST_R8, reg->index);
+  }
+}
+
+// ecx = base + index + displacement, the 16 bit adds leave the upper half zero so it wraps like getEffectiveAddress
+static void emitEffectiveAddress(Jit* jit, EffectiveAddress* effectiveAddress)
+{
+  ui8 first  = effectiveAddress->base != ZERO_REGISTER ? effectiveAddress->base : effectiveAddress->index;
+  ui8 second = effectiveAddress->base != ZERO_REGISTER ? effectiveAddress->index : ZERO_REGISTER;
+  if (first == ZERO_REGISTER)
+  {
+    emitMoveImmediate(jit, HOST_RCX, effectiveAddress->displacement);
+    return;
+  }
+  emitMemoryOperand(jit, JIT_DWORD, 0x0FB7, HOST_RCX, HOST_R8, first * 2);
+  if (second != ZERO_REGISTER)
+  {
+    emitMemoryOperand(jit, JIT_WORD, 0x03, HOST_RCX, HOST_R8, second * 2);
+  }
+  if (effectiveAddress->displacement)
+  {
+    emitRegisterOperand(jit, JIT_WORD, 0x81, 0, HOST_RCX);
+    emit16(jit, effectiveAddress->displacement);
+  }
+}
+
+// movzx host, byte or word [r11 + rcx]
+static void emitLoadMemory(Jit* jit, ui8 host, bool wide)
+{
+  emitGuestMemoryOperand(jit, JIT_DWORD, wide ? 0x0FB7 : 0x0FB6, host);
+}
+
+// What compileJitBlock has emitted for the block so far
+struct JitContext
+{
+  ui32      cycles;
+  ui32      steps;
+  ui32      next;
+  bool      flagsStored;
+  Operation flagsOp;
+  bool      flagsWide;
+};
+typedef struct JitContext JitContext;
+
+// add rbx, cycles; then mov eax, ip until the exit is linked and a jmp to the next block after that.
+// The unlinked path records how far the block got and where to link it before leaving through the shared exit
+static void emitExit(Jit* jit, ui32 cycles, ui32 steps, ui32 ip)
+{
+  if (cycles)
+  {
+    emitRegisterOperand(jit, JIT_QWORD, 0x81, 0, HOST_RBX);
+    emit32(jit, cycles);
+  }
+  ui32 link = jit->used;
+  emitMoveImmediate(jit, HOST_RAX, ip);
+  emitMemoryOperand(jit, JIT_DWORD, 0xC7, 0, HOST_RSI, offsetof(JitState, steps));
+  emit32(jit, steps);
+  // lea rcx, [rip - back to the link]; mov [rsi + exit], rcx; jmp leave
+  emitPrefix(jit, JIT_QWORD, HOST_RCX, 0, 0);
+  emit8(jit, 0x8D);
+  emit8(jit, 0x0D);
+  emit32(jit, (ui32)(link - (jit->used + 4)));
+  emitMemoryOperand(jit, JIT_QWORD, 0x89, HOST_RCX, HOST_RSI, offsetof(JitState, exit));
+  emit8(jit, 0xE9);
+  emit32(jit, (ui32)(jit->leave - (jit->code + jit->used + 4)));
+}
+
+// Word transfers at odd addresses cost 4 cycles each on the 8086, the 8088 always pays so that part is static
+static void emitPenalty(Jit* jit, CPU* cpu, bool wide, ui8 transfers, JitContext* context)
+{
+  if (!wide || !transfers)
+  {
+    return;
+  }
+  if (cpu->bus8088)
+  {
+    context->cycles += transfers * 4;
+    return;
+  }
+  // mov eax, ecx; and eax, 1; imul eax, eax, 4 * transfers; add rbx, rax
+  emitRegisterOperand(jit, JIT_DWORD, 0x89, HOST_RCX, HOST_RAX);
+  emitRegisterOperand(jit, JIT_DWORD, 0x83, 4, HOST_RAX);
+  emit8(jit, 1);
+  emitRegisterOperand(jit, JIT_DWORD, 0x6B, HOST_RAX, HOST_RAX);
+  emit8(jit, transfers * 4);
+  emitRegisterOperand(jit, JIT_QWORD, 0x01, HOST_RAX, HOST_RBX);
+}
+
+// The compiled side of touchMemory for the size bytes at ecx: the pages are marked dirty, and a write into the code
+// leaves the block right after the store so runJit can invalidate what was decoded and compiled from it
+static void emitTouchMemory(Jit* jit, CPU* cpu, ui32 size, JitContext* context)
+{
+  // xor r12d, r12d; then lea eax, [rcx + offset]; shr eax, PAGE_SHIFT; bts r12, rax for the first and the last byte
+  emitRegisterOperand(jit, JIT_DWORD, 0x31, HOST_R12, HOST_R12);
+  for (ui32 offset = 0; offset < size; offset++)
+  {
+    emitMemoryOperand(jit, JIT_DWORD, 0x8D, HOST_RAX, HOST_RCX, offset);
+    emitRegisterOperand(jit, JIT_DWORD, 0xC1, 5, HOST_RAX);
+    emit8(jit, PAGE_SHIFT);
+    emitRegisterOperand(jit, JIT_QWORD, 0x0FAB, HOST_RAX, HOST_R12);
+  }
+  // or [rdi + dirtyPages], r12
+  emitMemoryOperand(jit, JIT_QWORD, 0x09, HOST_R12, HOST_RDI, offsetof(CPU, dirtyPages));
+
+  // lea eax, [rcx + size]; cmp eax, codeBase; jbe; cmp ecx, codeEnd; jae
+  emitMemoryOperand(jit, JIT_DWORD, 0x8D, HOST_RAX, HOST_RCX, size);
+  emitRegisterOperand(jit, JIT_DWORD, 0x81, 7, HOST_RAX);
+  emit32(jit, cpu->codeBase);
+  ui32 before = emitBranch(jit, 0x0F86);
+  emitRegisterOperand(jit, JIT_DWORD, 0x81, 7, HOST_RCX);
+  emit32(jit, cpu->codeBase + cpu->codeLength);
+  ui32 after = emitBranch(jit, 0x0F83);
+  emitMemoryOperand(jit, JIT_DWORD, 0x89, HOST_RCX, HOST_RSI, offsetof(JitState, writeAddress));
+  emitMemoryOperand(jit, JIT_DWORD, 0xC7, 0, HOST_RSI, offsetof(JitState, writeSize));
+  emit32(jit, size);
+  emitExit(jit, context->cycles, context->steps, context->next);
+  bindBranch(jit, before);
+  bindBranch(jit, after);
+}
+
+// The lazy flags live in r9d, r10d and edx until the code leaves, only the operation and the width are stored as they change
+static void emitFlagsProducer(Jit* jit, Operation op, bool wide, JitContext* context)
+{
+  if (!context->flagsStored)
+  {
+    emitMemoryOperand(jit, JIT_BYTE, 0xC6, 0, HOST_RDI, offsetof(CPU, flagsPending));
+    emit8(jit, 1);
+  }
+  if (!context->flagsStored || context->flagsOp != op)
+  {
+    emitMemoryOperand(jit, JIT_DWORD, 0xC7, 0, HOST_RDI, offsetof(CPU, flagsOp));
+    emit32(jit, op);
+  }
+  if (!context->flagsStored || context->flagsWide != wide)
+  {
+    emitMemoryOperand(jit, JIT_BYTE, 0xC6, 0, HOST_RDI, offsetof(CPU, flagsWide));
+    emit8(jit, wide);
+  }
+  context->flagsStored = true;
+  context->flagsOp     = op;
+  context->flagsWide   = wide;
+}
+
+// The entry saves the callee saved registers it uses, loads the pointers and derives edx from ZF, the exit stores the
+// lazy flag operands and the cycles and returns the ip left in eax
+static void emitEntryAndExit(Jit* jit)
+{
+  jit->enter = (JitEntry)(jit->code + jit->used);
+  // push rbx; push r12
+  emit8(jit, 0x53);
+  emit8(jit, 0x41);
+  emit8(jit, 0x54);
+  emitMemoryOperand(jit, JIT_QWORD, 0x8B, HOST_R8, HOST_RDI, offsetof(CPU, registers));
+  emitMemoryOperand(jit, JIT_QWORD, 0x8B, HOST_R11, HOST_RDI, offsetof(CPU, memory));
+  emitRegisterOperand(jit, JIT_DWORD, 0x31, HOST_RBX, HOST_RBX);
+  emitRegisterOperand(jit, JIT_QWORD, 0x89, HOST_RDX, HOST_RAX);
+  // edx is zero exactly when ZF is set, the same as the result a flag producing instruction leaves in it
+  emitMemoryOperand(jit, JIT_DWORD, 0x0FB6, HOST_RDX, HOST_RDI, offsetof(CPU, flags));
+  emitRegisterOperand(jit, JIT_DWORD, 0xF7, 2, HOST_RDX);
+  emitRegisterOperand(jit, JIT_DWORD, 0x83, 4, HOST_RDX);
+  emit8(jit, 1 << ZF);
+  // jmp rax
+  emitRegisterOperand(jit, JIT_DWORD, 0xFF, 4, HOST_RAX);
+
+  jit->leave = jit->code + jit->used;
+  emitMemoryOperand(jit, JIT_WORD, 0x89, HOST_R9, HOST_RDI, offsetof(CPU, flagsLeft));
+  emitMemoryOperand(jit, JIT_WORD, 0x89, HOST_R10, HOST_RDI, offsetof(CPU, flagsRight));
+  emitMemoryOperand(jit, JIT_WORD, 0x89, HOST_RDX, HOST_RDI, offsetof(CPU, flagsResult));
+  emitMemoryOperand(jit, JIT_QWORD, 0x89, HOST_RBX, HOST_RSI, offsetof(JitState, cycles));
+  // pop r12; pop rbx; ret
+  emit8(jit, 0x41);
+  emit8(jit, 0x5C);
+  emit8(jit, 0x5B);
+  emit8(jit, 0xC3);
+}
+
+static void flushJit(Jit* jit, CPU* cpu)
+{
+  memset(jit->blocks, 0, sizeof(JitBlock) * cpu->codeLength);
+  jit->codeVersion = cpu->codeVersion;
+  jit->generation++;
+  setJitWritable(jit, true);
+  jit->used = 0;
+  emitEntryAndExit(jit);
+}
+
+bool initJit(Jit* jit, CPU* cpu)
+{
+  jit->code = (ui8*)mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (jit->code == MAP_FAILED)
+  {
+    perror("mmap");
+    return false;
+  }
+  jit->capacity   = JIT_BUFFER_SIZE;
+  jit->blocks     = (JitBlock*)calloc(cpu->codeLength, sizeof(JitBlock));
+  jit->generation = 0;
+  jit->writable   = true;
+  flushJit(jit, cpu);
+  return true;
+}
+
+void freeJit(Jit* jit)
+{
+  munmap(jit->code, jit->capacity);
+  free(jit->blocks);
+}
+
+// Memory operands go through watchRead and touchMemory in the interpreter, the compiled code only mirrors those when
+// nothing is watched or logged
+static bool jitSupports(CPU* cpu, Instruction* instruction)
+{
+  switch (instruction->op)
+  {
+  case MOV:
+  case ADD:
+  case SUB:
+  case CMP:
+  {
+    OperandType dest   = instruction->operands[0].type;
+    OperandType source = instruction->operands[1].type;
+    if ((dest != REGISTER && dest != EFFECTIVEADDRESS) || (source != REGISTER && source != IMMEDIATE && source != EFFECTIVEADDRESS))
+    {
+      return false;
+    }
+    return (dest != EFFECTIVEADDRESS && source != EFFECTIVEADDRESS) || (!cpu->watch && !cpu->writeLog);
+  }
+  default:
+  {
+    return false;
+  }
+  }
+}
+
+static void emitInstruction(Jit* jit, CPU* cpu, Instruction* instruction, JitContext* context)
+{
+  Operand* dest      = &instruction->operands[0];
+  Operand* source    = &instruction->operands[1];
+  ui8      transfers = timingTable[instruction->op][getOperandForm(instruction)].transfers;
+  Operand* memory    = dest->type == EFFECTIVEADDRESS ? dest : source->type == EFFECTIVEADDRESS ? source : NULL;
+  if (memory)
+  {
+    emitEffectiveAddress(jit, &memory->effectiveAddress);
+    emitPenalty(jit, cpu, instruction->wide, transfers, context);
+  }
+
+  if (instruction->op == MOV)
+  {
+    if (source->type == IMMEDIATE)
+    {
+      // mov byte or word [r8 + reg] or [r11 + rcx], imm
+      bool wide = (dest->type == REGISTER ? dest->reg.size : source->immediate.size) == SIXTEEN;
+      if (dest->type == REGISTER)
+      {
+        emitMemoryOperand(jit, wide ? JIT_WORD : JIT_BYTE, wide ? 0xC7 : 0xC6, 0, HOST_R8, wide ? dest->reg.type * 2 : dest->reg.index);
+      }
+      else
+      {
+        emitGuestMemoryOperand(jit, wide ? JIT_WORD : JIT_BYTE, wide ? 0xC7 : 0xC6, 0);
+      }
+      if (wide)
+      {
+        emit16(jit, IMMEDIATE_VALUE(source->immediate));
+      }
+      else
+      {
+        emit8(jit, source->immediate.immediate8);
+      }
+      if (dest->type == EFFECTIVEADDRESS)
+      {
+        emitTouchMemory(jit, cpu, wide ? 2 : 1, context);
+      }
+      return;
+    }
+    if (source->type == REGISTER)
+    {
+      emitLoadRegister(jit, HOST_RAX, &source->reg);
+    }
+    else
+    {
+      emitLoadMemory(jit, HOST_RAX, source->effectiveAddress.wide);
+    }
+    if (dest->type == REGISTER)
+    {
+      emitStoreRegister(jit, HOST_RAX, &dest->reg);
+      return;
+    }
+    bool wide = source->reg.size == SIXTEEN;
+    emitGuestMemoryOperand(jit, wide ? JIT_WORD : JIT_BYTE, wide ? 0x89 : 0x88, HOST_RAX);
+    emitTouchMemory(jit, cpu, wide ? 2 : 1, context);
+    return;
+  }
+
+  if (dest->type == EFFECTIVEADDRESS)
+  {
+    // the interpreter only writes back register destinations, so all that's left of these is their timing
+    return;
+  }
+  // left in eax and r9d, right in ecx and r10d, the result masked to the operand size in edx
+  bool wide = dest->reg.size == SIXTEEN;
+  emitLoadRegister(jit, HOST_RAX, &dest->reg);
+  if (source->type == REGISTER)
+  {
+    emitLoadRegister(jit, HOST_RCX, &source->reg);
+  }
+  else if (source->type == IMMEDIATE)
+  {
+    emitMoveImmediate(jit, HOST_RCX, IMMEDIATE_VALUE(source->immediate));
+  }
+  else
+  {
+    emitLoadMemory(jit, HOST_RCX, source->effectiveAddress.wide);
+  }
+  emitRegisterOperand(jit, JIT_DWORD, 0x89, HOST_RAX, HOST_R9);
+  emitRegisterOperand(jit, JIT_DWORD, 0x89, HOST_RCX, HOST_R10);
+  emitRegisterOperand(jit, JIT_DWORD, instruction->op == ADD ? 0x01 : 0x29, HOST_RCX, HOST_RAX);
+  emitRegisterOperand(jit, JIT_DWORD, wide ? 0x0FB7 : 0x0FB6, HOST_RDX, HOST_RAX);
+  if (instruction->op != CMP)
+  {
+    emitStoreRegister(jit, HOST_RAX, &dest->reg);
+  }
+  emitFlagsProducer(jit, instruction->op, wide, context);
+}
+
+// Translates the code starting at ip up to the first jnz or the first instruction we can't compile. The other jumps
+// are compiled inline, the interpreter never takes them
+static JitBlock* compileJitBlock(Jit* jit, CPU* cpu, ui32 ip)
+{
+  if (jit->used + JIT_MAX_BLOCK_SIZE > jit->capacity)
+  {
+    flushJit(jit, cpu);
+  }
+  setJitWritable(jit, true);
+
+  JitBlock*  block      = &jit->blocks[ip];
+  ui8*       code       = jit->code + jit->used;
+  JitContext context    = {0};
+  ui32       current    = ip;
+  bool       terminated = false;
+  block->compiled       = true;
+  while (current < cpu->codeLength && context.steps < JIT_MAX_BLOCK_INSTRUCTIONS)
+  {
+    DecodedInstruction* decoded = fetchDecodedInstruction(cpu, cpu->start + current);
+    if (!decoded)
+    {
+      break;
+    }
+    Instruction* instruction = &decoded->instruction;
+    ui32         next        = current + decoded->size;
+
+    if (isJump(instruction->op))
+    {
+      context.steps++;
+      if (instruction->op != JNZ)
+      {
+        context.cycles += jumpCycles(instruction->op, false);
+        current = next;
+        continue;
+      }
+      // test edx, edx; jz over the taken exit
+      ui32 target = next + *(i8*)&instruction->operands[0].immediate.immediate8;
+      emitRegisterOperand(jit, JIT_DWORD, 0x85, HOST_RDX, HOST_RDX);
+      ui32 notTaken = emitBranch(jit, 0x0F84);
+      emitExit(jit, context.cycles + jumpCycles(JNZ, true), context.steps, target);
+      bindBranch(jit, notTaken);
+      emitExit(jit, context.cycles + jumpCycles(JNZ, false), context.steps, next);
+      terminated = true;
+      break;
+    }
+    if (!jitSupports(cpu, instruction))
+    {
+      break;
+    }
+
+    cpu->instruction = *instruction;
+    Cycles cycles    = calcCycles(cpu);
+    context.cycles += cycles.normal + cycles.ea;
+    context.steps++;
+    context.next = next;
+    emitInstruction(jit, cpu, instruction, &context);
+    current = next;
+  }
+
+  if (context.steps == 0)
+  {
+    // nothing we can compile here, the dispatcher steps the interpreter instead
+    jit->used   = (ui32)(code - jit->code);
+    block->code = NULL;
+  }
+  else
+  {
+    if (!terminated)
+    {
+      emitExit(jit, context.cycles, context.steps, current);
+    }
+    block->code = code;
+  }
+  return block;
+}
+
+// Points an exit at the block it leads to, from then on the two run back to back without returning to runJit
+static void linkJitExit(Jit* jit, ui8* link, ui8* target)
+{
+  i32 displacement = (i32)(target - (link + 5));
+  setJitWritable(jit, true);
+  link[0] = 0xE9;
+  memcpy(link + 1, &displacement, sizeof(displacement));
+}
+
+// Steps the shadow cpu through the same instructions with the interpreter and compares the architectural state
+static bool crossCheckJit(Jit* jit, CPU* cpu, CPU* shadow, ui8** shadowBuffer, ui32 steps, ui32 ip)
+{
+  for (ui32 i = 0; i < steps; i++)
+  {
+    stepInterpreter(shadow, shadowBuffer, false);
+  }
+
+  ui32 shadowIp = (ui32)(*shadowBuffer - shadow->start);
+  if (shadowIp != ip || memcmp(cpu->registers, shadow->registers, sizeof(ui16) * NUMBER_OF_REGISTERS) != 0 || getFlags(cpu) != getFlags(shadow))
+  {
+    printf("JIT diverged from the interpreter, ip 0x%04x (interpreter 0x%04x)\n", ip, shadowIp);
+    printf("jit:\n");
+    debugRegisters(cpu->registers);
+    printf("interpreter:\n");
+    debugRegisters(shadow->registers);
+    return false;
+  }
+  return true;
+}
+
+// Runs compiled code until the ip leaves the code, falling back to the interpreter one instruction at a time for anything
+// the JIT doesn't handle. Every exit that comes back here is linked to the block it leads to, except with a shadow cpu
+// where each block returns on its own so it can be cross-checked against the interpreter
+ui64 runJit(Jit* jit, CPU* cpu, CPU* shadow)
+{
+  ui32 ip           = 0;
+  ui64 cycles       = 0;
+  ui8* shadowBuffer = shadow ? shadow->start : NULL;
+  while (ip < cpu->codeLength && !cpu->halted)
+  {
+    if (jit->codeVersion != cpu->codeVersion)
+    {
+      flushJit(jit, cpu);
+    }
+    JitBlock* block = &jit->blocks[ip];
+    if (!block->compiled)
+    {
+      block = compileJitBlock(jit, cpu, ip);
+    }
+
+    ui32 steps;
+    if (block->code)
+    {
+      if (cpu->flagsPending)
+      {
+        // the entry reads ZF from the flags byte
+        getFlags(cpu);
+      }
+      setJitWritable(jit, false);
+      jit->state.writeSize = 0;
+      ip                   = jit->enter(cpu, &jit->state, block->code);
+      cycles += jit->state.cycles;
+      steps = jit->state.steps;
+      if (jit->state.writeSize)
+      {
+        // the code stopped right after writing into itself, runJit flushes once the decoded instructions are invalidated
+        invalidateDecodedInstructions(cpu, jit->state.writeAddress, jit->state.writeSize);
+      }
+      else if (!shadow && ip < cpu->codeLength)
+      {
+        ui32      generation = jit->generation;
+        JitBlock* next       = jit->blocks[ip].compiled ? &jit->blocks[ip] : compileJitBlock(jit, cpu, ip);
+        if (next->code && jit->generation == generation)
+        {
+          linkJitExit(jit, jit->state.exit, next->code);
+        }
+      }
+    }
+    else
+    {
+      ui8*   buffer      = cpu->start + ip;
+      Cycles interpreted = stepInterpreter(cpu, &buffer, false);
+      cycles += interpreted.normal + interpreted.ea + interpreted.penalty;
+      ip    = (ui32)(buffer - cpu->start);
+      steps = 1;
+    }
+
+    if (shadow && !crossCheckJit(jit, cpu, shadow, &shadowBuffer, steps, ip))
+    {
+      break;
+    }
+  }
+  if (shadow && !compareMemory(cpu, shadow))
+  {
+    printf("JIT memory diverged from the interpreter\n");
+  }
+  return cycles;
+}
+
+#define SPARSE_DUMP_MAGIC 0x504D4453
+
+// Sparse dumps hold a header followed by one (address, length, bytes) record per run of consecutive dirty pages
+struct SparseDumpHeader
+{
+  ui32 magic;
+  ui32 pageSize;
+  ui32 regionCount;
+};
+typedef struct SparseDumpHeader SparseDumpHeader;
+
+static void writeSparseMemoryDump(CPU* cpu, FILE* filePtr)
+{
+  SparseDumpHeader header = {SPARSE_DUMP_MAGIC, PAGE_SIZE, 0};
+  for (ui32 page = 0; page < PAGE_COUNT; page++)
+  {
+    if (isPageSet(cpu->dirtyPages, page) && (page == 0 || !isPageSet(cpu->dirtyPages, page - 1)))
+    {
+      header.regionCount++;
+    }
+  }
+  fwrite(&header, sizeof(header), 1, filePtr);
+
+  ui32 page = 0;
+  while (page < PAGE_COUNT)
+  {
+    if (!isPageSet(cpu->dirtyPages, page))
+    {
+      page++;
+      continue;
+    }
+    ui32 first = page;
+    while (page < PAGE_COUNT && isPageSet(cpu->dirtyPages, page))
+    {
+      page++;
+    }
+    ui32 address = first << PAGE_SHIFT;
+    ui32 length  = (page - first) << PAGE_SHIFT;
+    fwrite(&address, sizeof(address), 1, filePtr);
+    fwrite(&length, sizeof(length), 1, filePtr);
+    fwrite(&cpu->memory[address], length, 1, filePtr);
+  }
+}
+
+static void writeMemoryDump(CPU* cpu, bool sparse)
+{
+  FILE* filePtr;
+  filePtr = fopen("test.data", "w");
+  if (sparse)
+  {
+    writeSparseMemoryDump(cpu, filePtr);
+  }
+  else
+  {
+    fwrite(cpu->memory, MEMORY_SIZE, 1, filePtr);
+  }
+  fclose(filePtr);
+}
+
+#define EXECUTION_BENCHMARK_SECONDS 1.0
+
+enum Engine
+{
+  ENGINE_INTERPRETER,
+  ENGINE_THREADED,
+  ENGINE_JIT
+};
+typedef enum Engine Engine;
+
+static ui64 runEngine(Engine engine, CPU* cpu, ThreadedProgram* program, Jit* jit)
+{
+  switch (engine)
+  {
+  case ENGINE_THREADED:
+  {
+    return runThreadedProgram(cpu, program);
+  }
+  case ENGINE_JIT:
+  {
+    return runJit(jit, cpu, NULL);
+  }
+  default:
+  {
+    return runInterpreter(cpu, false);
+  }
+  }
+}
+
+static void benchmarkEngine(const char* name, Engine engine, CPU* cpu, ThreadedProgram* program, Jit* jit)
+{
+  MemorySnapshot initial;
+  resetMemory(cpu);
+  takeSnapshot(cpu, &initial);
+
+  ui64 runs   = 0;
+  ui64 cycles = 0;
+  f64  start  = readTime();
+  f64  elapsed;
+  do
+  {
+    resetRegisters(cpu);
+    restoreSnapshot(cpu, &initial);
+    cycles += runEngine(engine, cpu, program, jit);
+    runs++;
+    elapsed = readTime() - start;
+  } while (elapsed < EXECUTION_BENCHMARK_SECONDS);
+  freeSnapshot(&initial);
+  printf("%-12s %10lu runs %10.2f simulated Mcycles/s\n", name, runs, cycles / elapsed / 1000000.0);
+}
+
+// Checks that the cores end up in the same state and then compares how many simulated cycles they get through per second
+void benchmarkExecution(ProgramImage* image, ui32 address)
+{
+  CPU*            interpreted = (CPU*)malloc(sizeof(CPU));
+  CPU*            threaded    = (CPU*)malloc(sizeof(CPU));
+  CPU*            jitted      = (CPU*)malloc(sizeof(CPU));
+  RegisterFile    interpretedRegisters;
+  RegisterFile    threadedRegisters;
+  RegisterFile    jittedRegisters;
+  ThreadedProgram program;
+  Jit             jit;
+  initCPU(interpreted, &interpretedRegisters);
+  initCPU(threaded, &threadedRegisters);
+  initCPU(jitted, &jittedRegisters);
+  if (!loadProgram(interpreted, image, address) || !loadProgram(threaded, image, address) || !loadProgram(jitted, image, address) ||
+      !translateThreadedProgram(threaded, &program, threaded->start, image->length) || !initJit(&jit, jitted))
+  {
+    exit(1);
+  }
+
+  ui64 interpretedCycles = runInterpreter(interpreted, false);
+  ui64 threadedCycles    = runThreadedProgram(threaded, &program);
+  if (memcmp(&interpretedRegisters, &threadedRegisters, sizeof(interpretedRegisters)) != 0 || getFlags(interpreted) != getFlags(threaded) ||
+      !compareMemory(interpreted, threaded))
+  {
+    printf("Threaded core diverged from the interpreter!\n");
+    debugRegisters(interpretedRegisters.words);
+    debugRegisters(threadedRegisters.words);
+  }
+  ui64 jitCycles = runJit(&jit, jitted, NULL);
+  if (memcmp(&interpretedRegisters, &jittedRegisters, sizeof(interpretedRegisters)) != 0 || getFlags(interpreted) != getFlags(jitted) ||
+      !compareMemory(interpreted, jitted))
+  {
+    printf("JIT diverged from the interpreter!\n");
+    debugRegisters(interpretedRegisters.words);
+    debugRegisters(jittedRegisters.words);
+  }
+  printf("%d instructions, %lu cycles per run (threaded %lu, jit %lu)\n", program.count, interpretedCycles, threadedCycles, jitCycles);
+  printf("%lu of the dynamic instructions per run were fused by the interpreter\n", interpreted->fusedExecuted * 2);
+
+  benchmarkEngine("interpreter", ENGINE_INTERPRETER, interpreted, NULL, NULL);
+  interpreted->fuse = false;
+  benchmarkEngine("unfused", ENGINE_INTERPRETER, interpreted, NULL, NULL);
+  interpreted->fuse = true;
+  benchmarkEngine("threaded", ENGINE_THREADED, threaded, &program, NULL);
+  benchmarkEngine("jit", ENGINE_JIT, jitted, NULL, &jit);
+
+  freeJit(&jit);
+  free(program.instructions);
+  freeCPU(interpreted);
+  freeCPU(threaded);
+  freeCPU(jitted);
+  free(interpreted);
+  free(threaded);
+  free(jitted);
+}
+
+#define REGISTER_BENCHMARK_OPERANDS 4096
+#define REGISTER_BENCHMARK_ROUNDS   2048
+
+// The shift and mask register access the RegisterFile replaced, kept to benchmark against
+static inline ui16 readRegisterMasked(ui16* registers, Register* reg)
+{
+  ui16 value = registers[reg->type];
+  if (reg->size == SIXTEEN)
+  {
+    return value;
+  }
+  return reg->offset == 8 ? value >> 8 : value & 0xFF;
+}
+
+static inline void writeRegisterMasked(ui16* registers, Register* reg, ui16 value)
+{
+  ui16* regValue = &registers[reg->type];
+  if (reg->offset == 0)
+  {
+    if (reg->size == EIGHT)
+    {
+      *regValue = (*regValue & 0xFF00) | (ui8)value;
+    }
+    else
+    {
+      *regValue = value;
+    }
+  }
+  else
+  {
+    *regValue = (*regValue & 0x00FF) | ((ui8)value << 8);
+  }
+}
+
+// Chains register to register moves over a random mix of 8 and 16-bit operands through both access paths,
+// the two have to leave the same values behind
+void benchmarkRegisters()
+{
+  Operand*     operands = (Operand*)malloc(sizeof(Operand) * REGISTER_BENCHMARK_OPERANDS);
+  CPU*         cpu      = (CPU*)malloc(sizeof(CPU));
+  RegisterFile unionFile;
+  ui16         maskedFile[REGISTER_FILE_SIZE] = {0};
+  initCPU(cpu, &unionFile);
+  srand(1);
+  for (ui32 i = 0; i < REGISTER_BENCHMARK_OPERANDS; i++)
+  {
+    operands[i].type = REGISTER;
+    parseRegister(&operands[i].reg, rand() & 7, rand() & 1);
+  }
+
+  f64 bestMasked = 1e9;
+  f64 bestUnion  = 1e9;
+  for (i32 repetition = 0; repetition < BENCHMARK_REPETITIONS; repetition++)
+  {
+    f64 start = readTime();
+    for (ui32 round = 0; round < REGISTER_BENCHMARK_ROUNDS; round++)
+    {
+      for (ui32 i = 0; i < REGISTER_BENCHMARK_OPERANDS; i++)
+      {
+        ui16 value = readRegisterMasked(maskedFile, &operands[i].reg);
+        writeRegisterMasked(maskedFile, &operands[(i + 1) & (REGISTER_BENCHMARK_OPERANDS - 1)].reg, value + i);
+      }
+    }
+    f64 mid = readTime();
+    for (ui32 round = 0; round < REGISTER_BENCHMARK_ROUNDS; round++)
+    {
+      for (ui32 i = 0; i < REGISTER_BENCHMARK_OPERANDS; i++)
+      {
+        ui16 value = readRegister(cpu, &operands[i].reg);
+        setRegisterValue(cpu, &operands[(i + 1) & (REGISTER_BENCHMARK_OPERANDS - 1)].reg, value + i);
+      }
+    }
+    f64 end    = readTime();
+    bestMasked = mid - start < bestMasked ? mid - start : bestMasked;
+    bestUnion  = end - mid < bestUnion ? end - mid : bestUnion;
+  }
+
+  f64 moves = (f64)REGISTER_BENCHMARK_OPERANDS * REGISTER_BENCHMARK_ROUNDS;
+  printf("%d register moves per run over random 8/16-bit operands, best of %d\n", REGISTER_BENCHMARK_OPERANDS * REGISTER_BENCHMARK_ROUNDS, BENCHMARK_REPETITIONS);
+  printf("%-8s %8.3fms %8.3f ns/move\n", "masked", bestMasked * 1000.0, bestMasked * 1e9 / moves);
+  printf("%-8s %8.3fms %8.3f ns/move\n", "union", bestUnion * 1000.0, bestUnion * 1e9 / moves);
+  if (memcmp(maskedFile, unionFile.words, sizeof(maskedFile)) != 0)
+  {
+    printf("Register files diverged!\n");
+    debugRegisters(maskedFile);
+    debugRegisters(unionFile.words);
+  }
+
+  freeCPU(cpu);
+  free(cpu);
+  free(operands);
+}
+
+static void printFinalState(CPU* cpu, ui64 cycles, f64 elapsed)
+{
+  printf("Final registers:\n");
+  debugRegisters(cpu->registers);
+  printf("\tflags:");
+  debugFlags(getFlags(cpu));
+  printf("\n\tcycles: %lu (%.2f simulated Mcycles/s)\n", cycles, cycles / elapsed / 1000000.0);
+}
+
+struct HotSpot
+{
+  ui32 ip;
+  ui32 end;
+  ui64 count;
+  ui64 cycles;
+};
+typedef struct HotSpot HotSpot;
+
+static i32 compareHotSpots(const void* a, const void* b)
+{
+  ui64 left  = ((const HotSpot*)a)->cycles;
+  ui64 right = ((const HotSpot*)b)->cycles;
+  return left < right ? 1 : left > right ? -1 : 0;
+}
+
+#define PROFILE_REPORT_LINES 10
+
+static void initProfile(CPU* cpu)
+{
+  cpu->profileCycles = (ui64*)calloc(cpu->codeLength, sizeof(ui64));
+  cpu->profileCounts = (ui64*)calloc(cpu->codeLength, sizeof(ui64));
+}
+
+// Basic blocks are found statically, a block starts at the entry, at every jump target and after every jump
+static void printProfile(CPU* cpu)
+{
+  ui64     total     = 0;
+  bool*    leaders   = (bool*)calloc(cpu->codeLength + 1, sizeof(bool));
+  HotSpot* spots     = (HotSpot*)malloc(sizeof(HotSpot) * cpu->codeLength);
+  ui32     spotCount = 0;
+  leaders[0]         = true;
+  for (ui32 ip = 0; ip < cpu->codeLength;)
+  {
+    DecodedInstruction* decoded = fetchDecodedInstruction(cpu, cpu->start + ip);
+    if (!decoded)
+    {
+      break;
+    }
+    ui32 next = ip + decoded->size;
+    if (isJump(decoded->instruction.op))
+    {
+      i32 target = (i32)next + *(i8*)&decoded->instruction.operands[0].immediate.immediate8;
+      if (target >= 0 && (ui32)target < cpu->codeLength)
+      {
+        leaders[target] = true;
+      }
+      leaders[next] = true;
+    }
+    if (cpu->profileCounts[ip])
+    {
+      spots[spotCount++] = (HotSpot){.ip = ip, .end = next, .count = cpu->profileCounts[ip], .cycles = cpu->profileCycles[ip]};
+      total += cpu->profileCycles[ip];
+    }
+    ip = next;
+  }
+
+  printf("\nhotspots by instruction (%lu cycles):\n", total);
+  printf("      ip      count       cycles       %%  instruction\n");
+  qsort(spots, spotCount, sizeof(HotSpot), compareHotSpots);
+  for (ui32 i = 0; i < spotCount && i < PROFILE_REPORT_LINES; i++)
+  {
+    printf("  0x%04x %10lu %12lu %6.2f%%  ", spots[i].ip, spots[i].count, spots[i].cycles, total ? spots[i].cycles * 100.0 / total : 0.0);
+    printInstruction(&cpu->decoded[spots[i].ip].instruction);
+    printf("\n");
+  }
+
+  ui32 blockCount = 0;
+  for (ui32 ip = 0; ip < cpu->codeLength;)
+  {
+    DecodedInstruction* decoded = fetchDecodedInstruction(cpu, cpu->start + ip);
+    if (!decoded)
+    {
+      break;
+    }
+    if (leaders[ip])
+    {
+      spots[blockCount++] = (HotSpot){.ip = ip, .end = ip, .count = cpu->profileCounts[ip], .cycles = 0};
+    }
+    spots[blockCount - 1].end = ip + decoded->size;
+    spots[blockCount - 1].cycles += cpu->profileCycles[ip];
+    ip += decoded->size;
+  }
+
+  printf("\nhotspots by basic block:\n");
+  printf("    start      end      count       cycles       %%\n");
+  qsort(spots, blockCount, sizeof(HotSpot), compareHotSpots);
+  for (ui32 i = 0; i < blockCount && i < PROFILE_REPORT_LINES && spots[i].cycles; i++)
+  {
+    printf("   0x%04x   0x%04x %10lu %12lu %6.2f%%\n", spots[i].ip, spots[i].end, spots[i].count, spots[i].cycles, total ? spots[i].cycles * 100.0 / total : 0.0);
+  }
+  free(leaders);
+  free(spots);
+}
+
+// A loop trip count given on the command line, keyed by the ip of the jnz closing the loop
+struct TripCount
+{
+  ui32 ip;
+  ui32 trips;
+};
+typedef struct TripCount TripCount;
+
+// A backward jnz and its target, as instruction indices, writes has a bit for every register type written in between
+struct StaticLoop
+{
+  ui32 header;
+  ui32 latch;
+  ui8  writes;
+};
+typedef struct StaticLoop StaticLoop;
+
+#define MOVE_UNRESOLVED   -2
+#define MOVE_NOT_CONSTANT -1
+
+// Indexed by instruction * NUMBER_OF_REGISTERS + register type, lastWrites holds the closest instruction before writing it
+// and loopWrites the latest header of a loop around the instruction that writes it somewhere, both -1 if there is none.
+// moveValues caches the constant moved by register to register movs
+struct StaticCode
+{
+  Instruction* instructions;
+  ui32         count;
+  i32*         lastWrites;
+  i32*         loopWrites;
+  i32*         moveValues;
+  StaticLoop*  loops;
+  ui32         loopCount;
+};
+typedef struct StaticCode StaticCode;
+
+struct EstimateBlock
+{
+  ui32 start;
+  ui32 end;
+  ui32 first;
+  ui32 last;
+  ui64 cycles;
+  ui64 executions;
+  ui64 total;
+  ui32 trips;
+  bool guessed;
+};
+typedef struct EstimateBlock EstimateBlock;
+
+static inline bool sameRegister(Register* a, Register* b)
+{
+  return a->type == b->type && a->size == b->size && (a->size == SIXTEEN || a->index == b->index);
+}
+
+// A bit per register type the instruction writes any part of, string operations are assumed to clobber everything they could touch
+static ui8 registerWrites(Instruction* instruction)
+{
+  if (isStringOperation(instruction->op))
+  {
+    return 1 << SI | 1 << DI | 1 << C | 1 << A;
+  }
+  if (instruction->op != MOV && instruction->op != ADD && instruction->op != SUB)
+  {
+    return 0;
+  }
+  Operand* dest = &instruction->operands[0];
+  return dest->type == REGISTER ? 1 << dest->reg.type : dest->type == ACCUMULATOR ? 1 << A : 0;
+}
+
+// The value reg holds whenever the instruction at before runs, or only when it is first reached from above if onEntry.
+// The closest write in address order has to load a constant, directly or from another constant register, and no loop
+// around before may write it again later in its body. Registers start out zeroed
+static bool findConstant(StaticCode* code, ui32 before, Register* reg, bool onEntry, ui16* value)
+{
+  i32 write   = code->lastWrites[before * NUMBER_OF_REGISTERS + reg->type];
+  i32 wrapped = code->loopWrites[before * NUMBER_OF_REGISTERS + reg->type];
+  if (onEntry)
+  {
+    // only asked once per loop, so the loops are walked instead of keeping a second table without the loop itself
+    wrapped = -1;
+    for (ui32 l = 0; l < code->loopCount; l++)
+    {
+      StaticLoop* loop = &code->loops[l];
+      if (loop->header < before && loop->latch >= before && (loop->writes & (1 << reg->type)) && (i32)loop->header > wrapped)
+      {
+        wrapped = loop->header;
+      }
+    }
+  }
+  // nothing in that loop before the instruction writes it, so the write comes around from later in the body
+  if (wrapped > write)
+  {
+    return false;
+  }
+  if (write < 0)
+  {
+    *value = 0;
+    return true;
+  }
+
+  Instruction* instruction = &code->instructions[write];
+  Operand*     operands    = instruction->operands;
+  if (instruction->op != MOV || operands[0].type != REGISTER || !sameRegister(&operands[0].reg, reg))
+  {
+    return false;
+  }
+  if (operands[1].type == REGISTER)
+  {
+    i32 moved = code->moveValues[write];
+    if (moved == MOVE_UNRESOLVED)
+    {
+      moved                    = findConstant(code, write, &operands[1].reg, false, value) ? *value : MOVE_NOT_CONSTANT;
+      code->moveValues[write] = moved;
+    }
+    *value = (ui16)moved;
+    return moved != MOVE_NOT_CONSTANT;
+  }
+  if (operands[1].type != IMMEDIATE)
+  {
+    return false;
+  }
+  *value = IMMEDIATE_VALUE(operands[1].immediate);
+  return true;
+}
+
+static inline bool isConstantStep(Instruction* instruction, Register* counter)
+{
+  Operand* operands = instruction->operands;
+  return (instruction->op == ADD || instruction->op == SUB) && operands[0].type == REGISTER && sameRegister(&operands[0].reg, counter) &&
+         operands[1].type == IMMEDIATE;
+}
+
+// Loops the code itself bounds, a counter loaded with a constant before the header, stepped by a constant exactly once
+// in the body and tested against zero or a constant by the last flag setter before the jnz
+static bool inferTrips(StaticCode* code, StaticLoop* loop, ui32* trips)
+{
+  Instruction* instructions = code->instructions;
+  Instruction* test         = NULL;
+  for (ui32 i = loop->latch; i-- > loop->header && !test;)
+  {
+    Operation op = instructions[i].op;
+    if (op == CMPS || op == SCAS)
+    {
+      return false;
+    }
+    test = op == ADD || op == SUB || op == CMP ? &instructions[i] : NULL;
+  }
+  if (!test || test->operands[0].type != REGISTER)
+  {
+    return false;
+  }
+
+  Register*    counter = &test->operands[0].reg;
+  Operand*     source  = &test->operands[1];
+  Instruction* step    = NULL;
+  ui16         limit   = 0;
+  if (test->op == CMP)
+  {
+    if (source->type == IMMEDIATE)
+    {
+      limit = IMMEDIATE_VALUE(source->immediate);
+    }
+    else if (source->type != REGISTER || !findConstant(code, loop->header, &source->reg, true, &limit) || (loop->writes & (1 << source->reg.type)))
+    {
+      return false;
+    }
+  }
+  else if (!isConstantStep(test, counter))
+  {
+    return false;
+  }
+
+  for (ui32 i = loop->header; i < loop->latch; i++)
+  {
+    Instruction* instruction = &instructions[i];
+    if (!(registerWrites(instruction) & (1 << counter->type)))
+    {
+      continue;
+    }
+    if (!isConstantStep(instruction, counter) || (step && step != instruction))
+    {
+      return false;
+    }
+    step = instruction;
+  }
+
+  ui16 value;
+  if (!step || !findConstant(code, loop->header, counter, true, &value))
+  {
+    return false;
+  }
+  // same arithmetic as the simulator, 8 bit immediates are zero extended
+  ui32 mask  = counter->size == SIXTEEN ? 0xFFFF : 0xFF;
+  ui16 delta = IMMEDIATE_VALUE(step->operands[1].immediate);
+  delta      = step->op == SUB ? -delta : delta;
+  for (ui32 n = 1; n <= mask + 1; n++)
+  {
+    value = (value + delta) & mask;
+    if (value == (limit & mask))
+    {
+      *trips = n;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Word transfers at an address that isn't known statically are assumed to be even
+static inline ui8 staticPenalty(bool bus8088, bool known, ui16 address, bool wide, ui8 transfers)
+{
+  return wide && (bus8088 || (known && (address & 1))) ? transfers * 4 : 0;
+}
+
+static bool findEffectiveAddress(StaticCode* code, ui32 i, EffectiveAddress* effectiveAddress, ui16* address)
+{
+  ui16     base = 0, index = 0;
+  Register baseRegister  = {.type = (RegisterType)effectiveAddress->base, .size = SIXTEEN};
+  Register indexRegister = {.type = (RegisterType)effectiveAddress->index, .size = SIXTEEN};
+  if ((effectiveAddress->base != ZERO_REGISTER && !findConstant(code, i, &baseRegister, false, &base)) ||
+      (effectiveAddress->index != ZERO_REGISTER && !findConstant(code, i, &indexRegister, false, &index)))
+  {
+    return false;
+  }
+  *address = base + index + effectiveAddress->displacement;
+  return true;
+}
+
+static ui32 estimateInstructionCycles(StaticCode* code, ui32 i, bool bus8088, bool* guessed)
+{
+  Instruction* instruction = &code->instructions[i];
+  Operation    op          = instruction->op;
+  if (isJump(op))
+  {
+    return jumpCycles(op, false);
+  }
+  if (op == CLD || op == STD)
+  {
+    return 2;
+  }
+  if (isStringOperation(op))
+  {
+    StringTiming timing      = stringTimingTable[op - MOVS];
+    Register     si          = {.type = SI, .size = SIXTEEN};
+    Register     di          = {.type = DI, .size = SIXTEEN};
+    Register     cx          = {.type = C, .size = SIXTEEN};
+    ui16         source      = 0;
+    ui16         dest        = 0;
+    ui16         count       = 1;
+    bool         sourceKnown = findConstant(code, i, &si, false, &source);
+    bool         destKnown   = findConstant(code, i, &di, false, &dest);
+    ui32         penalty     = (timing.source ? staticPenalty(bus8088, sourceKnown, source, instruction->wide, 1) : 0) +
+                   (timing.dest ? staticPenalty(bus8088, destKnown, dest, instruction->wide, 1) : 0);
+    if (instruction->rep == REP_NONE)
+    {
+      return timing.single + penalty;
+    }
+    // repe and repne stop on the data, the full count is only an upper bound for them
+    if (!findConstant(code, i, &cx, false, &count) || op == CMPS || op == SCAS)
+    {
+      *guessed = true;
+    }
+    return REP_BASE_CYCLES + count * (timing.perRepetition + penalty);
+  }
+
+  OperandForm form   = getOperandForm(instruction);
+  Timing      timing = timingTable[op][form];
+  ui32        cycles = timing.base;
+  if (timing.transfers)
+  {
+    EffectiveAddress* effectiveAddress = &instruction->operands[instruction->operands[0].type == EFFECTIVEADDRESS ? 0 : 1].effectiveAddress;
+    ui16              address;
+    if (form != FORM_ACC_MEM && form != FORM_MEM_ACC)
+    {
+      cycles += effectiveAddress->cycles;
+    }
+    bool known = findEffectiveAddress(code, i, effectiveAddress, &address);
+    cycles += staticPenalty(bus8088, known, address, instruction->wide, timing.transfers);
+  }
+  return cycles;
+}
+
+#define MAX_TRIP_COUNTS 64
+
+// Parses "ip=trips[,ip=trips...]", ips are taken as hex with a 0x prefix
+static bool parseTripCounts(const char* text, TripCount* tripCounts, ui32* count)
+{
+  while (*text)
+  {
+    char* end;
+    ui32  ip = (ui32)strtoul(text, &end, 0);
+    if (end == text || *end != '=' || *count == MAX_TRIP_COUNTS)
+    {
+      printf("Invalid trip counts '%s', expected ip=trips[,ip=trips...]\n", text);
+      return false;
+    }
+    text       = end + 1;
+    ui32 trips = (ui32)strtoul(text, &end, 0);
+    if (end == text || trips == 0 || (*end && *end != ','))
+    {
+      printf("Invalid trip count '%s'\n", text);
+      return false;
+    }
+    tripCounts[(*count)++] = (TripCount){.ip = ip, .trips = trips};
+    text                   = *end ? end + 1 : end;
+  }
+  return true;
+}
+
+static i32 compareEstimateBlocks(const void* a, const void* b)
+{
+  ui64 left  = ((const EstimateBlock*)a)->total;
+  ui64 right = ((const EstimateBlock*)b)->total;
+  return left < right ? 1 : left > right ? -1 : 0;
+}
+
+// Estimates the cycles of a run without executing anything. Every basic block is costed once from the timing tables and
+// weighted by the trip counts of the loops around it, loops being backward jnz edges since jnz is the only jump that is taken.
+// Forward jumps are assumed to fall through
+void estimateCycles(ui8* bytes, ui32 len, TripCount* tripCounts, ui32 tripCountCount, bool bus8088)
+{
+  f64            start        = readTime();
+  Instruction*   instructions = (Instruction*)malloc(sizeof(Instruction) * len);
+  ui32           count        = decode(bytes, len, instructions);
+  ui32*          ips          = (ui32*)malloc(sizeof(ui32) * (count + 1));
+  i32*           indices      = (i32*)malloc(sizeof(i32) * (len + 1));
+  bool*          leaders      = (bool*)calloc(count + 1, sizeof(bool));
+  ui32*          blockOf      = (ui32*)malloc(sizeof(ui32) * (count + 1));
+  EstimateBlock* blocks       = (EstimateBlock*)malloc(sizeof(EstimateBlock) * (count + 1));
+  StaticLoop*    loops        = (StaticLoop*)malloc(sizeof(StaticLoop) * (count + 1));
+  i32*           lastWrites   = (i32*)malloc(sizeof(i32) * NUMBER_OF_REGISTERS * (count + 1));
+  i32*           loopWrites   = (i32*)malloc(sizeof(i32) * NUMBER_OF_REGISTERS * (count + 1));
+  i32*           moveValues   = (i32*)malloc(sizeof(i32) * (count + 1));
+  StaticCode     code         = {.instructions = instructions, .count = count, .lastWrites = lastWrites, .loopWrites = loopWrites, .moveValues = moveValues, .loops = loops, .loopCount = 0};
+  ui32           blockCount   = 0;
+  ui64           total        = 0;
+
+  memset(indices, -1, sizeof(i32) * (len + 1));
+  memset(lastWrites, -1, sizeof(i32) * NUMBER_OF_REGISTERS);
+  memset(loopWrites, -1, sizeof(i32) * NUMBER_OF_REGISTERS * (count + 1));
+  ips[0] = 0;
+  for (ui32 i = 0; i < count; i++)
+  {
+    moveValues[i]   = MOVE_UNRESOLVED;
+    indices[ips[i]] = i;
+    ips[i + 1]      = ips[i] + instructions[i].size;
+    ui8 writes      = registerWrites(&instructions[i]);
+    for (ui32 type = 0; type < NUMBER_OF_REGISTERS; type++)
+    {
+      lastWrites[(i + 1) * NUMBER_OF_REGISTERS + type] = writes & (1 << type) ? (i32)i : lastWrites[i * NUMBER_OF_REGISTERS + type];
+    }
+  }
+  leaders[0] = true;
+  for (ui32 i = 0; i < count; i++)
+  {
+    if (!isJump(instructions[i].op))
+    {
+      continue;
+    }
+    i32 target = (i32)ips[i + 1] + *(i8*)&instructions[i].operands[0].immediate.immediate8;
+    if (target >= 0 && (ui32)target < len && indices[target] >= 0)
+    {
+      leaders[indices[target]] = true;
+      if (instructions[i].op == JNZ && (ui32)target <= ips[i])
+      {
+        loops[code.loopCount++] = (StaticLoop){.header = indices[target], .latch = i, .writes = 0};
+      }
+    }
+    leaders[i + 1] = true;
+  }
+
+  for (ui32 i = 0; i < count; i++)
+  {
+    if (leaders[i])
+    {
+      blocks[blockCount++] = (EstimateBlock){.start = ips[i], .first = i, .executions = 1};
+    }
+    blocks[blockCount - 1].last = i;
+    blocks[blockCount - 1].end  = ips[i + 1];
+    blockOf[i]                  = blockCount - 1;
+  }
+
+  for (ui32 l = 0; l < code.loopCount; l++)
+  {
+    for (ui32 i = loops[l].header; i <= loops[l].latch; i++)
+    {
+      loops[l].writes |= registerWrites(&instructions[i]);
+    }
+  }
+  for (ui32 l = 0; l < code.loopCount; l++)
+  {
+    // jnz only reaches back 128 bytes, so this stays close to linear
+    for (ui32 i = loops[l].header; i <= loops[l].latch; i++)
+    {
+      for (ui32 type = 0; type < NUMBER_OF_REGISTERS; type++)
+      {
+        i32* wrapped = &loopWrites[i * NUMBER_OF_REGISTERS + type];
+        *wrapped     = (loops[l].writes & (1 << type)) && (i32)loops[l].header > *wrapped ? (i32)loops[l].header : *wrapped;
+      }
+    }
+  }
+  for (ui32 i = 0; i < count; i++)
+  {
+    // resolving the movs in order keeps chains of them from recursing more than one deep
+    Operand* operands = instructions[i].operands;
+    if (instructions[i].op == MOV && operands[0].type == REGISTER && operands[1].type == REGISTER)
+    {
+      ui16 value;
+      moveValues[i] = findConstant(&code, i, &operands[1].reg, false, &value) ? value : MOVE_NOT_CONSTANT;
+    }
+  }
+
+  for (ui32 l = 0; l < code.loopCount; l++)
+  {
+    StaticLoop*    loop  = &loops[l];
+    EstimateBlock* latch = &blocks[blockOf[loop->latch]];
+    for (ui32 t = 0; t < tripCountCount; t++)
+    {
+      latch->trips = tripCounts[t].ip == ips[loop->latch] ? tripCounts[t].trips : latch->trips;
+    }
+    if (!latch->trips && !inferTrips(&code, loop, &latch->trips))
+    {
+      latch->trips   = 1;
+      latch->guessed = true;
+    }
+    for (ui32 b = blockOf[loop->header]; b <= blockOf[loop->latch]; b++)
+    {
+      blocks[b].executions *= latch->trips;
+    }
+  }
+
+  for (ui32 b = 0; b < blockCount; b++)
+  {
+    EstimateBlock* block = &blocks[b];
+    for (ui32 i = block->first; i <= block->last; i++)
+    {
+      block->cycles += estimateInstructionCycles(&code, i, bus8088, &block->guessed);
+    }
+    block->total = block->cycles * block->executions;
+    if (block->trips)
+    {
+      // every pass through the loop but the last takes the jump back
+      ui64 taken = block->executions / block->trips * (block->trips - 1);
+      block->total += taken * (jumpCycles(JNZ, true) - jumpCycles(JNZ, false));
+    }
+    total += block->total;
+  }
+  f64 elapsed = readTime() - start;
+
+  printf("%u instructions, %u basic blocks, %u loops, estimated in %.1fus\n", count, blockCount, code.loopCount, elapsed * 1000000.0);
+  printf("    start      end   cycles       runs  trips        total       %%\n");
+  qsort(blocks, blockCount, sizeof(EstimateBlock), compareEstimateBlocks);
+  for (ui32 b = 0; b < blockCount && b < PROFILE_REPORT_LINES && blocks[b].total; b++)
+  {
+    EstimateBlock* block = &blocks[b];
+    printf("   0x%04x   0x%04x %8lu %10lu ", block->start, block->end, block->cycles, block->executions);
+    if (block->trips)
+    {
+      printf("%6u", block->trips);
+    }
+    else
+    {
+      printf("%6s", "");
+    }
+    printf(" %12lu %6.2f%%%s\n", block->total, total ? block->total * 100.0 / total : 0.0, block->guessed ? " ?" : "");
+  }
+  printf("estimated cycles: %lu\n", total);
+  if (ips[count] < len)
   {
-    ui16 dest = getEffectiveAddress(cpu, operands[0].effectiveAddress);
-    setMemoryValue(cpu, dest, immediate);
+    printf("decoding stopped at unknown byte 0x%02x at 0x%04x\n", bytes[ips[count]], ips[count]);
   }
+
+  free(instructions);
+  free(ips);
+  free(indices);
+  free(leaders);
+  free(blockOf);
+  free(blocks);
+  free(loops);
+  free(lastWrites);
+  free(loopWrites);
+  free(moveValues);
 }
 
-void executeAddInstruction(CPU* cpu, Operand* operands)
+// Operand forms only exist for mov/add/sub/cmp, string operations are split by whether they repeat
+#define FORM_NONE        FORM_COUNT
+#define FORM_REP         (FORM_COUNT + 1)
+#define STATS_FORM_COUNT (FORM_COUNT + 2)
+
+const char* formToString[STATS_FORM_COUNT] = {"reg/reg", "reg/mem", "mem/reg", "reg/imm", "mem/imm", "acc/mem", "mem/acc", "acc/imm", "-", "rep"};
+
+struct OperationStats
 {
-  Immediate op1 = getOperandValue(cpu, operands[1]);
-  Immediate op0 = getOperandValue(cpu, operands[0]);
-  ui16      res = IMMEDIATE_VALUE(op0) + IMMEDIATE_VALUE(op1);
-  if (operands[0].type == REGISTER)
+  Operation op;
+  ui32      form;
+  ui64      count;
+  ui64      cycles;
+};
+typedef struct OperationStats OperationStats;
+
+static i32 compareOperationStats(const void* a, const void* b)
+{
+  const OperationStats* left  = (const OperationStats*)a;
+  const OperationStats* right = (const OperationStats*)b;
+  if (left->cycles != right->cycles)
   {
-    setRegisterValue(cpu, &operands[0].reg, res);
-    updateFlags(cpu, res);
+    return left->cycles < right->cycles ? 1 : -1;
   }
+  return left->count < right->count ? 1 : left->count > right->count ? -1 : 0;
 }
-void executeJumpNotZeroInstruction(CPU* cpu, Operand* operands, ui8** buffer)
+
+static ui32 getStatsForm(Instruction* instruction)
 {
-  if (!GETZF(cpu->flags))
+  if (instruction->op <= CMP)
   {
-    *buffer += *(i8*)&operands[0].immediate.immediate8;
+    return getOperandForm(instruction);
   }
+  return isStringOperation(instruction->op) && instruction->rep != REP_NONE ? FORM_REP : FORM_NONE;
 }
 
-void executeCmpInstruction(CPU* cpu, Operand* operands)
+// Folds the per ip profile into counts and cycles per operation and operand form, printed by cycles and written as csv
+static void printOperationHistogram(CPU* cpu, const char* csvName)
 {
-  Immediate op1 = getOperandValue(cpu, operands[1]);
-  Immediate op0 = getOperandValue(cpu, operands[0]);
-  ui16      res = IMMEDIATE_VALUE(op0) - IMMEDIATE_VALUE(op1);
+  OperationStats stats[(JCXZ + 1) * STATS_FORM_COUNT];
+  ui32           statsCount = 0;
+  ui64           count      = 0;
+  ui64           cycles     = 0;
+  for (ui32 op = 0; op <= JCXZ; op++)
+  {
+    for (ui32 form = 0; form < STATS_FORM_COUNT; form++)
+    {
+      stats[op * STATS_FORM_COUNT + form] = (OperationStats){.op = (Operation)op, .form = form, .count = 0, .cycles = 0};
+    }
+  }
+  for (ui32 ip = 0; ip < cpu->codeLength; ip++)
+  {
+    if (cpu->profileCounts[ip])
+    {
+      Instruction*    instruction = &cpu->decoded[ip].instruction;
+      OperationStats* entry       = &stats[instruction->op * STATS_FORM_COUNT + getStatsForm(instruction)];
+      entry->count += cpu->profileCounts[ip];
+      entry->cycles += cpu->profileCycles[ip];
+      count += cpu->profileCounts[ip];
+      cycles += cpu->profileCycles[ip];
+    }
+  }
+  for (ui32 i = 0; i < ArrayCount(stats); i++)
+  {
+    if (stats[i].count)
+    {
+      stats[statsCount++] = stats[i];
+    }
+  }
+  qsort(stats, statsCount, sizeof(OperationStats), compareOperationStats);
 
-  if (operands[0].type == REGISTER)
+  printf("\ninstruction mix (%lu instructions, %lu cycles):\n", count, cycles);
+  printf("  operation  form         count       %%       cycles       %%  cycles/inst\n");
+  for (ui32 i = 0; i < statsCount; i++)
   {
-    updateFlags(cpu, res);
+    OperationStats* entry = &stats[i];
+    printf("  %-9s  %-7s %10lu %6.2f%% %12lu %6.2f%% %12.2f\n", opToString[entry->op], formToString[entry->form], entry->count, entry->count * 100.0 / count,
+           entry->cycles, cycles ? entry->cycles * 100.0 / cycles : 0.0, (f64)entry->cycles / entry->count);
   }
-}
 
-void executeSubInstruction(CPU* cpu, Operand* operands)
-{
-  Immediate op1 = getOperandValue(cpu, operands[1]);
-  Immediate op0 = getOperandValue(cpu, operands[0]);
-  ui16      res = IMMEDIATE_VALUE(op0) - IMMEDIATE_VALUE(op1);
-  if (operands[0].type == REGISTER)
+  FILE* filePtr = fopen(csvName, "w");
+  if (!filePtr)
   {
-    setRegisterValue(cpu, &operands[0].reg, res);
-    updateFlags(cpu, res);
+    printf("Failed to open '%s'\n", csvName);
+    return;
+  }
+  fprintf(filePtr, "operation,form,count,cycles\n");
+  for (ui32 i = 0; i < statsCount; i++)
+  {
+    fprintf(filePtr, "%s,%s,%lu,%lu\n", opToString[stats[i].op], formToString[stats[i].form], stats[i].count, stats[i].cycles);
   }
+  fclose(filePtr);
 }
 
-void executeInstruction(CPU* cpu, Instruction instruction, ui8** buffer)
+// Parses first[-last][:rwx], reads and writes are watched when no kinds are given
+static bool parseWatchpoint(const char* text, MemoryWatch* watch)
 {
-  switch (instruction.op)
+  char* end;
+  ui32  first = (ui32)strtoul(text, &end, 0);
+  ui32  last  = first;
+  ui8   kinds = 0;
+  bool  valid = end != text && watch->watchpointCount < MAX_WATCHPOINTS;
+  if (valid && *end == '-')
   {
-  case MOV:
+    const char* start = end + 1;
+    last              = (ui32)strtoul(start, &end, 0);
+    valid             = end != start && last >= first;
+  }
+  if (valid && *end == ':')
   {
-    executeMoveInstruction(cpu, instruction.operands);
-    break;
+    for (end++; *end == 'r' || *end == 'w' || *end == 'x'; end++)
+    {
+      kinds |= *end == 'r' ? WATCH_READ : *end == 'w' ? WATCH_WRITE : WATCH_EXECUTE;
+    }
+    valid = kinds != 0;
   }
-  case ADD:
+  if (!valid || *end || last >= MEMORY_SIZE)
   {
-    executeAddInstruction(cpu, instruction.operands);
-    break;
+    printf("Invalid watchpoint '%s', expected first[-last][:rwx] with at most %d watchpoints\n", text, MAX_WATCHPOINTS);
+    return false;
   }
-  case SUB:
+  addWatchpoint(watch, first, last, kinds ? kinds : WATCH_READ | WATCH_WRITE);
+  return true;
+}
+
+static inline ui64 totalAccesses(const ui64* counts)
+{
+  return counts[0] + counts[1] + counts[2];
+}
+
+// By address, and the instructions touching an address the most first
+static i32 compareAccessCounts(const void* a, const void* b)
+{
+  const AccessCount* left  = (const AccessCount*)a;
+  const AccessCount* right = (const AccessCount*)b;
+  if (left->address != right->address)
   {
-    executeSubInstruction(cpu, instruction.operands);
-    break;
+    return left->address < right->address ? -1 : 1;
   }
-  case CMP:
+  ui64 leftTotal  = totalAccesses(left->counts);
+  ui64 rightTotal = totalAccesses(right->counts);
+  return leftTotal < rightTotal ? 1 : leftTotal > rightTotal ? -1 : 0;
+}
+
+// All accesses to one address, first and count give its instructions in the sorted access counts
+struct AddressAccesses
+{
+  ui32 address;
+  ui64 counts[WATCH_KINDS];
+  ui32 first;
+  ui32 count;
+};
+typedef struct AddressAccesses AddressAccesses;
+
+static i32 compareAddressAccesses(const void* a, const void* b)
+{
+  ui64 left  = totalAccesses(((const AddressAccesses*)a)->counts);
+  ui64 right = totalAccesses(((const AddressAccesses*)b)->counts);
+  return left < right ? 1 : left > right ? -1 : 0;
+}
+
+#define WATCH_REPORT_INSTRUCTIONS 3
+
+static void printMemoryWatch(MemoryWatch* watch)
+{
+  for (ui32 i = 0; i < watch->watchpointCount; i++)
   {
-    executeCmpInstruction(cpu, instruction.operands);
-    break;
+    Watchpoint* watchpoint = &watch->watchpoints[i];
+    printf("\nwatchpoint 0x%04x-0x%04x %s%s%s: %lu hits", watchpoint->first, watchpoint->last, watchpoint->kinds & WATCH_READ ? "r" : "",
+           watchpoint->kinds & WATCH_WRITE ? "w" : "", watchpoint->kinds & WATCH_EXECUTE ? "x" : "", watchpoint->hits);
   }
-  case JNZ:
+  printf("\n");
+
+  AccessCount*     counts              = (AccessCount*)malloc(sizeof(AccessCount) * (watch->countSize + 1));
+  AddressAccesses* addresses           = (AddressAccesses*)malloc(sizeof(AddressAccesses) * (watch->countSize + 1));
+  ui32             count               = 0;
+  ui32             addressCount        = 0;
+  ui64             totals[WATCH_KINDS] = {0};
+  for (ui32 i = 0; i < watch->countCapacity; i++)
   {
-    executeJumpNotZeroInstruction(cpu, instruction.operands, buffer);
-    break;
+    if (watch->counts[i].used)
+    {
+      counts[count++] = watch->counts[i];
+    }
   }
-  default:
+  qsort(counts, count, sizeof(AccessCount), compareAccessCounts);
+  for (ui32 i = 0; i < count; i++)
+  {
+    if (i == 0 || counts[i].address != counts[i - 1].address)
+    {
+      addresses[addressCount++] = (AddressAccesses){.address = counts[i].address, .first = i, .count = 0};
+    }
+    AddressAccesses* address = &addresses[addressCount - 1];
+    address->count++;
+    for (ui32 kind = 0; kind < WATCH_KINDS; kind++)
+    {
+      address->counts[kind] += counts[i].counts[kind];
+      totals[kind] += counts[i].counts[kind];
+    }
+  }
+
+  printf("\nhottest memory addresses (%lu reads, %lu writes, %lu executes):\n", totals[0], totals[1], totals[2]);
+  printf("   address      reads     writes   executes  instructions\n");
+  qsort(addresses, addressCount, sizeof(AddressAccesses), compareAddressAccesses);
+  for (ui32 i = 0; i < addressCount && i < PROFILE_REPORT_LINES; i++)
   {
+    AddressAccesses* address = &addresses[i];
+    printf("    0x%04x %10lu %10lu %10lu ", address->address, address->counts[0], address->counts[1], address->counts[2]);
+    for (ui32 j = 0; j < address->count && j < WATCH_REPORT_INSTRUCTIONS; j++)
+    {
+      AccessCount* access = &counts[address->first + j];
+      printf(" 0x%04x x%lu", access->ip, totalAccesses(access->counts));
+    }
+    if (address->count > WATCH_REPORT_INSTRUCTIONS)
+    {
+      printf(" +%u more", address->count - WATCH_REPORT_INSTRUCTIONS);
+    }
     printf("\n");
-    break;
   }
+  free(counts);
+  free(addresses);
+}
+
+// Every listing finishes in well under a million instructions, anything still running after this is looping
+#define BATCH_STEP_LIMIT 10000000
+
+struct BatchJob
+{
+  const char*  name;
+  bool         loaded;
+  bool         halted;
+  bool         timedOut;
+  RegisterFile registers;
+  ui8          flags;
+  ui64         cycles;
+};
+typedef struct BatchJob BatchJob;
+
+// Workers pull the next job index with an atomic add, so there is no lock around the queue
+struct BatchQueue
+{
+  BatchJob* jobs;
+  ui32      count;
+  ui32      next;
+  ui32      loadAddress;
+};
+typedef struct BatchQueue BatchQueue;
+
+void* runBatchWorker(void* arg)
+{
+  BatchQueue* queue = (BatchQueue*)arg;
+  CPU*        cpu   = (CPU*)malloc(sizeof(CPU));
+  for (;;)
+  {
+    ui32 index = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED);
+    if (index >= queue->count)
+    {
+      break;
+    }
+
+    BatchJob*    job = &queue->jobs[index];
+    ProgramImage image;
+    if (!mapProgramImage(&image, job->name))
+    {
+      job->loaded = false;
+      continue;
+    }
+
+    initCPU(cpu, &job->registers);
+    job->loaded = loadProgram(cpu, &image, queue->loadAddress);
+    if (job->loaded)
+    {
+      job->cycles = runInterpreterLimited(cpu, false, BATCH_STEP_LIMIT, &job->timedOut);
+      job->halted = cpu->halted;
+      job->flags  = getFlags(cpu);
+    }
+    freeCPU(cpu);
+    unmapProgramImage(&image);
   }
+  free(cpu);
+  return 0;
 }
 
-#define MEMORY_SIZE 1024 * 1024
-void debugMemory(CPU* cpu)
+static i32 compareNames(const void* a, const void* b)
 {
-  printf("memory:\n");
-  for (i32 i = 0; i < MEMORY_SIZE; i++)
+  return strcmp(*(const char**)a, *(const char**)b);
+}
+
+// Expands directories into the regular files inside them, sorted so the report order is stable
+static ui32 collectBatchFiles(char** inputs, ui32 inputCount, char*** files)
+{
+  ui32 count    = 0;
+  ui32 capacity = 16;
+  *files        = (char**)malloc(sizeof(char*) * capacity);
+  for (ui32 i = 0; i < inputCount; i++)
   {
-    if (cpu->memory[i] != 0)
+    struct stat info;
+    if (stat(inputs[i], &info) != 0)
     {
-      printf("%d", cpu->memory[i]);
+      printf("Failed to stat '%s'\n", inputs[i]);
+      continue;
+    }
+
+    ui32 first = count;
+    if (S_ISDIR(info.st_mode))
+    {
+      DIR* dir = opendir(inputs[i]);
+      if (!dir)
+      {
+        printf("Failed to open directory '%s'\n", inputs[i]);
+        continue;
+      }
+      struct dirent* entry;
+      while ((entry = readdir(dir)) != NULL)
+      {
+        if (entry->d_name[0] == '.')
+        {
+          continue;
+        }
+        char* path = (char*)malloc(strlen(inputs[i]) + strlen(entry->d_name) + 2);
+        sprintf(path, "%s/%s", inputs[i], entry->d_name);
+        if (stat(path, &info) != 0 || !S_ISREG(info.st_mode))
+        {
+          free(path);
+          continue;
+        }
+        if (count == capacity)
+        {
+          capacity *= 2;
+          *files = (char**)realloc(*files, sizeof(char*) * capacity);
+        }
+        (*files)[count++] = path;
+      }
+      closedir(dir);
+      qsort(&(*files)[first], count - first, sizeof(char*), compareNames);
+    }
+    else
+    {
+      if (count == capacity)
+      {
+        capacity *= 2;
+        *files = (char**)realloc(*files, sizeof(char*) * capacity);
+      }
+      (*files)[count++] = strdup(inputs[i]);
     }
   }
+  return count;
 }
 
-int main()
+// Simulates every program on its own cpu, spread over a pool of threads, and reports the final state of each in input order
+void runBatch(char** inputs, ui32 inputCount, ui32 threadCount, ui32 loadAddress)
 {
-  ui8*        buffer;
-  ui8*        end;
-  int         len;
-  const char* name = "listing_57";
-  read_file(&buffer, &len, name);
+  char** files;
+  ui32   count = collectBatchFiles(inputs, inputCount, &files);
+  if (count == 0)
+  {
+    printf("No programs to run\n");
+    free(files);
+    return;
+  }
+  if (threadCount == 0)
+  {
+    threadCount = (ui32)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (threadCount > count)
+  {
+    threadCount = count;
+  }
 
-  end = buffer + len;
-  // printf("; %s.asm\n", name);
-  // printf("bits 16\n\n");
+  BatchQueue queue;
+  queue.jobs        = (BatchJob*)calloc(count, sizeof(BatchJob));
+  queue.count       = count;
+  queue.next        = 0;
+  queue.loadAddress = loadAddress;
+  for (ui32 i = 0; i < count; i++)
+  {
+    queue.jobs[i].name = files[i];
+  }
 
-  ui16 registers[NUMBER_OF_REGISTERS];
-  for (i32 i = 0; i < NUMBER_OF_REGISTERS; i++)
+  f64        start     = readTime();
+  pthread_t* threadIds = (pthread_t*)malloc(sizeof(pthread_t) * threadCount);
+  ui32       started   = 0;
+  while (started < threadCount && pthread_create(&threadIds[started], NULL, runBatchWorker, (void*)&queue) == 0)
   {
-    registers[i] = 0;
+    started++;
   }
-  CPU cpu;
-  cpu.registers = &registers[0];
-  cpu.prevFlags = 0;
-  cpu.flags     = 0;
-  cpu.start     = buffer;
-  cpu.prev      = buffer;
-  cpu.cycles    = 0;
-  for (i32 i = 0; i < MEMORY_SIZE; i++)
+  // the queue hands out whatever is left, so the calling thread picks up the work of the threads that didn't start
+  if (started < threadCount)
+  {
+    printf("Only started %d of %d threads, running the rest on this one\n", started, threadCount);
+    runBatchWorker((void*)&queue);
+    threadCount = started + 1;
+  }
+  for (ui32 i = 0; i < started; i++)
+  {
+    if (pthread_join(threadIds[i], NULL) != 0)
+    {
+      printf("Failed to join?\n");
+      exit(2);
+    }
+  }
+  f64 elapsed = readTime() - start;
+
+  ui32 failed = 0;
+  for (ui32 i = 0; i < count; i++)
+  {
+    BatchJob* job = &queue.jobs[i];
+    if (!job->loaded)
+    {
+      printf("%s: failed to load\n", job->name);
+      failed++;
+      continue;
+    }
+    if (job->timedOut)
+    {
+      printf("%s: timed out after %d instructions, %lu cycles\n", job->name, BATCH_STEP_LIMIT, job->cycles);
+    }
+    else
+    {
+      printf("%s: %lu cycles%s\n", job->name, job->cycles, job->halted ? " (halted on unknown instruction)" : "");
+    }
+    failed += job->halted || job->timedOut;
+    debugRegisters(job->registers.words);
+    printf("\tflags:");
+    debugFlags(job->flags);
+    printf("\n");
+  }
+  printf("Ran %d programs on %d threads in %.3fms, %d failed\n", count, threadCount, elapsed * 1000.0, failed);
+
+  for (ui32 i = 0; i < count; i++)
   {
-    cpu.memory[i] = 0;
+    free(files[i]);
   }
+  free(files);
+  free(threadIds);
+  free(queue.jobs);
+}
 
-  while (buffer < end)
+int main(int argc, char** argv)
+{
+  const char* name        = "listing_57";
+  bool        threaded    = false;
+  bool        jit         = false;
+  bool        jitCheck    = false;
+  bool        benchExec   = false;
+  bool        disasm      = false;
+  bool        parallel    = false;
+  bool        batch       = false;
+  bool        sparseDump  = false;
+  bool        bus8088     = false;
+  bool        profile     = false;
+  const char* mixCsvName  = NULL;
+  bool        pipeline    = false;
+  const char* recordName  = NULL;
+  const char* replayName  = NULL;
+  ui64        replayIndex = 0;
+  bool        benchDecode = false;
+  const char* mixName     = NULL;
+  ui64        seed        = STREAM_SEED;
+  const char* streamName  = NULL;
+  ui32        streamSize  = 0;
+  ui32        threadCount = 0;
+  ui32        loadAddress = DEFAULT_LOAD_ADDRESS;
+  bool        estimate    = false;
+  MemoryWatch memoryWatch = {0};
+  TripCount   tripCounts[MAX_TRIP_COUNTS];
+  ui32        tripCount   = 0;
+  char**      inputs      = (char**)malloc(sizeof(char*) * argc);
+  ui32        inputCount  = 0;
+  for (i32 i = 1; i < argc; i++)
   {
-    if (matchRegMemoryAdd(buffer[0]))
+    if (strcmp(argv[i], "-bench-decode") == 0)
+    {
+      benchDecode = true;
+    }
+    else if (strcmp(argv[i], "-mix") == 0 && i + 1 < argc)
     {
-      cpu.instruction.op = ADD;
-      parseRegMemory(&cpu.instruction.operands[0], &buffer, "add");
+      mixName = argv[++i];
     }
-    else if (matchRegMemoryCmp(buffer[0]))
+    else if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc)
     {
-      cpu.instruction.op = CMP;
-      parseRegMemory(&cpu.instruction.operands[0], &buffer, "cmp");
+      seed = strtoull(argv[++i], NULL, 10);
     }
-    else if (matchRegMemorySub(buffer[0]))
+    else if (strcmp(argv[i], "-gen-stream") == 0 && i + 2 < argc)
     {
-      cpu.instruction.op = SUB;
-      parseRegMemory(&cpu.instruction.operands[0], &buffer, "sub");
+      streamName = argv[++i];
+      streamSize = (ui32)strtoul(argv[++i], NULL, 10);
     }
-    else if (matchImmediateToRegMemory(buffer[0]))
+    else if (strcmp(argv[i], "-bench-registers") == 0)
     {
-      parseImmediateToRegMemoryAddSubCmp(&cpu.instruction, &buffer);
+      benchmarkRegisters();
+      return 0;
     }
-    else if (matchImmediateToAccumulatorCmp(buffer[0]))
+    else if (strcmp(argv[i], "-bench-disasm") == 0)
     {
-      cpu.instruction.op = CMP;
-      parseImmediateToAccumulator(&cpu.instruction.operands[0], &buffer, "cmp");
+      benchmarkDisassembly(i + 1 < argc ? argv[i + 1] : "test.data");
+      return 0;
     }
-    else if (matchImmediateToAccumulatorSub(buffer[0]))
+    else if (strcmp(argv[i], "-disasm") == 0)
     {
-      cpu.instruction.op = SUB;
-      parseImmediateToAccumulator(&cpu.instruction.operands[0], &buffer, "sub");
+      disasm = true;
     }
-    else if (matchImmediateToAccumulatorAdd(buffer[0]))
+    else if (strcmp(argv[i], "-disasm-parallel") == 0)
     {
-      cpu.instruction.op = ADD;
-      parseImmediateToAccumulator(&cpu.instruction.operands[0], &buffer, "add");
+      disasm   = true;
+      parallel = true;
     }
-    else if (matchImmediateToRegMove(buffer[0]))
+    else if (strcmp(argv[i], "-bench-exec") == 0)
     {
-      cpu.instruction.op = MOV;
-      parseImmediateToRegMove(&cpu.instruction.operands[0], &buffer);
+      benchExec = true;
     }
-    else if (matchAccumulatorToMemoryMov(buffer[0]))
+    else if (strcmp(argv[i], "-threaded") == 0)
     {
-      cpu.instruction.op = MOV;
-      parseAccumulatorToMemoryMov(&cpu.instruction.operands[0], &buffer, false);
+      threaded = true;
     }
-    else if (matchMemoryToAccumulatorMov(buffer[0]))
+    else if (strcmp(argv[i], "-jit") == 0)
     {
-      cpu.instruction.op = MOV;
-      parseAccumulatorToMemoryMov(&cpu.instruction.operands[0], &buffer, true);
+      jit = true;
     }
-    else if (matchImmediateToRegMemoryMove(buffer[0]))
+    else if (strcmp(argv[i], "-jit-check") == 0)
     {
-      cpu.instruction.op = MOV;
-      parseImmediateToRegMemoryMove(&cpu.instruction.operands[0], &buffer);
+      jit      = true;
+      jitCheck = true;
     }
-    else if (matchRegMemoryMove(buffer[0]))
+    else if (strcmp(argv[i], "-batch") == 0)
     {
-      cpu.instruction.op = MOV;
-      parseRegMemory(&cpu.instruction.operands[0], &buffer, "mov");
+      batch = true;
     }
-    else if (matchJE(buffer[0]))
+    else if (strcmp(argv[i], "-sparse-dump") == 0)
     {
-      cpu.instruction.op = JE;
-      parseJump(&cpu.instruction.operands[0], &buffer, "je");
+      sparseDump = true;
     }
-    else if (matchJL(buffer[0]))
+    else if (strcmp(argv[i], "-8088") == 0)
     {
-      cpu.instruction.op = JL;
-      parseJump(&cpu.instruction.operands[0], &buffer, "jl");
+      bus8088 = true;
     }
-    else if (matchJLE(buffer[0]))
+    else if (strcmp(argv[i], "-profile") == 0)
     {
-      cpu.instruction.op = JLE;
-      parseJump(&cpu.instruction.operands[0], &buffer, "jle");
+      profile = true;
     }
-    else if (matchJB(buffer[0]))
+    else if (strcmp(argv[i], "-op-histogram") == 0 && i + 1 < argc)
     {
-      cpu.instruction.op = JB;
-      parseJump(&cpu.instruction.operands[0], &buffer, "jb");
+      mixCsvName = argv[++i];
     }
-    else if (matchJBE(buffer[0]))
+    else if (strcmp(argv[i], "-pipeline") == 0)
     {
-      cpu.instruction.op = JBE;
-      parseJump(&cpu.instruction.operands[0], &buffer, "jbe");
+      pipeline = true;
     }
-    else if (matchJP(buffer[0]))
+    else if (strcmp(argv[i], "-record") == 0 && i + 1 < argc)
     {
-      cpu.instruction.op = JP;
-      parseJump(&cpu.instruction.operands[0], &buffer, "jp");
+      recordName = argv[++i];
     }
-    else if (matchJO(buffer[0]))
+    else if (strcmp(argv[i], "-replay") == 0 && i + 2 < argc)
     {
-      cpu.instruction.op = JO;
-      parseJump(&cpu.instruction.operands[0], &buffer, "jo");
+      replayName  = argv[++i];
+      replayIndex = strtoull(argv[++i], NULL, 10);
     }
-    else if (matchJS(buffer[0]))
+    else if (strcmp(argv[i], "-watch") == 0 && i + 1 < argc)
     {
-      cpu.instruction.op = JS;
-      parseJump(&cpu.instruction.operands[0], &buffer, "js");
+      if (!parseWatchpoint(argv[++i], &memoryWatch))
+      {
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "-mem-histogram") == 0)
+    {
+      memoryWatch.histogram = true;
+      memset(memoryWatch.pages, 0xFF, sizeof(memoryWatch.pages));
+    }
+    else if (strcmp(argv[i], "-estimate") == 0)
+    {
+      estimate = true;
+    }
+    else if (strcmp(argv[i], "-trips") == 0 && i + 1 < argc)
+    {
+      if (!parseTripCounts(argv[++i], tripCounts, &tripCount))
+      {
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+    {
+      threadCount = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "-load") == 0 && i + 1 < argc)
+    {
+      if (!parseLoadAddress(argv[++i], &loadAddress))
+      {
+        return 1;
+      }
     }
-    else if (matchJNE(buffer[0]))
+    else
     {
-      cpu.instruction.op = JNZ;
-      parseJump(&cpu.instruction.operands[0], &buffer, "jne");
+      name                 = argv[i];
+      inputs[inputCount++] = argv[i];
     }
-    else if (matchJNL(buffer[0]))
+  }
+
+  if (benchDecode || streamName)
+  {
+    InstructionMix mix = instructionMixes[0];
+    free(inputs);
+    if (mixName && !parseInstructionMix(mixName, &mix))
     {
-      cpu.instruction.op = JNL;
-      parseJump(&cpu.instruction.operands[0], &buffer, "jnl");
+      return 1;
     }
-    else if (matchJNLE(buffer[0]))
+    if (benchDecode)
     {
-      cpu.instruction.op = JNLE;
-      parseJump(&cpu.instruction.operands[0], &buffer, "jnle");
+      benchmarkDecode(mixName ? &mix : NULL, seed);
+      return 0;
     }
-    else if (matchJNB(buffer[0]))
+    return writeInstructionStream(streamName, &mix, seed, streamSize) ? 0 : 1;
+  }
+
+  if (batch)
+  {
+    runBatch(inputs, inputCount, threadCount, loadAddress);
+    free(inputs);
+    return 0;
+  }
+  free(inputs);
+
+  if (replayName)
+  {
+    TraceReplay replay;
+    if (!loadTrace(&replay, replayName))
     {
-      cpu.instruction.op = JNB;
-      parseJump(&cpu.instruction.operands[0], &buffer, "jnb");
+      return 1;
     }
-    else if (matchJNBE(buffer[0]))
+    seekTrace(&replay, replayIndex);
+    printf("Instruction %lu of %lu, ip: 0x%04x\n", replay.index, replay.count, replay.ip);
+    debugRegisters(replay.cpu->registers);
+    printf("\tflags:");
+    debugFlags(replay.cpu->flags);
+    printf("\n\tcycles: %lu\n", replay.cpu->cycles);
+    writeMemoryDump(replay.cpu, sparseDump);
+    freeTraceReplay(&replay);
+    return 0;
+  }
+
+  ProgramImage image;
+  if (!mapProgramImage(&image, name))
+  {
+    printf("Failed to read file '%s'\n", name);
+    return 1;
+  }
+  ui8* buffer = image.bytes;
+  ui32 len    = image.length;
+  // printf("; %s.asm\n", name);
+  // printf("bits 16\n\n");
+
+  if (disasm && parallel)
+  {
+    ui32         chunkCount;
+    DisasmChunk* chunks  = disassembleParallel(buffer, len, threadCount, &chunkCount);
+    bool         written = writeDisasmChunks(chunks, chunkCount, STDOUT_FILENO);
+    freeDisasmChunks(chunks, chunkCount);
+    unmapProgramImage(&image);
+    return written ? 0 : 1;
+  }
+
+  if (disasm)
+  {
+    Instruction* instructions = (Instruction*)malloc(sizeof(Instruction) * len);
+    OutputBuffer output       = {0};
+    disassemble(buffer, len, instructions, &output);
+    bool written = flushOutput(&output, STDOUT_FILENO);
+    free(output.data);
+    free(instructions);
+    unmapProgramImage(&image);
+    return written ? 0 : 1;
+  }
+
+  if (estimate)
+  {
+    estimateCycles(buffer, len, tripCounts, tripCount, bus8088);
+    unmapProgramImage(&image);
+    return 0;
+  }
+
+  if (benchExec)
+  {
+    benchmarkExecution(&image, loadAddress);
+    unmapProgramImage(&image);
+    return 0;
+  }
+
+  RegisterFile registers;
+  CPU          cpu;
+  initCPU(&cpu, &registers);
+  if (!loadProgram(&cpu, &image, loadAddress))
+  {
+    return 1;
+  }
+  cpu.bus8088 = bus8088;
+  if ((profile || mixCsvName) && (threaded || jit))
+  {
+    printf("Profiling only runs on the interpreter\n");
+    profile    = false;
+    mixCsvName = NULL;
+  }
+  if (recordName && (threaded || jit))
+  {
+    printf("Traces are only recorded by the interpreter\n");
+    recordName = NULL;
+  }
+  bool watching = memoryWatch.watchpointCount || memoryWatch.histogram;
+  if (watching && (threaded || jit))
+  {
+    printf("Watchpoints only run on the interpreter\n");
+    watching = false;
+  }
+
+  if (threaded)
+  {
+    ThreadedProgram program;
+    if (!translateThreadedProgram(&cpu, &program, cpu.start, len))
     {
-      cpu.instruction.op = JNBE;
-      parseJump(&cpu.instruction.operands[0], &buffer, "jnbe");
+      return 1;
     }
-    else if (matchJNP(buffer[0]))
+    f64  start  = readTime();
+    ui64 cycles = runThreadedProgram(&cpu, &program);
+    printFinalState(&cpu, cycles, readTime() - start);
+    free(program.instructions);
+  }
+  else if (jit)
+  {
+    Jit          jitState;
+    RegisterFile shadowRegisters;
+    CPU*         shadow = NULL;
+    if (!initJit(&jitState, &cpu))
     {
-      cpu.instruction.op = JP;
-      parseJump(&cpu.instruction.operands[0], &buffer, "jp");
+      return 1;
     }
-    else if (matchJNO(buffer[0]))
+    if (jitCheck)
     {
-      cpu.instruction.op = JNO;
-      parseJump(&cpu.instruction.operands[0], &buffer, "jno");
+      shadow = (CPU*)malloc(sizeof(CPU));
+      initCPU(shadow, &shadowRegisters);
+      if (!loadProgram(shadow, &image, loadAddress))
+      {
+        return 1;
+      }
+      shadow->bus8088 = bus8088;
     }
-    else if (matchJNS(buffer[0]))
+    f64  start  = readTime();
+    ui64 cycles = runJit(&jitState, &cpu, shadow);
+    printFinalState(&cpu, cycles, readTime() - start);
+    freeJit(&jitState);
+    if (shadow)
     {
-      cpu.instruction.op = JNS;
-      parseJump(&cpu.instruction.operands[0], &buffer, "jns");
+      freeCPU(shadow);
+      free(shadow);
     }
-    else if (matchLoop(buffer[0]))
+  }
+  else
+  {
+    if (profile || mixCsvName)
     {
-      cpu.instruction.op = LOOP;
-      parseJump(&cpu.instruction.operands[0], &buffer, "loop");
+      initProfile(&cpu);
     }
-    else if (matchLoopz(buffer[0]))
+    if (watching)
     {
-      cpu.instruction.op = LOOPZ;
-      parseJump(&cpu.instruction.operands[0], &buffer, "loopz");
+      cpu.watch = &memoryWatch;
     }
-    else if (matchLoopnz(buffer[0]))
+    TraceRecorder recorder;
+    if (recordName)
     {
-      cpu.instruction.op = LOOPNZ;
-      parseJump(&cpu.instruction.operands[0], &buffer, "loopnz");
+      if (!startTraceRecorder(&recorder, &cpu, recordName))
+      {
+        return 1;
+      }
+      cpu.recorder = &recorder;
     }
-    else if (matchJCXZ(buffer[0]))
+    if (pipeline)
     {
-      cpu.instruction.op = JCXZ;
-      parseJump(&cpu.instruction.operands[0], &buffer, "jcxz");
+      runPipelinedInterpreter(&cpu);
     }
     else
     {
-      printf("UNKNOWN INSTRUCTION ");
-      debugByte(buffer[0]);
-      exit(1);
+      runInterpreter(&cpu, true);
+    }
+    if (recordName)
+    {
+      cpu.recorder = NULL;
+      finishTraceRecorder(&recorder, &cpu);
+    }
+    if (profile)
+    {
+      printProfile(&cpu);
+    }
+    if (mixCsvName)
+    {
+      printOperationHistogram(&cpu, mixCsvName);
+    }
+    free(cpu.profileCycles);
+    free(cpu.profileCounts);
+    if (watching)
+    {
+      printMemoryWatch(&memoryWatch);
+      cpu.watch = NULL;
+      free(memoryWatch.counts);
     }
-    buffer++;
-    executeInstruction(&cpu, cpu.instruction, &buffer);
-    debugInstruction(&cpu, buffer);
+  }
 
-    cpu.prevFlags = cpu.flags;
-    cpu.prev      = buffer;
+  if (cpu.halted)
+  {
+    printf("UNKNOWN INSTRUCTION ");
+    debugByte(cpu.prev[0]);
+    return 1;
   }
-  FILE* filePtr;
-  filePtr = fopen("test.data", "w");
-  fwrite(cpu.memory, MEMORY_SIZE, 1, filePtr);
-  fclose(filePtr);
+  writeMemoryDump(&cpu, sparseDump);
+  freeCPU(&cpu);
+  unmapProgramImage(&image);
   // printf("Final stuff:\n");
   // debugRegisters(registers);
   // debugIp(&cpu, buffer);
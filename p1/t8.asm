@@ -0,0 +1,68 @@
+bits 16
+
+mov si, 256
+mov di, 512
+mov cx, 16
+mov ax, 16706
+rep stosw
+
+mov di, 256
+mov si, 512
+mov cx, 32
+rep movsb
+
+mov si, 256
+mov di, 512
+mov cx, 32
+repe cmpsb
+
+mov di, 256
+mov cx, 40
+mov ax, 65
+repne scasb
+
+mov di, 256
+mov cx, 40
+mov ax, 66
+repe scasb
+
+std
+mov si, 543
+mov di, 799
+mov cx, 32
+rep movsb
+cld
+
+mov si, 512
+mov di, 513
+mov cx, 8
+rep movsb
+
+mov si, 512
+mov cx, 3
+rep lodsw
+
+mov si, 768
+mov di, 512
+mov cx, 20
+repe cmpsw
+
+std
+mov di, 799
+mov cx, 5
+mov ax, 30583
+rep stosw
+cld
+
+mov si, 769
+mov di, 1025
+movsw
+movsb
+stosb
+lodsb
+scasb
+
+mov di, 65520
+mov cx, 32
+mov ax, 4660
+rep stosb
@@ -2,6 +2,7 @@
 #include "../arena.h"
 #include "common.h"
 #include "files.h"
+#include "powersOfFive.h"
 #include <cfloat>
 #include <cmath>
 #include <cstdio>
@@ -12,15 +13,26 @@
 
 #define ADVANCE(curr) ((*curr)++)
 
+typedef u8* (*FindQuoteOrBackslash)(u8* ptr, u8* end);
+
+struct StructuralIndex;
+
 struct Buffer
 {
-  u8* buffer;
-  u64 curr;
-  u64 len;
+  u8*                  buffer;
+  u64                  curr;
+  u64                  len;
+  bool                 direct;
+  u64                  stretchStart;
+  u64                  stretchEnd;
+  u64                  stretchWhitespace;
+  u32*                 structurals;
+  u64                  next;
+  u64                  count;
+  StructuralIndex*     index;
+  FindQuoteOrBackslash findQuoteOrBackslash;
 };
 
-extern "C" void parseString2(String * key, Buffer * buffer);
-
 static inline u8      getCurrentCharBuffer(Buffer* buffer)
 {
   return buffer->buffer[buffer->curr];
@@ -31,6 +43,330 @@ static inline void advanceBuffer(Buffer* buffer)
   buffer->curr++;
 }
 
+struct BlockMasks
+{
+  u64 quote;
+  u64 backslash;
+  u64 structural;
+  u64 whitespace;
+};
+
+// What a block needs to know about the bytes before it, plus how much whitespace outside of strings they held
+struct IndexCarry
+{
+  u64 escaped;
+  u64 inString;
+  u64 scalar;
+  u64 whitespace;
+};
+
+// Room for the sixteen positions flattenBits writes ahead, stray reads past the last token land on sentinels that point at the terminating '\0'
+#define STRUCTURAL_PADDING 16
+
+// '[' and ']' are '{' and '}' without the 0x20 bit, so or'ing it in covers both brackets with one compare
+__attribute__((target("avx2"), always_inline)) static inline void classifyBlockAvx2(const u8* block, BlockMasks* masks)
+{
+  u32 quote[2], backslash[2], structural[2], whitespace[2];
+  for (i32 i = 0; i < 2; i++)
+  {
+    __m256i input      = _mm256_loadu_si256((const __m256i*)(block + 32 * i));
+    __m256i lower      = _mm256_or_si256(input, _mm256_set1_epi8(0x20));
+    __m256i brackets   = _mm256_or_si256(_mm256_cmpeq_epi8(lower, _mm256_set1_epi8('{')), _mm256_cmpeq_epi8(lower, _mm256_set1_epi8('}')));
+    __m256i separators = _mm256_or_si256(_mm256_cmpeq_epi8(input, _mm256_set1_epi8(':')), _mm256_cmpeq_epi8(input, _mm256_set1_epi8(',')));
+    __m256i spaces     = _mm256_or_si256(_mm256_cmpeq_epi8(input, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(input, _mm256_set1_epi8('\t')));
+    __m256i newlines   = _mm256_or_si256(_mm256_cmpeq_epi8(input, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(input, _mm256_set1_epi8('\r')));
+    quote[i]           = _mm256_movemask_epi8(_mm256_cmpeq_epi8(input, _mm256_set1_epi8('"')));
+    backslash[i]       = _mm256_movemask_epi8(_mm256_cmpeq_epi8(input, _mm256_set1_epi8('\\')));
+    structural[i]      = _mm256_movemask_epi8(_mm256_or_si256(brackets, separators));
+    whitespace[i]      = _mm256_movemask_epi8(_mm256_or_si256(spaces, newlines));
+  }
+  masks->quote      = quote[0] | ((u64)quote[1] << 32);
+  masks->backslash  = backslash[0] | ((u64)backslash[1] << 32);
+  masks->structural = structural[0] | ((u64)structural[1] << 32);
+  masks->whitespace = whitespace[0] | ((u64)whitespace[1] << 32);
+}
+
+static inline void classifyBlockSse2(const u8* block, BlockMasks* masks)
+{
+  *masks = (BlockMasks){0, 0, 0, 0};
+  for (i32 i = 0; i < 4; i++)
+  {
+    __m128i input      = _mm_loadu_si128((const __m128i*)(block + 16 * i));
+    __m128i lower      = _mm_or_si128(input, _mm_set1_epi8(0x20));
+    __m128i brackets   = _mm_or_si128(_mm_cmpeq_epi8(lower, _mm_set1_epi8('{')), _mm_cmpeq_epi8(lower, _mm_set1_epi8('}')));
+    __m128i separators = _mm_or_si128(_mm_cmpeq_epi8(input, _mm_set1_epi8(':')), _mm_cmpeq_epi8(input, _mm_set1_epi8(',')));
+    __m128i spaces     = _mm_or_si128(_mm_cmpeq_epi8(input, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(input, _mm_set1_epi8('\t')));
+    __m128i newlines   = _mm_or_si128(_mm_cmpeq_epi8(input, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(input, _mm_set1_epi8('\r')));
+    masks->quote |= (u64)(u16)_mm_movemask_epi8(_mm_cmpeq_epi8(input, _mm_set1_epi8('"'))) << (16 * i);
+    masks->backslash |= (u64)(u16)_mm_movemask_epi8(_mm_cmpeq_epi8(input, _mm_set1_epi8('\\'))) << (16 * i);
+    masks->structural |= (u64)(u16)_mm_movemask_epi8(_mm_or_si128(brackets, separators)) << (16 * i);
+    masks->whitespace |= (u64)(u16)_mm_movemask_epi8(_mm_or_si128(spaces, newlines)) << (16 * i);
+  }
+}
+
+// Bit i of the result is the xor of bits 0..i, so every byte from an opening quote up to its closing quote is set
+static inline u64 prefixXor(u64 bits)
+{
+  bits ^= bits << 1;
+  bits ^= bits << 2;
+  bits ^= bits << 4;
+  bits ^= bits << 8;
+  bits ^= bits << 16;
+  bits ^= bits << 32;
+  return bits;
+}
+
+// A byte is escaped when an odd length run of backslashes precedes it. Adding the run starts on odd bits to the backslashes
+// carries through each run and flips the parity of where it ends, the carry out of the block continues the run in the next one
+static inline u64 findEscaped(u64 backslash, u64* prevEscaped)
+{
+  const u64 even = 0x5555555555555555ULL;
+  backslash &= ~*prevEscaped;
+  u64 followsEscape     = backslash << 1 | *prevEscaped;
+  u64 oddSequenceStarts = backslash & ~even & ~followsEscape;
+  u64 sequencesStartingOnEvenBits;
+  *prevEscaped          = __builtin_add_overflow(oddSequenceStarts, backslash, &sequencesStartingOnEvenBits);
+  u64 invertMask        = sequencesStartingOnEvenBits << 1;
+  return (even ^ invertMask) & followsEscape;
+}
+
+// Writes positions eight at a time without looking at the count, so the usual block costs no mispredicted branch.
+// Whatever lands past the real positions is overwritten by the next block
+static inline __attribute__((always_inline)) u32* flattenBits(u32* out, u64 base, u64 bits)
+{
+  u32 count = __builtin_popcountll(bits);
+  for (i32 i = 0; i < 8; i++)
+  {
+    out[i] = (u32)(base + __builtin_ctzll(bits));
+    bits &= bits - 1;
+  }
+  if (count > 8)
+  {
+    for (i32 i = 8; i < 16; i++)
+    {
+      out[i] = (u32)(base + __builtin_ctzll(bits));
+      bits &= bits - 1;
+    }
+  }
+  if (count > 16)
+  {
+    for (u32 i = 16; i < count; i++)
+    {
+      out[i] = (u32)(base + __builtin_ctzll(bits));
+      bits &= bits - 1;
+    }
+  }
+  return out + count;
+}
+
+static inline __attribute__((always_inline)) u32* indexBlock(u32* out, u64 base, BlockMasks* masks, IndexCarry* carry)
+{
+  u64 escaped      = findEscaped(masks->backslash, &carry->escaped);
+  u64 quotes       = masks->quote & ~escaped;
+  u64 inString     = prefixXor(quotes) ^ carry->inString;
+  carry->inString  = (u64)((i64)inString >> 63);
+  u64 scalar       = ~(masks->structural | masks->whitespace | quotes | inString);
+  u64 scalarStarts = scalar & ~(scalar << 1 | carry->scalar);
+  carry->scalar    = scalar >> 63;
+  carry->whitespace += __builtin_popcountll(masks->whitespace & ~inString);
+  return flattenBits(out, base, (masks->structural & ~inString) | (quotes & inString) | scalarStarts);
+}
+
+// The block loop is compiled once per instruction set so the classification inlines, every AVX2 cpu also has BMI and popcnt
+__attribute__((target("avx2,bmi,popcnt"))) static u32* indexBlocksAvx2(u32* out, const u8* blocks, u64 blockCount, u64 base, IndexCarry* carry)
+{
+  for (u64 i = 0; i < blockCount; i++)
+  {
+    BlockMasks masks;
+    classifyBlockAvx2(blocks + 64 * i, &masks);
+    out = indexBlock(out, base + 64 * i, &masks, carry);
+  }
+  return out;
+}
+
+static u32* indexBlocksSse2(u32* out, const u8* blocks, u64 blockCount, u64 base, IndexCarry* carry)
+{
+  for (u64 i = 0; i < blockCount; i++)
+  {
+    BlockMasks masks;
+    classifyBlockSse2(blocks + 64 * i, &masks);
+    out = indexBlock(out, base + 64 * i, &masks, carry);
+  }
+  return out;
+}
+
+typedef u32* (*IndexBlocks)(u32* out, const u8* blocks, u64 blockCount, u64 base, IndexCarry* carry);
+
+// The first pass classifies the input 64 bytes at a time into bitmasks and writes out the position of every
+// structural character and opening quote outside of strings plus the first byte of every number and literal,
+// so the tree builder jumps from token to token instead of walking whitespace byte by byte.
+// It runs a window at a time in step with the tree builder, so the positions stay in cache and take the same
+// memory whatever the size of the input
+struct StructuralIndex
+{
+  u32*        positions;
+  u64         count;
+  u64         indexed;
+  u64         windowStart;
+  String      input;
+  IndexCarry  carry;
+  IndexBlocks indexBlocks;
+};
+
+// Input bytes per window, a whole number of blocks
+#define STRUCTURAL_WINDOW (64 * 1024)
+
+// Strings are scanned with vectors either way, so the index only earns its pass over the input where the tree builder
+// would otherwise walk a lot of whitespace. On compact input like the haversine pairs it costs more than it saves,
+// so the input is taken a window at a time and only indexed while the last window was at least this many percent whitespace
+#define STRUCTURAL_MIN_WHITESPACE_PERCENT 50
+
+bool initStructuralIndex(StructuralIndex* index, String input)
+{
+  if (input.len >= UINT32_MAX)
+  {
+    printf("Can't index %ld bytes, positions are 32 bit\n", input.len);
+    return false;
+  }
+  index->positions   = (u32*)malloc(sizeof(u32) * (STRUCTURAL_WINDOW + STRUCTURAL_PADDING));
+  index->count       = 0;
+  index->indexed     = 0;
+  index->windowStart = 0;
+  index->input       = input;
+  index->carry       = (IndexCarry){0, 0, 0, 0};
+  index->indexBlocks = __builtin_cpu_supports("avx2") ? indexBlocksAvx2 : indexBlocksSse2;
+  return true;
+}
+
+// Replaces the positions with the ones from the next window that has any, the inside of a long string can have none.
+// Once the input runs out the window is empty and only holds the sentinels
+void indexNextWindow(StructuralIndex* index)
+{
+  u32* out                = index->positions;
+  index->windowStart      = index->indexed;
+  index->carry.whitespace = 0;
+  while (out == index->positions && index->indexed < index->input.len)
+  {
+    u64 size = index->input.len - index->indexed < STRUCTURAL_WINDOW ? index->input.len - index->indexed : STRUCTURAL_WINDOW;
+    TimeBandwidth("indexNextWindow", size);
+    u64 full = size / 64;
+    out      = index->indexBlocks(out, index->input.buffer + index->indexed, full, index->indexed, &index->carry);
+    if (full * 64 < size)
+    {
+      // the last partial block is padded with whitespace, which can't start a scalar
+      u8 tail[64];
+      memset(tail, ' ', sizeof(tail));
+      memcpy(tail, index->input.buffer + index->indexed + full * 64, size - full * 64);
+      out = index->indexBlocks(out, tail, 1, index->indexed + full * 64, &index->carry);
+    }
+    index->indexed += size;
+  }
+
+  index->count = out - index->positions;
+  for (i32 i = 0; i < STRUCTURAL_PADDING; i++)
+  {
+    out[i] = (u32)index->input.len;
+  }
+}
+
+// Starts indexing again from a position between tokens, nothing before it can be inside a string or a scalar
+void restartStructuralIndex(StructuralIndex* index, u64 position)
+{
+  index->count       = 0;
+  index->indexed     = position;
+  index->windowStart = position;
+  index->carry       = (IndexCarry){0, 0, 0, 0};
+}
+
+// One shift and test instead of four compares, everything above ' ' is out of the mask
+static inline bool isWhitespace(u8 ch)
+{
+  const u64 whitespace = (1ULL << ' ') | (1ULL << '\n') | (1ULL << '\r') | (1ULL << '\t');
+  return ch <= ' ' && ((whitespace >> ch) & 1);
+}
+
+static inline bool isWhitespaceHeavy(u64 whitespace, u64 size)
+{
+  return whitespace * 100 >= size * STRUCTURAL_MIN_WHITESPACE_PERCENT;
+}
+
+// Starts on the whitespace right after the last token, the run is counted towards the choice of scan for the next window
+static inline u8 skipWhitespace(Buffer* buffer, u64 start)
+{
+  u64 curr = start + 1;
+  while (isWhitespace(buffer->buffer[curr]))
+  {
+    curr++;
+  }
+  buffer->stretchWhitespace += curr - start;
+  buffer->curr = curr;
+  return getCurrentCharBuffer(buffer);
+}
+
+static inline u8 indexedToken(Buffer* buffer)
+{
+  buffer->curr = buffer->structurals[buffer->next++];
+  return getCurrentCharBuffer(buffer);
+}
+
+// Runs at the end of every window in either scan and picks the scan for the next one from how much whitespace the last one had
+static u8 nextTokenAfterWindow(Buffer* buffer)
+{
+  StructuralIndex* index    = buffer->index;
+  u64              position = buffer->curr + 1;
+  if (buffer->direct)
+  {
+    if (isWhitespaceHeavy(buffer->stretchWhitespace, position - buffer->stretchStart))
+    {
+      restartStructuralIndex(index, position);
+      buffer->direct = false;
+    }
+  }
+  else if (index->indexed > index->windowStart && !isWhitespaceHeavy(index->carry.whitespace, index->indexed - index->windowStart))
+  {
+    buffer->direct = true;
+  }
+
+  if (buffer->direct)
+  {
+    buffer->stretchStart      = position;
+    buffer->stretchEnd        = position + STRUCTURAL_WINDOW;
+    buffer->stretchWhitespace = 0;
+    buffer->curr              = position;
+    return isWhitespace(getCurrentCharBuffer(buffer)) ? skipWhitespace(buffer, position) : getCurrentCharBuffer(buffer);
+  }
+  indexNextWindow(index);
+  buffer->next  = 0;
+  buffer->count = index->count;
+  return indexedToken(buffer);
+}
+
+// Moves the cursor to the next token. The cursor rests on the last byte of the last token, so in compact input the direct
+// scan usually finds the next one right after it. Windows are only checked for when there's whitespace to skip,
+// input without any never has a reason to switch to the index
+static inline u8 nextToken(Buffer* buffer)
+{
+  if (buffer->direct)
+  {
+    u64 start = buffer->curr + 1;
+    if (!isWhitespace(buffer->buffer[start]))
+    {
+      buffer->curr = start;
+      return getCurrentCharBuffer(buffer);
+    }
+    if (start >= buffer->stretchEnd)
+    {
+      return nextTokenAfterWindow(buffer);
+    }
+    return skipWhitespace(buffer, start);
+  }
+  if (buffer->next == buffer->count)
+  {
+    return nextTokenAfterWindow(buffer);
+  }
+  return indexedToken(buffer);
+}
+
 void debugJsonObject(JsonObject* object);
 void debugJsonArray(JsonArray* arr);
 
@@ -188,6 +524,54 @@ void initJsonObject(Arena* arena, JsonObject* obj)
 void serializeJsonValue(JsonValue* value, FILE* filePtr);
 void serializeJsonObject(JsonObject* object, FILE* filePtr);
 
+// Strings are stored decoded, so quotes, backslashes and control characters have to be escaped again
+void serializeString(String string, FILE* filePtr)
+{
+  fwrite("\"", 1, 1, filePtr);
+  u64 run = 0;
+  for (u64 i = 0; i < string.len; i++)
+  {
+    u8 ch = string.buffer[i];
+    if (ch != '"' && ch != '\\' && ch >= 0x20)
+    {
+      continue;
+    }
+    fwrite(&string.buffer[run], 1, i - run, filePtr);
+    run = i + 1;
+    switch (ch)
+    {
+    case '"':
+    case '\\':
+    {
+      fprintf(filePtr, "\\%c", ch);
+      break;
+    }
+    case '\n':
+    {
+      fwrite("\\n", 1, 2, filePtr);
+      break;
+    }
+    case '\t':
+    {
+      fwrite("\\t", 1, 2, filePtr);
+      break;
+    }
+    case '\r':
+    {
+      fwrite("\\r", 1, 2, filePtr);
+      break;
+    }
+    default:
+    {
+      fprintf(filePtr, "\\u%04x", ch);
+      break;
+    }
+    }
+  }
+  fwrite(&string.buffer[run], 1, string.len - run, filePtr);
+  fwrite("\"", 1, 1, filePtr);
+}
+
 void serializeJsonArray(JsonArray* arr, FILE* filePtr)
 {
   fwrite("[", 1, 1, filePtr);
@@ -207,7 +591,8 @@ void serializeJsonObject(JsonObject* object, FILE* filePtr)
   fwrite("{", 1, 1, filePtr);
   for (i32 i = 0; i < object->size; i++)
   {
-    fprintf(filePtr, "\"%.*s\":", (i32)object->keys[i].len, object->keys[i].buffer);
+    serializeString(object->keys[i], filePtr);
+    fwrite(":", 1, 1, filePtr);
     serializeJsonValue(&object->values[i], filePtr);
     if (i != object->size - 1)
     {
@@ -255,7 +640,7 @@ void serializeJsonValue(JsonValue* value, FILE* filePtr)
   }
   case JSON_STRING:
   {
-    fprintf(filePtr, "\"%.*s\"", (i32)value->string.len, value->string.buffer);
+    serializeString(value->string, filePtr);
     break;
   }
   default:
@@ -302,6 +687,8 @@ bool serializeToFile(Json* json, const char* filename)
   return true;
 }
 
+// The original parser, accumulates error with every fraction digit and goes through pow for exponents.
+// Kept to benchmark against
 inline f64 convertJsonNumber(Buffer* buffer)
 {
   f64 result = 0.0f;
@@ -314,7 +701,7 @@ inline f64 convertJsonNumber(Buffer* buffer)
   return result;
 }
 
-f64 parseNumber(Buffer* buffer)
+f64 parseNumberNaive(Buffer* buffer)
 {
   f64 sign = getCurrentCharBuffer(buffer) == '-' ? -1.0f : 1.0f;
   if (sign == -1.0f)
@@ -350,37 +737,507 @@ f64 parseNumber(Buffer* buffer)
   return sign * result;
 }
 
-void parseString(String* key, Buffer* buffer)
+#define MANTISSA_BITS       52
+#define EXPONENT_BIAS       1023
+#define INFINITE_POWER      0x7FF
+#define MAX_MANTISSA_DIGITS 19
+#define MAX_EXACT_POWER     22
+
+static const f64 exactPowersOfTen[MAX_EXACT_POWER + 1] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static inline bool isDigit(u8 ch)
 {
-  // TimeFunction;
-  advanceBuffer(buffer);
-  u64 start   = buffer->curr;
-  key->buffer = &buffer->buffer[start];
-  while (getCurrentCharBuffer(buffer) != '"')
+  return (u8)(ch - '0') < 10;
+}
+
+static inline u64 loadEightBytes(u8* ptr)
+{
+  u64 chunk;
+  memcpy(&chunk, ptr, sizeof(chunk));
+  return chunk;
+}
+
+// Adding 0x46 pushes anything above '9' into the top bit, subtracting 0x30 borrows into it for anything below '0'.
+// Carries and borrows only travel upwards so the lowest flagged byte is always the first non digit
+static inline u64 nonDigitMask(u64 chunk)
+{
+  return ((chunk + 0x4646464646464646ULL) | (chunk - 0x3030303030303030ULL)) & 0x8080808080808080ULL;
+}
+
+// Combines neighbouring digits into pairs, then pairs into fours and fours into the final value,
+// the first digit is in the lowest byte since we're little endian
+static inline u32 parseEightDigits(u64 chunk)
+{
+  const u64 mask = 0x000000FF000000FFULL;
+  const u64 mul1 = 0x000F424000000064ULL; // 100 + (1000000 << 32)
+  const u64 mul2 = 0x0000271000000001ULL; // 1 + (10000 << 32)
+  chunk -= 0x3030303030303030ULL;
+  chunk = (chunk * 10) + (chunk >> 8);
+  chunk = (((chunk & mask) * mul1) + (((chunk >> 16) & mask) * mul2)) >> 32;
+  return (u32)chunk;
+}
+
+static const u64 integerPowersOfTen[9] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000};
+
+// Accumulates a run of digits into w eight at a time, a partial chunk is shifted up and padded with
+// leading '0's so the number of digits in it doesn't turn into a branch
+static inline u8* parseDigits(u8* ptr, u8* end, u64* w)
+{
+  while (end - ptr >= 8)
   {
-    advanceBuffer(buffer);
+    u64 chunk     = loadEightBytes(ptr);
+    u64 nonDigits = nonDigitMask(chunk);
+    if (nonDigits == 0)
+    {
+      *w = *w * 100000000 + parseEightDigits(chunk);
+      ptr += 8;
+      continue;
+    }
+    u32 count = __builtin_ctzll(nonDigits) >> 3;
+    if (count != 0)
+    {
+      chunk = (chunk << (64 - 8 * count)) | (0x3030303030303030ULL >> (8 * count));
+      *w    = *w * integerPowersOfTen[count] + parseEightDigits(chunk);
+    }
+    return ptr + count;
   }
-  key->len = buffer->curr - start;
+  while (isDigit(*ptr))
+  {
+    *w = 10 * *w + (*ptr - '0');
+    ptr++;
+  }
+  return ptr;
+}
 
-  advanceBuffer(buffer);
+static inline f64 assembleDouble(u64 mantissa, u64 power2, bool negative)
+{
+  u64 bits = mantissa | (power2 << MANTISSA_BITS) | ((u64)negative << 63);
+  f64 result;
+  memcpy(&result, &bits, sizeof(result));
+  return result;
 }
 
-static inline void skipWhitespace(Buffer* buffer)
+// Eisel-Lemire, w * 10^q is computed as w * 5^q * 2^q where 5^q comes from a 128 bit truncated table.
+// With at most 19 digits in w the truncated product always has enough correct bits to round from,
+// so unlike the original algorithm there's no case where we have to give up
+static f64 computeFloat(i64 q, u64 w, bool negative)
 {
-  while (getCurrentCharBuffer(buffer) == ' ' || getCurrentCharBuffer(buffer) == '\n')
+  if (w == 0 || q < POWER_OF_FIVE_MIN)
   {
-    advanceBuffer(buffer);
+    return assembleDouble(0, 0, negative);
   }
+  if (q > POWER_OF_FIVE_MAX)
+  {
+    return assembleDouble(0, INFINITE_POWER, negative);
+  }
+
+  i32        leadingZeroes = __builtin_clzll(w);
+  w <<= leadingZeroes;
+
+  u64        index         = 2 * (q - POWER_OF_FIVE_MIN);
+  __uint128_t product      = (__uint128_t)w * powersOfFive[index];
+  u64        high          = (u64)(product >> 64);
+  u64        low           = (u64)product;
+
+  // Only the bits below the mantissa and the round bit are uncertain, if they're all set the
+  // truncated low half of the power could carry into them
+  const u64  precisionMask = 0xFFFFFFFFFFFFFFFFULL >> (MANTISSA_BITS + 3);
+  if ((high & precisionMask) == precisionMask)
+  {
+    __uint128_t second     = (__uint128_t)w * powersOfFive[index + 1];
+    u64         secondHigh = (u64)(second >> 64);
+    low += secondHigh;
+    if (secondHigh > low)
+    {
+      high++;
+    }
+  }
+
+  i32 upperBit = (i32)(high >> 63);
+  u64 mantissa = high >> (upperBit + 64 - MANTISSA_BITS - 3);
+  // floor(log2(10^q)) = floor(q * log2(10)), exact over the table range
+  i64 power2   = (((152170 + 65536) * q) >> 16) + 63 + upperBit - leadingZeroes + EXPONENT_BIAS;
+
+  if (power2 <= 0)
+  {
+    // Subnormal, shift down to the fixed exponent and round, which might carry us back into normal
+    if (-power2 + 1 >= 64)
+    {
+      return assembleDouble(0, 0, negative);
+    }
+    mantissa >>= -power2 + 1;
+    mantissa += (mantissa & 1);
+    mantissa >>= 1;
+    power2 = (mantissa < (1ULL << MANTISSA_BITS)) ? 0 : 1;
+    return assembleDouble(mantissa & ~(1ULL << MANTISSA_BITS), power2, negative);
+  }
+
+  // Exactly halfway between two doubles, can only happen when 5^q fits in 64 bits and nothing was truncated
+  if (low <= 1 && q >= -4 && q <= 23 && (mantissa & 3) == 1)
+  {
+    if ((mantissa << (upperBit + 64 - MANTISSA_BITS - 3)) == high)
+    {
+      mantissa &= ~1ULL;
+    }
+  }
+
+  mantissa += (mantissa & 1);
+  mantissa >>= 1;
+  if (mantissa >= (2ULL << MANTISSA_BITS))
+  {
+    mantissa = (1ULL << MANTISSA_BITS);
+    power2++;
+  }
+  mantissa &= ~(1ULL << MANTISSA_BITS);
+
+  if (power2 >= INFINITE_POWER)
+  {
+    return assembleDouble(0, INFINITE_POWER, negative);
+  }
+  return assembleDouble(mantissa, power2, negative);
+}
+
+// Parses -?digits(.digits)?([eE][+-]?digits)? into a mantissa of up to 19 significant digits and a power of ten.
+// Relies on the buffer being terminated by a non digit like the rest of the parser
+bool parseNumber(Buffer* buffer, f64* result)
+{
+  u8*  start    = &buffer->buffer[buffer->curr];
+  u8*  end      = &buffer->buffer[buffer->len];
+  u8*  ptr      = start;
+
+  bool negative = *ptr == '-';
+  ptr += negative;
+
+  u8* integer    = ptr;
+  u64 w          = 0;
+  ptr            = parseDigits(ptr, end, &w);
+  i64 digitCount = ptr - integer;
+  if (digitCount == 0)
+  {
+    return false;
+  }
+
+  i64 exponent = 0;
+  if (*ptr == '.')
+  {
+    ptr++;
+    u8* fraction = ptr;
+    ptr          = parseDigits(ptr, end, &w);
+    exponent     = fraction - ptr;
+    if (exponent == 0)
+    {
+      return false;
+    }
+    digitCount -= exponent;
+  }
+
+  if ((*ptr | 0x20) == 'e')
+  {
+    ptr++;
+    bool negativeExponent = *ptr == '-';
+    if (*ptr == '-' || *ptr == '+')
+    {
+      ptr++;
+    }
+    if (!isDigit(*ptr))
+    {
+      return false;
+    }
+    i64 explicitExponent = 0;
+    while (isDigit(*ptr))
+    {
+      // Anything this large is already zero or infinity, just stop it from overflowing
+      if (explicitExponent < 0x10000)
+      {
+        explicitExponent = 10 * explicitExponent + (*ptr - '0');
+      }
+      ptr++;
+    }
+    exponent += negativeExponent ? -explicitExponent : explicitExponent;
+  }
+  buffer->curr = ptr - buffer->buffer;
+
+  if (digitCount > MAX_MANTISSA_DIGITS)
+  {
+    // Leading zeroes don't contribute to w
+    for (u8* digit = integer; *digit == '0' || *digit == '.'; digit++)
+    {
+      digitCount -= *digit == '0';
+    }
+    if (digitCount > MAX_MANTISSA_DIGITS)
+    {
+      *result = strtod((char*)start, NULL);
+      return true;
+    }
+  }
+
+  // Clinger's fast path, both w and the power are exact doubles so a single multiply or divide rounds correctly
+  if (exponent >= -MAX_EXACT_POWER && exponent <= MAX_EXACT_POWER && w <= (1ULL << 53))
+  {
+    f64 value = (f64)w;
+    value     = exponent < 0 ? value / exactPowersOfTen[-exponent] : value * exactPowersOfTen[exponent];
+    *result   = negative ? -value : value;
+    return true;
+  }
+
+  *result = computeFloat(exponent, w, negative);
+  return true;
+}
+
+// Strings are scanned a vector at a time for the closing quote or the first backslash, with a scalar
+// loop for the bytes that don't fill a whole vector before the end of the input
+__attribute__((target("avx2,bmi"))) static u8* findQuoteOrBackslashAvx2(u8* ptr, u8* end)
+{
+  const __m256i quote     = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  while (end - ptr >= 32)
+  {
+    __m256i input = _mm256_loadu_si256((const __m256i*)ptr);
+    u32     mask  = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(input, quote), _mm256_cmpeq_epi8(input, backslash)));
+    if (mask != 0)
+    {
+      return ptr + __builtin_ctz(mask);
+    }
+    ptr += 32;
+  }
+  while (ptr < end && *ptr != '"' && *ptr != '\\')
+  {
+    ptr++;
+  }
+  return ptr;
+}
+
+static u8* findQuoteOrBackslashSse2(u8* ptr, u8* end)
+{
+  const __m128i quote     = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  while (end - ptr >= 16)
+  {
+    __m128i input = _mm_loadu_si128((const __m128i*)ptr);
+    u32     mask  = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(input, quote), _mm_cmpeq_epi8(input, backslash)));
+    if (mask != 0)
+    {
+      return ptr + __builtin_ctz(mask);
+    }
+    ptr += 16;
+  }
+  while (ptr < end && *ptr != '"' && *ptr != '\\')
+  {
+    ptr++;
+  }
+  return ptr;
+}
+
+static inline i32 hexDigit(u8 ch)
+{
+  if (isDigit(ch))
+  {
+    return ch - '0';
+  }
+  ch |= 0x20;
+  if (ch >= 'a' && ch <= 'f')
+  {
+    return ch - 'a' + 10;
+  }
+  return -1;
+}
+
+// Reads the XXXX of \uXXXX, -1 if it isn't four hex digits
+static inline i32 parseHex4(u8* ptr, u8* end)
+{
+  if (end - ptr < 4)
+  {
+    return -1;
+  }
+  i32 codepoint = 0;
+  for (i32 i = 0; i < 4; i++)
+  {
+    i32 digit = hexDigit(ptr[i]);
+    if (digit < 0)
+    {
+      return -1;
+    }
+    codepoint = (codepoint << 4) | digit;
+  }
+  return codepoint;
+}
+
+static inline u8* encodeUtf8(u8* out, u32 codepoint)
+{
+  if (codepoint < 0x80)
+  {
+    *out++ = (u8)codepoint;
+  }
+  else if (codepoint < 0x800)
+  {
+    *out++ = (u8)(0xC0 | (codepoint >> 6));
+    *out++ = (u8)(0x80 | (codepoint & 0x3F));
+  }
+  else if (codepoint < 0x10000)
+  {
+    *out++ = (u8)(0xE0 | (codepoint >> 12));
+    *out++ = (u8)(0x80 | ((codepoint >> 6) & 0x3F));
+    *out++ = (u8)(0x80 | (codepoint & 0x3F));
+  }
+  else
+  {
+    *out++ = (u8)(0xF0 | (codepoint >> 18));
+    *out++ = (u8)(0x80 | ((codepoint >> 12) & 0x3F));
+    *out++ = (u8)(0x80 | ((codepoint >> 6) & 0x3F));
+    *out++ = (u8)(0x80 | (codepoint & 0x3F));
+  }
+  return out;
+}
+
+// Decodes the escape sequence at *ptr (just past the backslash) into out, a surrogate pair has to come as two \u escapes
+static u8* decodeEscape(u8* out, u8** ptr, u8* end)
+{
+  u8 ch = *(*ptr)++;
+  switch (ch)
+  {
+  case '"':
+  case '\\':
+  case '/':
+  {
+    *out++ = ch;
+    return out;
+  }
+  case 'b':
+  {
+    *out++ = '\b';
+    return out;
+  }
+  case 'f':
+  {
+    *out++ = '\f';
+    return out;
+  }
+  case 'n':
+  {
+    *out++ = '\n';
+    return out;
+  }
+  case 'r':
+  {
+    *out++ = '\r';
+    return out;
+  }
+  case 't':
+  {
+    *out++ = '\t';
+    return out;
+  }
+  case 'u':
+  {
+    i32 codepoint = parseHex4(*ptr, end);
+    if (codepoint < 0)
+    {
+      printf("Invalid unicode escape\n");
+      return NULL;
+    }
+    *ptr += 4;
+    if (codepoint >= 0xDC00 && codepoint <= 0xDFFF)
+    {
+      printf("Unpaired low surrogate \\u%04x\n", codepoint);
+      return NULL;
+    }
+    if (codepoint >= 0xD800 && codepoint <= 0xDBFF)
+    {
+      i32 low = end - *ptr >= 2 && (*ptr)[0] == '\\' && (*ptr)[1] == 'u' ? parseHex4(*ptr + 2, end) : -1;
+      if (low < 0xDC00 || low > 0xDFFF)
+      {
+        printf("Unpaired high surrogate \\u%04x\n", codepoint);
+        return NULL;
+      }
+      *ptr += 6;
+      codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + (low - 0xDC00);
+    }
+    return encodeUtf8(out, codepoint);
+  }
+  default:
+  {
+    printf("Invalid escape '\\%c'\n", ch);
+    return NULL;
+  }
+  }
+}
+
+// Only strings with escapes end up here. The first pass finds the closing quote so we know how much
+// room the decoded string could need, every escape decodes to fewer bytes than it was written with
+static bool parseEscapedString(Arena* arena, String* string, Buffer* buffer, u8* start, u8* ptr)
+{
+  u8* end   = &buffer->buffer[buffer->len];
+  u8* quote = ptr;
+  while (quote < end && *quote == '\\')
+  {
+    quote = buffer->findQuoteOrBackslash(quote + 2, end);
+  }
+  if (quote >= end)
+  {
+    printf("Unterminated string\n");
+    return false;
+  }
+
+  u64 rawLength = quote - start;
+  u8* decoded   = ArenaPushArray(arena, u8, rawLength);
+  u8* out       = decoded;
+  u8* run       = start;
+  while (ptr < quote)
+  {
+    memcpy(out, run, ptr - run);
+    out += ptr - run;
+    ptr++;
+    out = decodeEscape(out, &ptr, quote);
+    if (!out)
+    {
+      ArenaPop(arena, rawLength);
+      return false;
+    }
+    run = ptr;
+    ptr = buffer->findQuoteOrBackslash(ptr, quote);
+  }
+  memcpy(out, run, quote - run);
+  out += quote - run;
+
+  string->buffer = decoded;
+  string->len    = out - decoded;
+  ArenaPop(arena, rawLength - string->len);
+  buffer->curr = quote - buffer->buffer;
+  return true;
+}
+
+// Strings without escapes are returned as a slice of the input, nothing gets copied
+bool parseString(Arena* arena, String* string, Buffer* buffer)
+{
+  u8* start = &buffer->buffer[buffer->curr + 1];
+  u8* end   = &buffer->buffer[buffer->len];
+  u8* ptr   = buffer->findQuoteOrBackslash(start, end);
+  if (ptr == end)
+  {
+    printf("Unterminated string\n");
+    return false;
+  }
+  if (*ptr == '\\')
+  {
+    return parseEscapedString(arena, string, buffer, start, ptr);
+  }
+  string->buffer = start;
+  string->len    = ptr - start;
+  buffer->curr   = ptr - buffer->buffer;
+  return true;
 }
 
 bool consumeToken(Buffer* buffer, char expected)
 {
-  if (expected != getCurrentCharBuffer(buffer))
+  u8 token = nextToken(buffer);
+  if (expected != token)
   {
-    printf("Expected '%c' but got '%c'\n", expected, getCurrentCharBuffer(buffer));
+    printf("Expected '%c' but got '%c'\n", expected, token);
     return false;
   }
-  advanceBuffer(buffer);
   return true;
 }
 
@@ -392,32 +1249,42 @@ bool parseKeyValuePair(Arena* arena, JsonObject* obj, Buffer* buffer)
   // TimeFunction;
   resizeObject(obj);
 
-  parseString(&obj->keys[obj->size], buffer);
-  skipWhitespace(buffer);
+  if (getCurrentCharBuffer(buffer) != '"')
+  {
+    printf("Expected key but got '%c'\n", getCurrentCharBuffer(buffer));
+    return false;
+  }
+  if (!parseString(arena, &obj->keys[obj->size], buffer))
+  {
+    return false;
+  }
 
   if (!consumeToken(buffer, ':'))
   {
     return false;
   }
 
+  nextToken(buffer);
   bool res = parseJsonValue(arena, &obj->values[obj->size], buffer);
   if (!res)
   {
     return false;
   }
   obj->size++;
-  skipWhitespace(buffer);
   return true;
 }
 
+// Starts on the '{' token and stops on the matching '}'
 bool parseJsonObject(Arena* arena, JsonObject* obj, Buffer* buffer)
 {
   // TimeFunction;
-  advanceBuffer(buffer);
-  skipWhitespace(buffer);
+  u8 token = nextToken(buffer);
+  if (token == '}')
+  {
+    return true;
+  }
 
-  // end or string
-  while (getCurrentCharBuffer(buffer) != '}')
+  for (;;)
   {
     bool res = parseKeyValuePair(arena, obj, buffer);
     if (!res)
@@ -426,23 +1293,31 @@ bool parseJsonObject(Arena* arena, JsonObject* obj, Buffer* buffer)
       return false;
     }
 
-    skipWhitespace(buffer);
-    if (getCurrentCharBuffer(buffer) == ',')
+    token = nextToken(buffer);
+    if (token == '}')
     {
-      advanceBuffer(buffer);
+      return true;
     }
-    skipWhitespace(buffer);
+    if (token != ',')
+    {
+      printf("Expected ',' or '}' but got '%c'\n", token);
+      return false;
+    }
+    nextToken(buffer);
   }
-  advanceBuffer(buffer);
-  return true;
 }
 
+// Starts on the '[' token and stops on the matching ']'
 bool parseJsonArray(Arena* arena, JsonArray* arr, Buffer* buffer)
 {
-  advanceBuffer(buffer);
-  skipWhitespace(buffer);
+  u8 token = nextToken(buffer);
+  if (token == ']')
+  {
+    return true;
+  }
+
   bool res;
-  while (getCurrentCharBuffer(buffer) != ']')
+  for (;;)
   {
     resizeArray(arr);
     res = parseJsonValue(arena, &arr->values[arr->arraySize], buffer);
@@ -451,15 +1326,19 @@ bool parseJsonArray(Arena* arena, JsonArray* arr, Buffer* buffer)
       return false;
     }
     arr->arraySize++;
-    skipWhitespace(buffer);
-    if (getCurrentCharBuffer(buffer) == ',')
+
+    token = nextToken(buffer);
+    if (token == ']')
     {
-      advanceBuffer(buffer);
+      return true;
+    }
+    if (token != ',')
+    {
+      printf("Expected ',' or ']' but got '%c'\n", token);
+      return false;
     }
+    nextToken(buffer);
   }
-  advanceBuffer(buffer);
-
-  return true;
 }
 bool parseKeyword(Buffer* buffer, const char* expected, u8 len)
 {
@@ -473,14 +1352,51 @@ bool parseKeyword(Buffer* buffer, const char* expected, u8 len)
   return true;
 }
 
+// Neither scan looks past the first byte of a scalar, so whatever directly follows one has to be checked here:
+// only whitespace, a structural character or the end of the input may. The cursor then steps back onto the
+// last byte of the scalar, where it rests after every other token
+static bool endsScalar(Buffer* buffer)
+{
+  if (buffer->curr != buffer->len)
+  {
+    switch (getCurrentCharBuffer(buffer))
+    {
+    case ' ':
+    case '\t':
+    case '\n':
+    case '\r':
+    case ',':
+    case ':':
+    case '[':
+    case ']':
+    case '{':
+    case '}':
+    {
+      break;
+    }
+    default:
+    {
+      printf("Unexpected '%c' after value at %ld\n", getCurrentCharBuffer(buffer), buffer->curr);
+      return false;
+    }
+    }
+  }
+  buffer->curr--;
+  return true;
+}
+
 bool parseJsonValue(Arena* arena, JsonValue* value, Buffer* buffer)
 {
   char currentChar = getCurrentCharBuffer(buffer);
-  if (isdigit(currentChar) || currentChar == '-')
+  if (isDigit(currentChar) || currentChar == '-')
   {
-    value->type   = JSON_NUMBER;
-    value->number = parseNumber(buffer);
-    return true;
+    value->type = JSON_NUMBER;
+    if (!parseNumber(buffer, &value->number))
+    {
+      printf("Invalid number at %ld\n", buffer->curr);
+      return false;
+    }
+    return endsScalar(buffer);
   }
 
   switch (currentChar)
@@ -488,14 +1404,17 @@ bool parseJsonValue(Arena* arena, JsonValue* value, Buffer* buffer)
   case '\"':
   {
     value->type = JSON_STRING;
-    parseString(&value->string, buffer);
-    return true;
+    return parseString(arena, &value->string, buffer);
   }
   case '-':
   {
-    value->type   = JSON_NUMBER;
-    value->number = parseNumber(buffer);
-    return true;
+    value->type = JSON_NUMBER;
+    if (!parseNumber(buffer, &value->number))
+    {
+      printf("Invalid number at %ld\n", buffer->curr);
+      return false;
+    }
+    return endsScalar(buffer);
   }
   case '{':
   {
@@ -516,7 +1435,7 @@ bool parseJsonValue(Arena* arena, JsonValue* value, Buffer* buffer)
       value->type = JSON_BOOL;
       value->b    = true;
       buffer->curr += 4;
-      return true;
+      return endsScalar(buffer);
     }
     printf("Got 't' but wasn't true?\n");
     return false;
@@ -528,7 +1447,7 @@ bool parseJsonValue(Arena* arena, JsonValue* value, Buffer* buffer)
       value->type = JSON_BOOL;
       value->b    = false;
       buffer->curr += 5;
-      return true;
+      return endsScalar(buffer);
     }
     printf("Got 'f' but wasn't false?\n");
     return false;
@@ -539,7 +1458,7 @@ bool parseJsonValue(Arena* arena, JsonValue* value, Buffer* buffer)
     {
       value->type = JSON_NULL;
       buffer->curr += 4;
-      return true;
+      return endsScalar(buffer);
     }
     printf("Got 'n' but wasn't null?\n");
     return false;
@@ -555,63 +1474,69 @@ bool parseJsonValue(Arena* arena, JsonValue* value, Buffer* buffer)
 bool deserializeFromString(Json* json, Arena* arena, String fileContent)
 {
   // TimeFunction;
-  bool   res;
-  bool   first = false;
+  bool            res;
+  StructuralIndex index;
+  if (!initStructuralIndex(&index, fileContent))
+  {
+    return false;
+  }
 
   Buffer buffer;
-  buffer.buffer = (u8*)fileContent.buffer;
-  buffer.curr   = 0;
-  buffer.len    = fileContent.len;
+  buffer.buffer               = (u8*)fileContent.buffer;
+  buffer.curr                 = UINT64_MAX;
+  buffer.len                  = fileContent.len;
+  buffer.direct               = true;
+  buffer.stretchStart         = 0;
+  buffer.stretchEnd           = STRUCTURAL_WINDOW;
+  buffer.stretchWhitespace    = 0;
+  buffer.structurals          = index.positions;
+  buffer.next                 = 0;
+  buffer.count                = 0;
+  buffer.index                = &index;
+  buffer.findQuoteOrBackslash = __builtin_cpu_supports("avx2") ? findQuoteOrBackslashAvx2 : findQuoteOrBackslashSse2;
 
-  while (!first)
   {
-    switch (getCurrentCharBuffer(&buffer))
+    TimeBandwidth("parseJsonValue", fileContent.len);
+    switch (nextToken(&buffer))
     {
     case '{':
     {
       json->headType = JSON_OBJECT;
       initJsonObject(arena, &json->obj);
-      res   = parseJsonObject(arena, &json->obj, &buffer);
-      first = true;
+      res = parseJsonObject(arena, &json->obj, &buffer);
       break;
     }
     case '[':
     {
       json->headType = JSON_ARRAY;
       initJsonArray(arena, &json->array);
-      res   = parseJsonArray(arena, &json->array, &buffer);
-      first = true;
-      break;
-    }
-    case ' ':
-    {
-    }
-    case '\n':
-    {
-    }
-    case '\t':
-    {
-      advanceBuffer(&buffer);
+      res = parseJsonArray(arena, &json->array, &buffer);
       break;
     }
     default:
     {
-      printf("Default: %c\n", getCurrentCharBuffer(&buffer));
       json->headType = JSON_VALUE;
       res            = parseJsonValue(arena, &json->value, &buffer);
-      first          = true;
       break;
     }
     }
   }
+
+  // the rest of the input still has to be free of tokens
+  if (res)
+  {
+    nextToken(&buffer);
+  }
+  free(index.positions);
+
   if (!res)
   {
     printf("Failed to parse something\n");
     return false;
   }
-  if (buffer.curr != fileContent.len)
+  if (buffer.curr != buffer.len)
   {
-    printf("Didn't reach eof after parsing first value? %ld %ld\n", buffer.curr, fileContent.len);
+    printf("Didn't reach eof after parsing first value? %ld %ld\n", buffer.curr, buffer.len);
     return false;
   }
   return true;
@@ -694,3 +1619,112 @@ void freeJson(Json* json)
   }
   }
 }
+
+#define NUMBER_BENCHMARK_REPETITIONS 10
+
+// Finds every number through the structural index, checks that parseNumber agrees with strtod
+// down to the bit and then times the old parser, the new one and strtod over the same numbers
+bool benchmarkNumbers(String content)
+{
+  StructuralIndex index;
+  if (!initStructuralIndex(&index, content))
+  {
+    return false;
+  }
+
+  u64  capacity    = 1024;
+  u32* numbers     = (u32*)malloc(sizeof(u32) * capacity);
+  u64  numberCount = 0;
+  do
+  {
+    indexNextWindow(&index);
+    for (u64 i = 0; i < index.count; i++)
+    {
+      u8 ch = content.buffer[index.positions[i]];
+      if (!isDigit(ch) && ch != '-')
+      {
+        continue;
+      }
+      if (numberCount == capacity)
+      {
+        capacity *= 2;
+        numbers = (u32*)realloc(numbers, sizeof(u32) * capacity);
+      }
+      numbers[numberCount++] = index.positions[i];
+    }
+  } while (index.count);
+  free(index.positions);
+
+  Buffer buffer;
+  buffer.buffer = (u8*)content.buffer;
+  buffer.len    = content.len;
+
+  u64 mismatches = 0;
+  for (u64 i = 0; i < numberCount; i++)
+  {
+    f64 parsed;
+    buffer.curr = numbers[i];
+    if (!parseNumber(&buffer, &parsed))
+    {
+      printf("Invalid number at %d\n", numbers[i]);
+      mismatches++;
+      continue;
+    }
+    f64 expected = strtod((char*)&content.buffer[numbers[i]], NULL);
+    if (memcmp(&parsed, &expected, sizeof(f64)) != 0)
+    {
+      if (mismatches < 10)
+      {
+        printf("Mismatch at %d: %.*s got %.17g expected %.17g\n", numbers[i], (i32)(buffer.curr - numbers[i]), &content.buffer[numbers[i]],
+               parsed, expected);
+      }
+      mismatches++;
+    }
+  }
+  printf("Checked %ld numbers against strtod, %ld mismatches\n", numberCount, mismatches);
+
+  u64 cpuFreq   = EstimateCPUTimerFreq();
+  u64 best[3]   = {~0ULL, ~0ULL, ~0ULL};
+  f64 sums[3]   = {};
+  for (i32 repetition = 0; repetition < NUMBER_BENCHMARK_REPETITIONS; repetition++)
+  {
+    u64 start = ReadCPUTimer();
+    for (u64 i = 0; i < numberCount; i++)
+    {
+      buffer.curr = numbers[i];
+      sums[0] += parseNumberNaive(&buffer);
+    }
+    u64 elapsed = ReadCPUTimer() - start;
+    best[0]     = elapsed < best[0] ? elapsed : best[0];
+
+    start       = ReadCPUTimer();
+    for (u64 i = 0; i < numberCount; i++)
+    {
+      f64 parsed;
+      buffer.curr = numbers[i];
+      parseNumber(&buffer, &parsed);
+      sums[1] += parsed;
+    }
+    elapsed = ReadCPUTimer() - start;
+    best[1] = elapsed < best[1] ? elapsed : best[1];
+
+    start   = ReadCPUTimer();
+    for (u64 i = 0; i < numberCount; i++)
+    {
+      sums[2] += strtod((char*)&content.buffer[numbers[i]], NULL);
+    }
+    elapsed = ReadCPUTimer() - start;
+    best[2] = elapsed < best[2] ? elapsed : best[2];
+  }
+
+  const char* names[3] = {"naive", "parseNumber", "strtod"};
+  for (i32 i = 0; i < 3; i++)
+  {
+    f64 seconds = best[i] / (f64)cpuFreq;
+    printf("%-12s %8.2f Mnumbers/s %6.2f ns/number (sum %.6f)\n", names[i], numberCount / seconds / 1e6, seconds * 1e9 / numberCount,
+           sums[i] / NUMBER_BENCHMARK_REPETITIONS);
+  }
+
+  free(numbers);
+  return mismatches == 0;
+}
@@ -75,6 +75,7 @@ void                addElementToJsonArray(Arena* arena, JsonArray* array, JsonVa
 void                initJsonArray(Arena* arena, JsonArray* array);
 void                initJsonObject(Arena* arena, JsonObject* obj);
 bool                deserializeFromString(Arena* arena, Json* json, String fileContent);
+bool                benchmarkNumbers(String content);
 bool                serializeToFile(Json* json, const char* filename);
 void                debugJson(Json* json);
 void                debugJsonArray(JsonArray* array);
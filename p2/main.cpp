@@ -126,9 +126,22 @@ static inline void cleanup(String* string, String* fileContent)
   free(string->buffer);
 }
 
-int main()
+int main(int argc, char** argv)
 {
   initProfiler();
+  if (argc == 3 && strcmp(argv[1], "-bench-numbers") == 0)
+  {
+    String content;
+    if (!ah_ReadFile(&content, argv[2]))
+    {
+      printf("Failed to read file\n");
+      return 1;
+    }
+    bool valid = benchmarkNumbers(content);
+    free(content.buffer);
+    return valid ? 0 : 1;
+  }
+
   u64    stackSize   = ((u64)(1024 * 1024 * 1024)) * 3;
   u8*    stackMemory = (u8*)malloc(sizeof(u8) * stackSize);
 